@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+void BitBangPins::attach(int miso, int mosi, int sck) {
+	_miso = miso;
+	_mosi = mosi;
+	_sck = sck;
+	_misoPort = (volatile p32_ioport *)portRegisters(digitalPinToPort(miso));
+	_mosiPort = (volatile p32_ioport *)portRegisters(digitalPinToPort(mosi));
+	_sckPort = (volatile p32_ioport *)portRegisters(digitalPinToPort(sck));
+	_misoMask = digitalPinToBitMask(miso);
+	_mosiMask = digitalPinToBitMask(mosi);
+	_sckMask = digitalPinToBitMask(sck);
+}
+
+void BitBangPins::begin() {
+	// pinMode also takes care of any analog function sharing the pin.
+	pinMode(_mosi, OUTPUT);
+	pinMode(_miso, INPUT);
+	pinMode(_sck, OUTPUT);
+	mosiHigh();
+	sckLow();
+}
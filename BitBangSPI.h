@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The BitBangSPI classes provide a software SPI master for devices wired
+ *  to pins without a hardware SPI peripheral.  The pins are resolved to their
+ *  port registers and bit masks once, and whole blocks are clocked through
+ *  unrolled loops that touch nothing but those registers.
+ *
+ *  PinBitBangSPI resolves the pins at run time from their pin numbers.
+ *  PortBitBangSPI takes the port base addresses and bit masks as template
+ *  parameters so every register access compiles down to a constant address:
+ *
+ *      PortBitBangSPI<_PORTF_BASE_ADDRESS, 1 << 4,   // MISO
+ *                     _PORTF_BASE_ADDRESS, 1 << 5,   // MOSI
+ *                     _PORTF_BASE_ADDRESS, 1 << 6>   // SCK
+ *                     sdspi;
+ *      SDCard sd(sdspi, 10);
+ *
+ *  Data is clocked in SPI mode 0, MSB first.
+ */
+
+#ifndef _BITBANGSPI_H
+#define _BITBANGSPI_H
+
+#if (ARDUINO >= 100)
+# include <Arduino.h>
+#else
+# include <WProgram.h>
+#endif
+
+/*! Delay, in microseconds, of each half clock in slow mode.  Slow mode is
+ *  used while a card is being initialized and must be clocked at no more
+ *  than 400kHz.
+ */
+#define BITBANG_SLOW_DELAY 2
+
+class BitBangSPI {
+protected:
+	bool _slow;
+
+public:
+	BitBangSPI() : _slow(true) {}
+
+	/*! Configure the pins and park the clock low */
+	virtual void begin() = 0;
+
+	/*! Send one byte and return the byte received at the same time */
+	virtual uint8_t transfer(uint8_t out) = 0;
+
+	/*! Receive a block of data, sending 0xFF for each byte */
+	virtual void receive(uint8_t *data, size_t len) = 0;
+
+	/*! Send a block of data, discarding whatever comes back */
+	virtual void send(const uint8_t *data, size_t len) = 0;
+
+	/*! Select between the slow (initialization) and full speed clock */
+	void setSlow(bool slow) { _slow = slow; }
+};
+
+/*! Pin access for run-time selected pins. */
+class BitBangPins {
+private:
+	int _miso;
+	int _mosi;
+	int _sck;
+	volatile p32_ioport *_misoPort;
+	volatile p32_ioport *_mosiPort;
+	volatile p32_ioport *_sckPort;
+	uint32_t _misoMask;
+	uint32_t _mosiMask;
+	uint32_t _sckMask;
+
+public:
+	void attach(int miso, int mosi, int sck);
+	void begin();
+
+	inline bool miso() { return (_misoPort->port.reg & _misoMask) != 0; }
+	inline void mosiHigh() { _mosiPort->lat.set = _mosiMask; }
+	inline void mosiLow() { _mosiPort->lat.clr = _mosiMask; }
+	inline void sckHigh() { _sckPort->lat.set = _sckMask; }
+	inline void sckLow() { _sckPort->lat.clr = _sckMask; }
+};
+
+/*! Pin access for pins fixed at compile time.  The PORT parameters are the
+ *  base addresses of the port register blocks (the TRISx register), the
+ *  MASK parameters the bit within the port.
+ */
+template <uint32_t MISO_PORT, uint32_t MISO_MASK,
+          uint32_t MOSI_PORT, uint32_t MOSI_MASK,
+          uint32_t SCK_PORT, uint32_t SCK_MASK>
+class StaticBitBangPins {
+private:
+	static inline volatile p32_ioport *port(uint32_t addr) { return (volatile p32_ioport *)addr; }
+
+public:
+	void begin() {
+		port(MISO_PORT)->tris.set = MISO_MASK;
+		port(MOSI_PORT)->tris.clr = MOSI_MASK;
+		port(SCK_PORT)->tris.clr = SCK_MASK;
+		mosiHigh();
+		sckLow();
+	}
+
+	inline bool miso() { return (port(MISO_PORT)->port.reg & MISO_MASK) != 0; }
+	inline void mosiHigh() { port(MOSI_PORT)->lat.set = MOSI_MASK; }
+	inline void mosiLow() { port(MOSI_PORT)->lat.clr = MOSI_MASK; }
+	inline void sckHigh() { port(SCK_PORT)->lat.set = SCK_MASK; }
+	inline void sckLow() { port(SCK_PORT)->lat.clr = SCK_MASK; }
+};
+
+// One full bit: drive MOSI, clock it in, sample MISO, drop the clock.
+#define BITBANG_XFER_BIT(N) \
+	if (out & (1 << N)) { _pins.mosiHigh(); } else { _pins.mosiLow(); } \
+	_pins.sckHigh(); \
+	if (_pins.miso()) { in |= (1 << N); } \
+	_pins.sckLow();
+
+// Receive only: MOSI is already held high.
+#define BITBANG_RECV_BIT(N) \
+	_pins.sckHigh(); \
+	if (_pins.miso()) { in |= (1 << N); } \
+	_pins.sckLow();
+
+// Send only: MISO is never sampled.
+#define BITBANG_SEND_BIT(N) \
+	if (out & (1 << N)) { _pins.mosiHigh(); } else { _pins.mosiLow(); } \
+	_pins.sckHigh(); \
+	_pins.sckLow();
+
+/*! The bit-bang engine proper, specialized on the pin access class. */
+template <class Pins>
+class BitBangSPIEngine : public BitBangSPI {
+protected:
+	Pins _pins;
+
+	uint8_t slowByte(uint8_t out) {
+		uint8_t in = 0;
+		for (int i = 7; i >= 0; i--) {
+			if (out & (1 << i)) {
+				_pins.mosiHigh();
+			} else {
+				_pins.mosiLow();
+			}
+			delayMicroseconds(BITBANG_SLOW_DELAY);
+			_pins.sckHigh();
+			if (_pins.miso()) {
+				in |= (1 << i);
+			}
+			delayMicroseconds(BITBANG_SLOW_DELAY);
+			_pins.sckLow();
+		}
+		return in;
+	}
+
+	inline uint8_t fastByte(uint8_t out) {
+		uint8_t in = 0;
+		BITBANG_XFER_BIT(7) BITBANG_XFER_BIT(6) BITBANG_XFER_BIT(5) BITBANG_XFER_BIT(4)
+		BITBANG_XFER_BIT(3) BITBANG_XFER_BIT(2) BITBANG_XFER_BIT(1) BITBANG_XFER_BIT(0)
+		return in;
+	}
+
+	inline uint8_t recvByte() {
+		uint8_t in = 0;
+		BITBANG_RECV_BIT(7) BITBANG_RECV_BIT(6) BITBANG_RECV_BIT(5) BITBANG_RECV_BIT(4)
+		BITBANG_RECV_BIT(3) BITBANG_RECV_BIT(2) BITBANG_RECV_BIT(1) BITBANG_RECV_BIT(0)
+		return in;
+	}
+
+	inline void sendByte(uint8_t out) {
+		BITBANG_SEND_BIT(7) BITBANG_SEND_BIT(6) BITBANG_SEND_BIT(5) BITBANG_SEND_BIT(4)
+		BITBANG_SEND_BIT(3) BITBANG_SEND_BIT(2) BITBANG_SEND_BIT(1) BITBANG_SEND_BIT(0)
+	}
+
+public:
+	void begin() {
+		_pins.begin();
+	}
+
+	uint8_t transfer(uint8_t out) {
+		if (_slow) {
+			return slowByte(out);
+		}
+		return fastByte(out);
+	}
+
+	void receive(uint8_t *data, size_t len) {
+		if (_slow) {
+			while (len--) {
+				*data++ = slowByte(0xFF);
+			}
+			return;
+		}
+		_pins.mosiHigh();
+		while (len >= 4) {
+			data[0] = recvByte();
+			data[1] = recvByte();
+			data[2] = recvByte();
+			data[3] = recvByte();
+			data += 4;
+			len -= 4;
+		}
+		while (len--) {
+			*data++ = recvByte();
+		}
+	}
+
+	void send(const uint8_t *data, size_t len) {
+		if (_slow) {
+			while (len--) {
+				slowByte(*data++);
+			}
+			return;
+		}
+		while (len >= 4) {
+			sendByte(data[0]);
+			sendByte(data[1]);
+			sendByte(data[2]);
+			sendByte(data[3]);
+			data += 4;
+			len -= 4;
+		}
+		while (len--) {
+			sendByte(*data++);
+		}
+		_pins.mosiHigh();
+	}
+};
+
+#undef BITBANG_XFER_BIT
+#undef BITBANG_RECV_BIT
+#undef BITBANG_SEND_BIT
+
+/*! Software SPI on pins chosen at run time. */
+class PinBitBangSPI : public BitBangSPIEngine<BitBangPins> {
+public:
+	PinBitBangSPI() {}
+	PinBitBangSPI(int miso, int mosi, int sck) { _pins.attach(miso, mosi, sck); }
+};
+
+/*! Software SPI on pins fixed at compile time. */
+template <uint32_t MISO_PORT, uint32_t MISO_MASK,
+          uint32_t MOSI_PORT, uint32_t MOSI_MASK,
+          uint32_t SCK_PORT, uint32_t SCK_MASK>
+class PortBitBangSPI : public BitBangSPIEngine<StaticBitBangPins<MISO_PORT, MISO_MASK, MOSI_PORT, MOSI_MASK, SCK_PORT, SCK_MASK> > {
+};
+
+#endif
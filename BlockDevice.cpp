@@ -30,6 +30,28 @@
 
 #include <FileSystem.h>
 
+BlockDevice::BlockDevice() {
+	_cacheHit = 0;
+	_cacheMiss = 0;
+	_cacheMode = CACHE_WRITEBACK;
+	_activityLED = 0;
+	_haveActivityLED = false;
+	_blockSize = 512;
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		_dataCache[i].blockno = 0xFFFFFFFFUL;
+		_dataCache[i].flags = 0;
+		_dataCache[i].data = NULL;
+		_dataCache[i].hit_count = 0;
+		_dataCache[i].last_millis = 0;
+		_systemCache[i].blockno = 0xFFFFFFFFUL;
+		_systemCache[i].flags = 0;
+		_systemCache[i].data = NULL;
+		_systemCache[i].hit_count = 0;
+		_systemCache[i].last_millis = 0;
+	}
+	memset(_partitions, 0, sizeof(_partitions));
+}
+
 void BlockDevice::attachActivityLED(uint8_t pin) {
 	_activityLED = pin;
 	_haveActivityLED = true;
@@ -117,6 +139,9 @@ bool BlockDevice::readBlock(uint32_t block, uint8_t *data) {
 
 	// No room = let's expire the oldest entry and use that.
 	uint32_t max_entry = findExpirableEntry(_dataCache);
+	if (max_entry == 0xFFFFFFFFUL) {
+		return false;
+	}
 
 	// If the found block is dirty then flush it to disk
 	if (_dataCache[max_entry].flags & CACHE_DIRTY) {
@@ -144,7 +169,7 @@ bool BlockDevice::readBlock(uint32_t block, uint8_t *data) {
 bool BlockDevice::readSystemBlock(uint32_t block, uint8_t *data) {
 	// Is it in the cache already?
 	for (int i = 0; i < CACHE_SIZE; i++) {
-		if (_dataCache[i].flags & CACHE_VALID) {
+		if (_systemCache[i].flags & CACHE_VALID) {
 			if (_systemCache[i].blockno == block) {
 				memcpy(data, _systemCache[i].data, _blockSize);
 				_systemCache[i].last_millis = millis();
@@ -179,6 +204,9 @@ bool BlockDevice::readSystemBlock(uint32_t block, uint8_t *data) {
 
 	// No room = let's expire the oldest entry and use that.
 	uint32_t max_entry = findExpirableEntry(_systemCache);
+	if (max_entry == 0xFFFFFFFFUL) {
+		return false;
+	}
 
 	// If the found block is dirty then flush it to disk
 	if (_systemCache[max_entry].flags & CACHE_DIRTY) {
@@ -259,6 +287,9 @@ bool BlockDevice::writeBlock(uint32_t block, uint8_t *data) {
 	}
 
 	uint32_t max_entry = findExpirableEntry(_dataCache);
+	if (max_entry == 0xFFFFFFFFUL) {
+		return false;
+	}
 
 	// If the found block is dirty then flush it to disk
 	if (_dataCache[max_entry].flags & CACHE_DIRTY) {
@@ -344,6 +375,9 @@ bool BlockDevice::writeSystemBlock(uint32_t block, uint8_t *data) {
 	}
 
 	uint32_t max_entry = findExpirableEntry(_systemCache);
+	if (max_entry == 0xFFFFFFFFUL) {
+		return false;
+	}
 
 	// If the found block is dirty then flush it to disk
 	if (_systemCache[max_entry].flags & CACHE_DIRTY) {
@@ -373,6 +407,202 @@ bool BlockDevice::writeSystemBlock(uint32_t block, uint8_t *data) {
 	return true;
 }
 
+bool BlockDevice::readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data) {
+	for (uint32_t i = 0; i < count; i++) {
+		if (!readBlockFromDisk(block + i, data + (i * _blockSize))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void BlockDevice::syncBlocks(uint32_t block, uint32_t count) {
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((_dataCache[i].flags & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY)) {
+			if ((_dataCache[i].blockno >= block) && (_dataCache[i].blockno - block < count)) {
+				switchOnActivityLED();
+				if (writeBlockToDisk(_dataCache[i].blockno, _dataCache[i].data)) {
+					_dataCache[i].flags &= ~CACHE_DIRTY;
+				}
+				switchOffActivityLED();
+			}
+		}
+		if ((_systemCache[i].flags & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY)) {
+			if ((_systemCache[i].blockno >= block) && (_systemCache[i].blockno - block < count)) {
+				switchOnActivityLED();
+				if (writeBlockToDisk(_systemCache[i].blockno, _systemCache[i].data)) {
+					_systemCache[i].flags &= ~CACHE_DIRTY;
+				}
+				switchOffActivityLED();
+			}
+		}
+	}
+}
+
+bool BlockDevice::writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data) {
+	for (uint32_t i = 0; i < count; i++) {
+		if (!writeBlockToDisk(block + i, (uint8_t *)data + (i * _blockSize))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BlockDevice::readBlocks(uint32_t block, uint32_t count, uint8_t *data) {
+	// Make sure the device has the latest copy of anything we have cached.
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((_dataCache[i].flags & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY)) {
+			if ((_dataCache[i].blockno >= block) && (_dataCache[i].blockno < block + count)) {
+				if (writeBlockToDisk(_dataCache[i].blockno, _dataCache[i].data)) {
+					_dataCache[i].flags &= ~CACHE_DIRTY;
+				}
+			}
+		}
+		if ((_systemCache[i].flags & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY)) {
+			if ((_systemCache[i].blockno >= block) && (_systemCache[i].blockno < block + count)) {
+				if (writeBlockToDisk(_systemCache[i].blockno, _systemCache[i].data)) {
+					_systemCache[i].flags &= ~CACHE_DIRTY;
+				}
+			}
+		}
+	}
+
+	switchOnActivityLED();
+	bool ok = readBlocksFromDisk(block, count, data);
+	switchOffActivityLED();
+	return ok;
+}
+
+bool BlockDevice::writeBlocks(uint32_t block, uint32_t count, const uint8_t *data) {
+	// Cached copies are about to be stale - just throw them away.
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (_dataCache[i].flags & CACHE_VALID) {
+			if ((_dataCache[i].blockno >= block) && (_dataCache[i].blockno < block + count)) {
+				_dataCache[i].flags = 0;
+				_dataCache[i].hit_count = 0;
+			}
+		}
+		if (_systemCache[i].flags & CACHE_VALID) {
+			if ((_systemCache[i].blockno >= block) && (_systemCache[i].blockno < block + count)) {
+				_systemCache[i].flags = 0;
+				_systemCache[i].hit_count = 0;
+			}
+		}
+	}
+
+	switchOnActivityLED();
+	bool ok = writeBlocksToDisk(block, count, data);
+	switchOffActivityLED();
+	return ok;
+}
+
+bool BlockDevice::isCached(uint32_t block) {
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((_dataCache[i].flags & CACHE_VALID) && (_dataCache[i].blockno == block)) {
+			return true;
+		}
+		if ((_systemCache[i].flags & CACHE_VALID) && (_systemCache[i].blockno == block)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool BlockDevice::readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+	if ((offset >= _blockSize) || (len > _blockSize - offset)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	// A copy in the system cache may be newer than the one on the device.
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((_systemCache[i].flags & CACHE_VALID) && (_systemCache[i].blockno == block)) {
+			memcpy(data, _systemCache[i].data + offset, len);
+			_cacheHit++;
+			return true;
+		}
+	}
+
+	uint8_t *cached = lockBlock(block);
+	if (cached == NULL) {
+		return false;
+	}
+	memcpy(data, cached + offset, len);
+	unlockBlock(block, false);
+	return true;
+}
+
+uint8_t *BlockDevice::lockBlock(uint32_t block) {
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (_dataCache[i].flags & CACHE_VALID) {
+			if (_dataCache[i].blockno == block) {
+				_dataCache[i].flags |= CACHE_LOCKED;
+				_dataCache[i].last_millis = millis();
+				_dataCache[i].hit_count++;
+				_cacheHit++;
+				return _dataCache[i].data;
+			}
+		}
+	}
+
+	_cacheMiss++;
+
+	int slot = -1;
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (!(_dataCache[i].flags & CACHE_VALID)) {
+			slot = i;
+			break;
+		}
+	}
+
+	if (slot == -1) {
+		uint32_t victim = findExpirableEntry(_dataCache);
+		if (victim == 0xFFFFFFFFUL) {
+			return NULL;
+		}
+		slot = victim;
+		if (_dataCache[slot].flags & CACHE_DIRTY) {
+			switchOnActivityLED();
+			writeBlockToDisk(_dataCache[slot].blockno, _dataCache[slot].data);
+			switchOffActivityLED();
+		}
+		_dataCache[slot].flags = 0;
+	}
+
+	switchOnActivityLED();
+
+	if (!readBlockFromDisk(block, _dataCache[slot].data)) {
+		switchOffActivityLED();
+		return NULL;
+	}
+
+	switchOffActivityLED();
+	_dataCache[slot].blockno = block;
+	_dataCache[slot].last_millis = millis();
+	_dataCache[slot].flags = CACHE_VALID | CACHE_LOCKED;
+	_dataCache[slot].hit_count = 0;
+	return _dataCache[slot].data;
+}
+
+void BlockDevice::unlockBlock(uint32_t block, bool dirty) {
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((_dataCache[i].flags & CACHE_VALID) && (_dataCache[i].blockno == block)) {
+			_dataCache[i].flags &= ~CACHE_LOCKED;
+			if (dirty) {
+				_dataCache[i].flags |= CACHE_DIRTY;
+				if (_cacheMode == CACHE_WRITETHROUGH) {
+					switchOnActivityLED();
+					if (writeBlockToDisk(_dataCache[i].blockno, _dataCache[i].data)) {
+						_dataCache[i].flags &= ~CACHE_DIRTY;
+					}
+					switchOffActivityLED();
+				}
+			}
+			return;
+		}
+	}
+}
+
 void BlockDevice::setCacheMode(uint8_t mode) {
 	_cacheMode = mode;
 
@@ -382,13 +612,20 @@ void BlockDevice::setCacheMode(uint8_t mode) {
 }
 
 
+// Pick the cache entry to throw out to make room: the least used and,
+// out of those, the oldest.  Locked blocks are never picked, and if that's
+// all of them it fails with EBUSY and returns 0xFFFFFFFF.
 uint32_t BlockDevice::findExpirableEntry(struct cache *cache) {
 	uint32_t leastUsedCount = 0xFFFFFFFFUL;
 	uint32_t oldestUsedTime = 0;
-	uint32_t oldestUsedID = 0;
+	uint32_t oldestUsedID = 0xFFFFFFFFUL;
 
-	// First scan through and find the least used count.
+	// First scan through and find the least used count.  Locked
+	// blocks aren't candidates.
 	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (cache[i].flags & CACHE_LOCKED) {
+			continue;
+		}
 		if (cache[i].hit_count < leastUsedCount) {
 			leastUsedCount = cache[i].hit_count;
 		}
@@ -398,14 +635,20 @@ uint32_t BlockDevice::findExpirableEntry(struct cache *cache) {
 
 	// Now scan through and find the one with that count that is oldest.
 	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (cache[i].flags & CACHE_LOCKED) {
+			continue;
+		}
 		if (cache[i].hit_count == leastUsedCount) {
-			if (now - cache[i].last_millis > oldestUsedTime) {
+			if ((oldestUsedID == 0xFFFFFFFFUL) || (now - cache[i].last_millis > oldestUsedTime)) {
 				oldestUsedTime = now - cache[i].last_millis;
 				oldestUsedID = i;
 			}
 		}
 	}
 
+	if (oldestUsedID == 0xFFFFFFFFUL) {
+		errno = EBUSY;
+	}
 	return oldestUsedID;
 }
 
@@ -475,15 +718,14 @@ void BlockDevice::printCacheStats() {
 }
 
 bool BlockDevice::readRelativeBlock(uint8_t partition, uint32_t block, uint8_t *data) {
-	uint32_t offset = _partitions[partition & 0x03].lbastart;
-	uint32_t size = _partitions[partition & 0x03].lbalength;
+	uint32_t offset;
+	uint32_t size;
 
-	if (offset > getCapacity()) {
-		errno = EINVAL;
+	if (!getPartition(partition, &offset, &size)) {
 		return false;
 	}
 
-	if (block > size) {
+	if (block >= size) {
 		errno = EINVAL;
 		return false;
 	}
@@ -492,15 +734,14 @@ bool BlockDevice::readRelativeBlock(uint8_t partition, uint32_t block, uint8_t *
 }
 
 bool BlockDevice::readRelativeSystemBlock(uint8_t partition, uint32_t block, uint8_t *data) {
-	uint32_t offset = _partitions[partition & 0x03].lbastart;
-	uint32_t size = _partitions[partition & 0x03].lbalength;
+	uint32_t offset;
+	uint32_t size;
 
-	if (offset > getCapacity()) {
-		errno = EINVAL;
+	if (!getPartition(partition, &offset, &size)) {
 		return false;
 	}
 
-	if (block > size) {
+	if (block >= size) {
 		errno = EINVAL;
 		return false;
 	}
@@ -509,15 +750,14 @@ bool BlockDevice::readRelativeSystemBlock(uint8_t partition, uint32_t block, uin
 }
 
 bool BlockDevice::writeRelativeBlock(uint8_t partition, uint32_t block, uint8_t *data) {
-	uint8_t offset = _partitions[partition & 0x03].lbastart;
-	uint8_t size = _partitions[partition & 0x03].lbalength;
+	uint32_t offset;
+	uint32_t size;
 
-	if (offset > getCapacity()) {
-		errno = EINVAL;
+	if (!getPartition(partition, &offset, &size)) {
 		return false;
 	}
 
-	if (block > size) {
+	if (block >= size) {
 		errno = EINVAL;
 		return false;
 	}
@@ -526,15 +766,14 @@ bool BlockDevice::writeRelativeBlock(uint8_t partition, uint32_t block, uint8_t
 }
 
 bool BlockDevice::writeRelativeSystemBlock(uint8_t partition, uint32_t block, uint8_t *data) {
-	uint8_t offset = _partitions[partition & 0x03].lbastart;
-	uint8_t size = _partitions[partition & 0x03].lbalength;
+	uint32_t offset;
+	uint32_t size;
 
-	if (offset > getCapacity()) {
-		errno = EINVAL;
+	if (!getPartition(partition, &offset, &size)) {
 		return false;
 	}
 
-	if (block > size) {
+	if (block >= size) {
 		errno = EINVAL;
 		return false;
 	}
@@ -542,6 +781,21 @@ bool BlockDevice::writeRelativeSystemBlock(uint8_t partition, uint32_t block, ui
 	return writeSystemBlock(offset + block, data);
 }
 
+bool BlockDevice::getPartition(uint8_t partition, uint32_t *start, uint32_t *length) {
+	uint32_t offset = _partitions[partition & 0x03].lbastart;
+	uint32_t size = _partitions[partition & 0x03].lbalength;
+	uint32_t capacity = getCapacity();
+
+	if ((size == 0) || (offset >= capacity) || (size > capacity - offset)) {
+		errno = ENODEV;
+		return false;
+	}
+
+	*start = offset;
+	*length = size;
+	return true;
+}
+
 bool BlockDevice::loadPartitionTable() {
 	uint8_t buffer[_blockSize];
 
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The CachedBlockDevice template wraps a device driver in a block cache
+ *  that is sized entirely at compile time.  The cache blocks are arrays
+ *  inside the object, so nothing is ever malloc'd, and the block size and
+ *  slot counts are constants the compiler can fold into the copies and
+ *  lookups:
+ *
+ *      CachedBlockDevice<SDCard, 512, 4, 2> sd(spi, 10);
+ *      Fat fs(sd, 0);
+ *
+ *  The driver is any BlockDevice that leaves caching to BlockDevice and
+ *  just supplies readBlockFromDisk() and friends - SDCard or SPIFlash, say.
+ *  Its constructor arguments are passed straight through.  The device's
+ *  own block size must match BlockSize; if it doesn't, nothing is read and
+ *  the first access fails with EINVAL.
+ *
+ *  The RAM taken by the cache is known when building (CacheBytes below).
+ *  Both slot counts must be at least 1.
+ */
+
+#ifndef _CACHEDBLOCKDEVICE_H
+#define _CACHEDBLOCKDEVICE_H
+
+#include <FileSystem.h>
+
+template <class Driver, size_t BlockSize, uint8_t DataSlots, uint8_t SystemSlots>
+class CachedBlockDevice : public Driver {
+private:
+	struct slot {
+		uint32_t blockno;
+		uint32_t last_millis;
+		uint32_t hit_count;
+		uint8_t flags;
+	};
+
+	struct slot	_dataSlot[DataSlots];
+	struct slot	_systemSlot[SystemSlots];
+	uint8_t		_dataBlock[DataSlots][BlockSize];
+	uint8_t		_systemBlock[SystemSlots][BlockSize];
+
+	uint32_t	_hits;
+	uint32_t	_misses;
+	uint8_t		_mode;
+
+	void clear() {
+		for (uint8_t i = 0; i < DataSlots; i++) {
+			_dataSlot[i].blockno = 0xFFFFFFFFUL;
+			_dataSlot[i].flags = 0;
+			_dataSlot[i].hit_count = 0;
+			_dataSlot[i].last_millis = 0;
+		}
+		for (uint8_t i = 0; i < SystemSlots; i++) {
+			_systemSlot[i].blockno = 0xFFFFFFFFUL;
+			_systemSlot[i].flags = 0;
+			_systemSlot[i].hit_count = 0;
+			_systemSlot[i].last_millis = 0;
+		}
+		_hits = 0;
+		_misses = 0;
+		_mode = CACHE_WRITEBACK;
+	}
+
+	template <uint8_t Slots>
+	static int find(struct slot (&slots)[Slots], uint32_t block) {
+		for (uint8_t i = 0; i < Slots; i++) {
+			if ((slots[i].flags & CACHE_VALID) && (slots[i].blockno == block)) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	bool flush(struct slot &s, uint8_t *data) {
+		if ((s.flags & (CACHE_VALID | CACHE_DIRTY)) != (CACHE_VALID | CACHE_DIRTY)) {
+			return true;
+		}
+		this->switchOnActivityLED();
+		bool ok = this->writeBlockToDisk(s.blockno, data);
+		this->switchOffActivityLED();
+		if (ok) {
+			s.flags &= ~CACHE_DIRTY;
+		}
+		return ok;
+	}
+
+	// Find a slot for a new block: an empty one if there is one, else the
+	// least used, oldest unlocked one, written back first if it is dirty.
+	template <uint8_t Slots>
+	int claim(struct slot (&slots)[Slots], uint8_t (&data)[Slots][BlockSize]) {
+		uint32_t leastUsedCount = 0xFFFFFFFFUL;
+		for (uint8_t i = 0; i < Slots; i++) {
+			if (!(slots[i].flags & CACHE_VALID)) {
+				return i;
+			}
+			if (!(slots[i].flags & CACHE_LOCKED) && (slots[i].hit_count < leastUsedCount)) {
+				leastUsedCount = slots[i].hit_count;
+			}
+		}
+
+		uint32_t now = millis();
+		uint32_t oldestUsedTime = 0;
+		int oldest = -1;
+		for (uint8_t i = 0; i < Slots; i++) {
+			if (!(slots[i].flags & CACHE_LOCKED) && (slots[i].hit_count == leastUsedCount)) {
+				if ((oldest == -1) || (now - slots[i].last_millis > oldestUsedTime)) {
+					oldestUsedTime = now - slots[i].last_millis;
+					oldest = i;
+				}
+			}
+		}
+		if (oldest == -1) {
+			// Everything is locked.
+			errno = EBUSY;
+			return -1;
+		}
+		flush(slots[oldest], data[oldest]);
+		slots[oldest].flags = 0;
+		return oldest;
+	}
+
+	// Return the slot holding a block, reading it in if need be.
+	template <uint8_t Slots>
+	int fetch(struct slot (&slots)[Slots], uint8_t (&data)[Slots][BlockSize], uint32_t block) {
+		int i = find(slots, block);
+		if (i != -1) {
+			slots[i].last_millis = millis();
+			slots[i].hit_count++;
+			_hits++;
+			return i;
+		}
+
+		_misses++;
+		if (this->_blockSize != BlockSize) {
+			errno = EINVAL;
+			return -1;
+		}
+		i = claim(slots, data);
+		if (i == -1) {
+			return -1;
+		}
+
+		this->switchOnActivityLED();
+		bool ok = this->readBlockFromDisk(block, data[i]);
+		this->switchOffActivityLED();
+		if (!ok) {
+			return -1;
+		}
+		slots[i].blockno = block;
+		slots[i].last_millis = millis();
+		slots[i].flags = CACHE_VALID;
+		slots[i].hit_count = 0;
+		return i;
+	}
+
+	template <uint8_t Slots>
+	bool store(struct slot (&slots)[Slots], uint8_t (&data)[Slots][BlockSize], uint32_t block, const uint8_t *from) {
+		int i = find(slots, block);
+		if (i != -1) {
+			slots[i].hit_count++;
+			_hits++;
+		} else {
+			_misses++;
+			if (this->_blockSize != BlockSize) {
+				errno = EINVAL;
+				return false;
+			}
+			i = claim(slots, data);
+			if (i == -1) {
+				return false;
+			}
+			slots[i].blockno = block;
+			slots[i].hit_count = 0;
+		}
+		memcpy(data[i], from, BlockSize);
+		slots[i].last_millis = millis();
+		slots[i].flags |= CACHE_VALID | CACHE_DIRTY;
+		if (_mode == CACHE_WRITETHROUGH) {
+			return flush(slots[i], data[i]);
+		}
+		return true;
+	}
+
+	void printSlots(struct slot *slots, uint8_t count) {
+		Serial.println("ID     Block  Flags  Count  Time");
+		char temp[80];
+		uint32_t now = millis();
+		for (uint8_t i = 0; i < count; i++) {
+			sprintf(temp, "%2d  %8lu  %02x     %5lu  %lu",
+			        i,
+			        (unsigned long)slots[i].blockno,
+			        (unsigned int)slots[i].flags,
+			        (unsigned long)slots[i].hit_count,
+			        (unsigned long)(now - slots[i].last_millis)
+			       );
+			Serial.println(temp);
+		}
+	}
+
+protected:
+	// The blocks live in the arrays above, so the driver mustn't allocate any.
+	void initCacheBlocks() {}
+
+	bool isCached(uint32_t block) {
+		return (find(_dataSlot, block) != -1) || (find(_systemSlot, block) != -1);
+	}
+
+public:
+	/*! Bytes of RAM taken by the cache, blocks and bookkeeping */
+	enum { CacheBytes = (DataSlots + SystemSlots) * (BlockSize + sizeof(struct slot)) };
+
+	CachedBlockDevice() : Driver() { clear(); }
+	template <class A> CachedBlockDevice(A &a) : Driver(a) { clear(); }
+	template <class A> CachedBlockDevice(const A &a) : Driver(a) { clear(); }
+	template <class A, class B> CachedBlockDevice(A &a, B b) : Driver(a, b) { clear(); }
+	template <class A, class B> CachedBlockDevice(const A &a, B b) : Driver(a, b) { clear(); }
+	template <class A, class B, class C> CachedBlockDevice(A &a, B b, C c) : Driver(a, b, c) { clear(); }
+	template <class A, class B, class C> CachedBlockDevice(const A &a, B b, C c) : Driver(a, b, c) { clear(); }
+	template <class A, class B, class C, class D> CachedBlockDevice(A &a, B b, C c, D d) : Driver(a, b, c, d) { clear(); }
+	template <class A, class B, class C, class D> CachedBlockDevice(const A &a, B b, C c, D d) : Driver(a, b, c, d) { clear(); }
+
+	bool readBlock(uint32_t block, uint8_t *data) {
+		int i = fetch(_dataSlot, _dataBlock, block);
+		if (i == -1) {
+			return false;
+		}
+		memcpy(data, _dataBlock[i], BlockSize);
+		return true;
+	}
+
+	bool readSystemBlock(uint32_t block, uint8_t *data) {
+		int i = fetch(_systemSlot, _systemBlock, block);
+		if (i == -1) {
+			return false;
+		}
+		memcpy(data, _systemBlock[i], BlockSize);
+		return true;
+	}
+
+	bool writeBlock(uint32_t block, uint8_t *data) {
+		return store(_dataSlot, _dataBlock, block, data);
+	}
+
+	bool writeSystemBlock(uint32_t block, uint8_t *data) {
+		return store(_systemSlot, _systemBlock, block, data);
+	}
+
+	bool readBlocks(uint32_t block, uint32_t count, uint8_t *data) {
+		// Make sure the device has the latest copy of anything we have cached.
+		for (uint8_t i = 0; i < DataSlots; i++) {
+			if ((_dataSlot[i].blockno >= block) && (_dataSlot[i].blockno < block + count)) {
+				flush(_dataSlot[i], _dataBlock[i]);
+			}
+		}
+		for (uint8_t i = 0; i < SystemSlots; i++) {
+			if ((_systemSlot[i].blockno >= block) && (_systemSlot[i].blockno < block + count)) {
+				flush(_systemSlot[i], _systemBlock[i]);
+			}
+		}
+
+		this->switchOnActivityLED();
+		bool ok = this->readBlocksFromDisk(block, count, data);
+		this->switchOffActivityLED();
+		return ok;
+	}
+
+	bool writeBlocks(uint32_t block, uint32_t count, const uint8_t *data) {
+		// Cached copies are about to be stale - just throw them away.
+		for (uint8_t i = 0; i < DataSlots; i++) {
+			if ((_dataSlot[i].blockno >= block) && (_dataSlot[i].blockno < block + count)) {
+				_dataSlot[i].flags = 0;
+				_dataSlot[i].hit_count = 0;
+			}
+		}
+		for (uint8_t i = 0; i < SystemSlots; i++) {
+			if ((_systemSlot[i].blockno >= block) && (_systemSlot[i].blockno < block + count)) {
+				_systemSlot[i].flags = 0;
+				_systemSlot[i].hit_count = 0;
+			}
+		}
+
+		this->switchOnActivityLED();
+		bool ok = this->writeBlocksToDisk(block, count, data);
+		this->switchOffActivityLED();
+		return ok;
+	}
+
+	bool readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+		if ((offset >= BlockSize) || (len > BlockSize - offset)) {
+			errno = EINVAL;
+			return false;
+		}
+
+		// A copy in the system cache may be newer than the one on the device.
+		int i = find(_systemSlot, block);
+		if (i != -1) {
+			memcpy(data, _systemBlock[i] + offset, len);
+			_hits++;
+			return true;
+		}
+
+		// Let the driver fetch just the bytes if it can.
+		return Driver::readBlockBytes(block, offset, len, data);
+	}
+
+	uint8_t *lockBlock(uint32_t block) {
+		int i = fetch(_dataSlot, _dataBlock, block);
+		if (i == -1) {
+			return NULL;
+		}
+		_dataSlot[i].flags |= CACHE_LOCKED;
+		return _dataBlock[i];
+	}
+
+	void unlockBlock(uint32_t block, bool dirty) {
+		int i = find(_dataSlot, block);
+		if (i == -1) {
+			return;
+		}
+		_dataSlot[i].flags &= ~CACHE_LOCKED;
+		if (dirty) {
+			_dataSlot[i].flags |= CACHE_DIRTY;
+			if (_mode == CACHE_WRITETHROUGH) {
+				flush(_dataSlot[i], _dataBlock[i]);
+			}
+		}
+	}
+
+	void sync() {
+		for (uint8_t i = 0; i < DataSlots; i++) {
+			flush(_dataSlot[i], _dataBlock[i]);
+		}
+		for (uint8_t i = 0; i < SystemSlots; i++) {
+			flush(_systemSlot[i], _systemBlock[i]);
+		}
+	}
+
+	void syncBlocks(uint32_t block, uint32_t count) {
+		for (uint8_t i = 0; i < DataSlots; i++) {
+			if ((_dataSlot[i].blockno >= block) && (_dataSlot[i].blockno - block < count)) {
+				flush(_dataSlot[i], _dataBlock[i]);
+			}
+		}
+		for (uint8_t i = 0; i < SystemSlots; i++) {
+			if ((_systemSlot[i].blockno >= block) && (_systemSlot[i].blockno - block < count)) {
+				flush(_systemSlot[i], _systemBlock[i]);
+			}
+		}
+	}
+
+	void setCacheMode(uint8_t mode) {
+		_mode = mode;
+		if (_mode == CACHE_WRITETHROUGH) {
+			sync();
+		}
+	}
+
+	void printCacheStats() {
+		Serial.print("Cache hits: ");
+		Serial.println(_hits);
+		Serial.print("Cache misses: ");
+		Serial.println(_misses);
+		Serial.print("Cache bytes: ");
+		Serial.println((uint32_t)CacheBytes);
+		Serial.println();
+		Serial.println("Data cache:");
+		printSlots(_dataSlot, DataSlots);
+		Serial.println();
+		Serial.println("System cache:");
+		printSlots(_systemSlot, SystemSlots);
+	}
+
+	size_t getSectorSize() { return BlockSize; }
+};
+
+#endif
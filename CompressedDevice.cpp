@@ -0,0 +1,757 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+// Smallest slot allocation unit.  Units are never smaller than 1/64th of a
+// parent block so that the unit number and count fit in six bits each.
+#define COMPRESS_MIN_UNIT 64
+#define COMPRESS_MAX_UNITS 64
+
+// Remap table entries: parent block in the top 20 bits, then the first
+// unit and the unit count less one in six bits each.
+#define COMPRESS_UNMAPPED 0xFFFFFFFFUL
+#define COMPRESS_ENTRY(block, unit, count) (((block) << 12) | ((unit) << 6) | ((count) - 1))
+#define COMPRESS_BLOCK(entry) ((entry) >> 12)
+#define COMPRESS_UNIT(entry) (((entry) >> 6) & 0x3F)
+#define COMPRESS_COUNT(entry) (((entry) & 0x3F) + 1)
+
+#define COMPRESS_MAGIC 0x44345A4CUL	// "LZ4D"
+#define COMPRESS_NO_HEAD 0xFFFFFFFFUL
+
+// Logical block size.  FAT wants 512.
+#define COMPRESS_SECTOR_SIZE 512
+
+// Slot header: the compressed length, little endian
+#define COMPRESS_SLOT_HEADER 2
+
+// LZ4 match finder: a small hash table of recent positions
+#define LZ4_HASH_BITS 8
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+struct compressheader {
+	uint32_t magic;
+	uint32_t sectors;
+	uint32_t physBlockSize;
+	uint32_t unit;
+} __attribute__((packed));
+
+CompressedDevice::CompressedDevice(BlockDevice &parent, uint32_t sectors) {
+	_parent = &parent;
+	_sectors = sectors;
+	_blockSize = COMPRESS_SECTOR_SIZE;
+	_map = NULL;
+	_mapDirty = NULL;
+	_live = NULL;
+	_committed = NULL;
+	_head = NULL;
+	_headBlock = COMPRESS_NO_HEAD;
+	_headUsed = 0;
+	_headDirty = false;
+	_nextAlloc = 0;
+	_bytesIn = 0;
+	_bytesOut = 0;
+	_compactions = 0;
+	_decompressions = 0;
+	_decompressMicros = 0;
+}
+
+CompressedDevice::~CompressedDevice() {
+	eject();
+}
+
+bool CompressedDevice::initialize() {
+	if (_map != NULL) {
+		// Already running - just make sure everything is on the parent.
+		sync();
+		errno = 0;
+		return true;
+	}
+
+	if (!setup()) {
+		return false;
+	}
+
+	struct compressheader *hdr = (struct compressheader *)_head;
+	if (!_parent->readBlocks(0, 1, _head)) {
+		eject();
+		return false;
+	}
+
+	// Never format here - it could be another filesystem, or this one
+	// asked for with the wrong size.
+	if (hdr->magic != COMPRESS_MAGIC) {
+		eject();
+		errno = ENODEV;
+		return false;
+	}
+	if ((hdr->sectors != _sectors) || (hdr->physBlockSize != _physBlockSize) || (hdr->unit != _unit)) {
+		eject();
+		errno = EINVAL;
+		return false;
+	}
+
+	if (!_parent->readBlocks(1, _mapBlocks, (uint8_t *)_map)) {
+		eject();
+		return false;
+	}
+	for (uint32_t i = 0; i < _sectors; i++) {
+		uint32_t entry = _map[i];
+		if (entry == COMPRESS_UNMAPPED) {
+			continue;
+		}
+		uint32_t block = COMPRESS_BLOCK(entry);
+		if ((block <= _mapBlocks) || (block >= _physBlocks)) {
+			// Damaged table - don't trust the entry.
+			_map[i] = COMPRESS_UNMAPPED;
+			continue;
+		}
+		_live[block] += COMPRESS_COUNT(entry);
+	}
+	memcpy(_committed, _live, _physBlocks);
+
+	initCacheBlocks();
+	// Normally used whole, so a missing partition table is fine.
+	loadPartitionTable();
+	errno = 0;
+	return true;
+}
+
+// Work out the layout from the parent's geometry and get the memory for it.
+bool CompressedDevice::setup() {
+	_physBlockSize = _parent->getSectorSize();
+	_physBlocks = _parent->getCapacity();
+
+	if ((_physBlockSize < COMPRESS_SECTOR_SIZE) || (_physBlocks >= (COMPRESS_UNMAPPED >> 12))) {
+		errno = ENODEV;
+		return false;
+	}
+
+	_unit = _physBlockSize / COMPRESS_MAX_UNITS;
+	if (_unit < COMPRESS_MIN_UNIT) {
+		_unit = COMPRESS_MIN_UNIT;
+	}
+	_unitsPerBlock = _physBlockSize / _unit;
+
+	if (_sectors == 0) {
+		// Default to as much space as the parent would hold uncompressed.
+		_sectors = (_physBlocks * (_physBlockSize / COMPRESS_SECTOR_SIZE)) * 15 / 16;
+	}
+
+	_mapBlocks = ((_sectors * 4) + _physBlockSize - 1) / _physBlockSize;
+
+	// Block 0 holds the header, then the remap table, then the data.
+	if (_physBlocks < 1 + _mapBlocks + 2) {
+		errno = ENOSPC;
+		return false;
+	}
+
+	_map = (uint32_t *)malloc(_mapBlocks * _physBlockSize);
+	_mapDirty = (uint8_t *)malloc(_mapBlocks);
+	_live = (uint8_t *)malloc(_physBlocks);
+	_committed = (uint8_t *)malloc(_physBlocks);
+	_head = (uint8_t *)malloc(_physBlockSize);
+	if ((_map == NULL) || (_mapDirty == NULL) || (_live == NULL) || (_committed == NULL) || (_head == NULL)) {
+		eject();
+		errno = ENOMEM;
+		return false;
+	}
+
+	memset(_mapDirty, 0, _mapBlocks);
+	memset(_live, 0, _physBlocks);
+	memset(_committed, 0, _physBlocks);
+	_headBlock = COMPRESS_NO_HEAD;
+	_headUsed = 0;
+	_headDirty = false;
+	_nextAlloc = 1 + _mapBlocks;
+	return true;
+}
+
+bool CompressedDevice::insert() {
+	return initialize();
+}
+
+bool CompressedDevice::eject() {
+	if (_map != NULL) {
+		sync();
+	}
+	free(_map);
+	free(_mapDirty);
+	free(_live);
+	free(_committed);
+	free(_head);
+	_map = NULL;
+	_mapDirty = NULL;
+	_live = NULL;
+	_committed = NULL;
+	_head = NULL;
+	return true;
+}
+
+// Start an empty device: write a fresh header and an all-unmapped table.
+bool CompressedDevice::format() {
+	if (_map != NULL) {
+		// The cache would still hold blocks from before.
+		errno = EBUSY;
+		return false;
+	}
+	if (!setup()) {
+		return false;
+	}
+
+	memset(_map, 0xFF, _mapBlocks * _physBlockSize);
+
+	memset(_head, 0xFF, _physBlockSize);
+	struct compressheader *hdr = (struct compressheader *)_head;
+	hdr->magic = COMPRESS_MAGIC;
+	hdr->sectors = _sectors;
+	hdr->physBlockSize = _physBlockSize;
+	hdr->unit = _unit;
+
+	if (!_parent->writeBlocks(1, _mapBlocks, (const uint8_t *)_map)) {
+		eject();
+		return false;
+	}
+	// The header goes last so a half-formatted device is never trusted.
+	if (!_parent->writeBlocks(0, 1, _head)) {
+		eject();
+		return false;
+	}
+	_parent->sync();
+
+	initCacheBlocks();
+	loadPartitionTable();
+	errno = 0;
+	return true;
+}
+
+void CompressedDevice::setEntry(uint32_t block, uint32_t entry) {
+	_map[block] = entry;
+	_mapDirty[(block * 4) / _physBlockSize] = 1;
+}
+
+void CompressedDevice::releaseEntry(uint32_t entry) {
+	if (entry != COMPRESS_UNMAPPED) {
+		_live[COMPRESS_BLOCK(entry)] -= COMPRESS_COUNT(entry);
+	}
+}
+
+bool CompressedDevice::flushHead() {
+	if (!_headDirty) {
+		return true;
+	}
+	if (!_parent->writeBlocks(_headBlock, 1, _head)) {
+		return false;
+	}
+	_headDirty = false;
+	return true;
+}
+
+// A parent block can be written over only if nothing points into it -
+// not the table in RAM, and not the one on the parent either, or losing
+// power before the next sync() would lose blocks that were already safe.
+bool CompressedDevice::isFree(uint32_t block) {
+	return (block != _headBlock) && (_live[block] == 0) && (_committed[block] == 0);
+}
+
+// Make sure the head block has room for a slot of the given size, moving
+// to an empty parent block or compacting one into it if it hasn't.  One
+// empty block is always kept back for compacting into.
+bool CompressedDevice::openHead(uint32_t units) {
+	if ((_headBlock != COMPRESS_NO_HEAD) && (_headUsed + units <= _unitsPerBlock)) {
+		return true;
+	}
+
+	if (!flushHead()) {
+		return false;
+	}
+	_headBlock = COMPRESS_NO_HEAD;
+
+	uint32_t first = 1 + _mapBlocks;
+	uint32_t span = _physBlocks - first;
+
+	// Each pass either finds room or frees up blocks for the next one, and
+	// a third pass would have nothing left to try.
+	for (int pass = 0; pass < 3; pass++) {
+		uint32_t spare = COMPRESS_NO_HEAD;
+		uint32_t empty = 0;
+		bool stale = false;
+
+		// Round robin through the data area so the erases get spread about.
+		for (uint32_t i = 0; i < span; i++) {
+			uint32_t block = first + ((_nextAlloc - first + i) % span);
+			if (isFree(block)) {
+				if (spare == COMPRESS_NO_HEAD) {
+					spare = block;
+				}
+				empty++;
+			} else if (_live[block] == 0) {
+				stale = true;
+			}
+		}
+
+		if (empty > 1) {
+			_headBlock = spare;
+			_headUsed = 0;
+			_nextAlloc = spare + 1;
+			memset(_head, 0xFF, _physBlockSize);
+			return true;
+		}
+
+		// Blocks emptied since the last sync() can be had once the table
+		// on the parent stops pointing at them.
+		if (stale) {
+			if (!commit()) {
+				return false;
+			}
+			continue;
+		}
+
+		if (empty == 0) {
+			break;
+		}
+
+		if (!compact(spare)) {
+			return false;
+		}
+		if (_headUsed + units <= _unitsPerBlock) {
+			return true;
+		}
+		if (!flushHead()) {
+			return false;
+		}
+		_headBlock = COMPRESS_NO_HEAD;
+	}
+
+	errno = ENOSPC;
+	return false;
+}
+
+// Copy the live slots of the parent block with the least live data into
+// the empty one given, packed up at the front, and carry on filling that as
+// the new head.  The old block is left alone until the table on the parent
+// has moved off it.
+bool CompressedDevice::compact(uint32_t spare) {
+	uint32_t victim = COMPRESS_NO_HEAD;
+	uint32_t least = _unitsPerBlock;
+
+	for (uint32_t block = 1 + _mapBlocks; block < _physBlocks; block++) {
+		if ((_live[block] > 0) && (_live[block] < least)) {
+			least = _live[block];
+			victim = block;
+		}
+	}
+
+	if (victim == COMPRESS_NO_HEAD) {
+		errno = ENOSPC;
+		return false;
+	}
+
+	if (!_parent->readBlocks(victim, 1, _head)) {
+		return false;
+	}
+
+	// Find which logical block owns each slot, then squeeze them down in
+	// order so no slot is overwritten before it has been moved.
+	uint32_t owner[COMPRESS_MAX_UNITS];
+	for (uint32_t unit = 0; unit < _unitsPerBlock; unit++) {
+		owner[unit] = COMPRESS_UNMAPPED;
+	}
+	for (uint32_t i = 0; i < _sectors; i++) {
+		if ((_map[i] != COMPRESS_UNMAPPED) && (COMPRESS_BLOCK(_map[i]) == victim)) {
+			owner[COMPRESS_UNIT(_map[i])] = i;
+		}
+	}
+
+	uint32_t used = 0;
+	for (uint32_t unit = 0; unit < _unitsPerBlock; unit++) {
+		if (owner[unit] == COMPRESS_UNMAPPED) {
+			continue;
+		}
+		uint32_t count = COMPRESS_COUNT(_map[owner[unit]]);
+		if (unit != used) {
+			memmove(_head + (used * _unit), _head + (unit * _unit), count * _unit);
+		}
+		setEntry(owner[unit], COMPRESS_ENTRY(spare, used, count));
+		used += count;
+	}
+
+	memset(_head + (used * _unit), 0xFF, (_unitsPerBlock - used) * _unit);
+	_live[victim] = 0;
+	_live[spare] = used;
+	_headBlock = spare;
+	_headUsed = used;
+	_headDirty = true;
+	_nextAlloc = spare + 1;
+	_compactions++;
+	return true;
+}
+
+bool CompressedDevice::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	if (block >= _sectors) {
+		errno = EINVAL;
+		return false;
+	}
+
+	uint32_t entry = _map[block];
+	if (entry == COMPRESS_UNMAPPED) {
+		memset(data, 0, COMPRESS_SECTOR_SIZE);
+		return true;
+	}
+
+	uint32_t phys = COMPRESS_BLOCK(entry);
+	uint32_t offset = COMPRESS_UNIT(entry) * _unit;
+	uint32_t count = COMPRESS_COUNT(entry);
+
+	// A slot the full size of a block is stored as it is.
+	if (count * _unit >= COMPRESS_SECTOR_SIZE) {
+		if (phys == _headBlock) {
+			memcpy(data, _head + offset, COMPRESS_SECTOR_SIZE);
+			return true;
+		}
+		return _parent->readBlockBytes(phys, offset, COMPRESS_SECTOR_SIZE, data);
+	}
+
+	uint8_t slot[count * _unit];
+	if (phys == _headBlock) {
+		memcpy(slot, _head + offset, count * _unit);
+	} else if (!_parent->readBlockBytes(phys, offset, count * _unit, slot)) {
+		return false;
+	}
+
+	uint32_t start = micros();
+	uint32_t len = slot[0] | (slot[1] << 8);
+	if ((len > (count * _unit) - COMPRESS_SLOT_HEADER) ||
+		(decompress(slot + COMPRESS_SLOT_HEADER, len, data, COMPRESS_SECTOR_SIZE) != COMPRESS_SECTOR_SIZE)) {
+		errno = EIO;
+		return false;
+	}
+	_decompressMicros += micros() - start;
+	_decompressions++;
+	return true;
+}
+
+bool CompressedDevice::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	if (block >= _sectors) {
+		errno = EINVAL;
+		return false;
+	}
+
+	_bytesIn += COMPRESS_SECTOR_SIZE;
+
+	// Blocks of zeros take no space at all.
+	uint32_t i;
+	for (i = 0; i < COMPRESS_SECTOR_SIZE; i++) {
+		if (data[i] != 0) {
+			break;
+		}
+	}
+	if (i == COMPRESS_SECTOR_SIZE) {
+		releaseEntry(_map[block]);
+		setEntry(block, COMPRESS_UNMAPPED);
+		return true;
+	}
+
+	uint32_t rawUnits = (COMPRESS_SECTOR_SIZE + _unit - 1) / _unit;
+
+	// Only keep the compressed copy if it saves at least one unit.
+	uint8_t packed[COMPRESS_SLOT_HEADER + COMPRESS_SECTOR_SIZE];
+	int len = compress(data, COMPRESS_SECTOR_SIZE, packed + COMPRESS_SLOT_HEADER,
+		((rawUnits - 1) * _unit) - COMPRESS_SLOT_HEADER);
+
+	uint8_t *slot;
+	uint32_t bytes;
+	if (len < 0) {
+		slot = data;
+		bytes = COMPRESS_SECTOR_SIZE;
+	} else {
+		packed[0] = len & 0xFF;
+		packed[1] = len >> 8;
+		slot = packed;
+		bytes = COMPRESS_SLOT_HEADER + len;
+	}
+
+	uint32_t units = (bytes + _unit - 1) / _unit;
+
+	if (!openHead(units)) {
+		return false;
+	}
+
+	memcpy(_head + (_headUsed * _unit), slot, bytes);
+	memset(_head + (_headUsed * _unit) + bytes, 0xFF, (units * _unit) - bytes);
+
+	releaseEntry(_map[block]);
+	setEntry(block, COMPRESS_ENTRY(_headBlock, _headUsed, units));
+	_live[_headBlock] += units;
+	_headUsed += units;
+	_headDirty = true;
+
+	_bytesOut += units * _unit;
+	return true;
+}
+
+// Data first, then the table that points at it.  The head is finished
+// with after that: writing it again would put the slots just committed at
+// risk.
+bool CompressedDevice::commit() {
+	if (!flushHead()) {
+		return false;
+	}
+	bool changed = false;
+	for (uint32_t i = 0; i < _mapBlocks; i++) {
+		if (_mapDirty[i]) {
+			if (!_parent->writeBlocks(1 + i, 1, ((const uint8_t *)_map) + (i * _physBlockSize))) {
+				return false;
+			}
+			_mapDirty[i] = 0;
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return true;
+	}
+	_parent->sync();
+	memcpy(_committed, _live, _physBlocks);
+	if (_headUsed > 0) {
+		_headBlock = COMPRESS_NO_HEAD;
+	}
+	return true;
+}
+
+void CompressedDevice::sync() {
+	BlockDevice::sync();
+	if (_map != NULL) {
+		commit();
+	}
+}
+
+void CompressedDevice::printCacheStats() {
+	BlockDevice::printCacheStats();
+	Serial.println();
+
+	uint32_t mapped = 0;
+	uint32_t units = 0;
+	if (_map != NULL) {
+		for (uint32_t i = 0; i < _sectors; i++) {
+			if (_map[i] != COMPRESS_UNMAPPED) {
+				mapped++;
+				units += COMPRESS_COUNT(_map[i]);
+			}
+		}
+	}
+
+	Serial.print("Blocks in use: ");
+	Serial.print(mapped);
+	Serial.print(" of ");
+	Serial.println(_sectors);
+	if (units > 0) {
+		Serial.print("Stored compression ratio: ");
+		Serial.print((mapped * COMPRESS_SECTOR_SIZE * 100UL) / (units * _unit));
+		Serial.println("%");
+	}
+	if (_bytesOut > 0) {
+		Serial.print("Written compression ratio: ");
+		Serial.print((_bytesIn / _bytesOut) * 100 + ((_bytesIn % _bytesOut) * 100) / _bytesOut);
+		Serial.println("%");
+	}
+	Serial.print("Compactions: ");
+	Serial.println(_compactions);
+	if (_decompressions > 0) {
+		Serial.print("Decompression time per block: ");
+		Serial.print(_decompressMicros / _decompressions);
+		Serial.println("us");
+	}
+}
+
+/*! Compress a buffer into the LZ4 block format.  Returns the compressed
+ *  length, or -1 if it won't fit in max bytes.
+ */
+int CompressedDevice::compress(const uint8_t *src, int len, uint8_t *dst, int max) {
+	uint16_t table[1 << LZ4_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	int ip = 0;
+	int op = 0;
+	int anchor = 0;
+	int mflimit = len - LZ4_MF_LIMIT;
+	int matchlimit = len - LZ4_LAST_LITERALS;
+
+	while (ip < mflimit) {
+		uint32_t seq;
+		memcpy(&seq, src + ip, 4);
+		uint32_t hash = (uint32_t)(seq * 2654435761UL) >> (32 - LZ4_HASH_BITS);
+		int ref = (int)table[hash] - 1;
+		table[hash] = ip + 1;
+
+		uint32_t candidate;
+		if (ref >= 0) {
+			memcpy(&candidate, src + ref, 4);
+		}
+		if ((ref < 0) || (ip - ref > 0xFFFF) || (candidate != seq)) {
+			ip++;
+			continue;
+		}
+
+		int mlen = LZ4_MIN_MATCH;
+		while ((ip + mlen < matchlimit) && (src[ref + mlen] == src[ip + mlen])) {
+			mlen++;
+		}
+
+		int lit = ip - anchor;
+		if (op + 1 + (lit / 255) + 1 + lit + 2 + ((mlen - LZ4_MIN_MATCH) / 255) + 1 > max) {
+			return -1;
+		}
+
+		uint8_t *token = dst + op++;
+		if (lit >= 15) {
+			*token = 0xF0;
+			int n = lit - 15;
+			while (n >= 255) {
+				dst[op++] = 255;
+				n -= 255;
+			}
+			dst[op++] = n;
+		} else {
+			*token = lit << 4;
+		}
+		memcpy(dst + op, src + anchor, lit);
+		op += lit;
+
+		int offset = ip - ref;
+		dst[op++] = offset & 0xFF;
+		dst[op++] = offset >> 8;
+
+		int ml = mlen - LZ4_MIN_MATCH;
+		if (ml >= 15) {
+			*token |= 0x0F;
+			ml -= 15;
+			while (ml >= 255) {
+				dst[op++] = 255;
+				ml -= 255;
+			}
+			dst[op++] = ml;
+		} else {
+			*token |= ml;
+		}
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	// Whatever is left goes out as literals.
+	int lit = len - anchor;
+	if (op + 1 + (lit / 255) + 1 + lit > max) {
+		return -1;
+	}
+	if (lit >= 15) {
+		dst[op++] = 0xF0;
+		int n = lit - 15;
+		while (n >= 255) {
+			dst[op++] = 255;
+			n -= 255;
+		}
+		dst[op++] = n;
+	} else {
+		dst[op++] = lit << 4;
+	}
+	memcpy(dst + op, src + anchor, lit);
+	op += lit;
+	return op;
+}
+
+/*! Expand an LZ4 block.  Returns the decompressed length, or -1 if the
+ *  data is damaged or would overrun max bytes.
+ */
+int CompressedDevice::decompress(const uint8_t *src, int len, uint8_t *dst, int max) {
+	int ip = 0;
+	int op = 0;
+
+	while (ip < len) {
+		uint8_t token = src[ip++];
+
+		int lit = token >> 4;
+		if (lit == 15) {
+			uint8_t b;
+			do {
+				if (ip >= len) {
+					return -1;
+				}
+				b = src[ip++];
+				lit += b;
+			} while (b == 255);
+		}
+		if ((lit > len - ip) || (lit > max - op)) {
+			return -1;
+		}
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+
+		// The last sequence is literals only.
+		if (ip >= len) {
+			break;
+		}
+
+		if (ip + 2 > len) {
+			return -1;
+		}
+		int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > op)) {
+			return -1;
+		}
+
+		int mlen = token & 0x0F;
+		if (mlen == 15) {
+			uint8_t b;
+			do {
+				if (ip >= len) {
+					return -1;
+				}
+				b = src[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ4_MIN_MATCH;
+		if (mlen > max - op) {
+			return -1;
+		}
+
+		// Matches may overlap what they are copying, so byte at a time.
+		uint8_t *from = dst + op - offset;
+		for (int i = 0; i < mlen; i++) {
+			dst[op + i] = from[i];
+		}
+		op += mlen;
+	}
+	return op;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The CompressedDevice class sits on top of another block device and
+ *  stores each logical block LZ4 compressed.  It is aimed at small SPI
+ *  flash chips holding logs and assets: a block that packs down to a
+ *  quarter of its size takes a quarter of the flash and a quarter of the
+ *  SPI clocks to read back.
+ *
+ *  Compressed blocks are written one after another into the current "head"
+ *  block of the parent in slots of a whole number of units (64 bytes, or
+ *  1/64th of a parent block if that is bigger).  A remap table with one
+ *  32-bit entry per logical block says which parent block, unit and length
+ *  each logical block lives at.  One empty parent block is kept back; when
+ *  it's the last, the block with the least live data is copied into it
+ *  packed up, and that becomes the new head.  Blocks of all zeros take no
+ *  space at all.
+ *
+ *  The remap table lives in RAM (4 bytes per logical block) and is written
+ *  to the start of the parent on sync(), after the data it refers to.
+ *  Nothing the table on the parent points at is written over until the
+ *  next sync(), so losing power only loses what was written since.  The
+ *  logical blocks are held in this device's own cache, so repeated reads
+ *  decompress only once and writes are compressed as they are flushed.
+ *
+ *      SPIFlash flash(spi, 10);
+ *      flash.initialize();
+ *      CompressedDevice packed(flash, 32768);  // 16MB of logical space
+ *      if (!packed.initialize() && (errno == ENODEV)) packed.format();
+ *      Fat fs(packed);
+ *      if (!fs.begin()) fs.format();
+ *
+ *  The parent must be initialized first - a blank flash chip reporting no
+ *  partition table is fine.  A blank or foreign parent is only formatted
+ *  when format() is called.  More logical space than the
+ *  parent holds can be asked for; writes fail with ENOSPC if the data
+ *  turns out not to compress well enough to fit.
+ */
+
+#ifndef _COMPRESSEDDEVICE_H
+#define _COMPRESSEDDEVICE_H
+
+#include <FileSystem.h>
+
+class CompressedDevice : public BlockDevice {
+private:
+	BlockDevice	*_parent;
+	uint32_t	_sectors;			// Logical blocks
+	uint32_t	_physBlockSize;		// Parent block size
+	uint32_t	_physBlocks;		// Parent blocks
+	uint32_t	_unit;				// Slot allocation unit in bytes
+	uint32_t	_unitsPerBlock;
+	uint32_t	_mapBlocks;			// Parent blocks holding the remap table
+	uint32_t	*_map;				// Remap table, padded to whole parent blocks
+	uint8_t		*_mapDirty;			// One flag per remap table block
+	uint8_t		*_live;				// Live units in each parent block
+	uint8_t		*_committed;		// ... as the table on the parent has it
+	uint8_t		*_head;				// Copy of the head block being filled
+	uint32_t	_headBlock;
+	uint32_t	_headUsed;
+	bool		_headDirty;
+	uint32_t	_nextAlloc;
+
+	// Statistics
+	uint32_t	_bytesIn;			// Logical bytes written
+	uint32_t	_bytesOut;			// Slot bytes those took up
+	uint32_t	_compactions;
+	uint32_t	_decompressions;
+	uint32_t	_decompressMicros;
+
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+
+	void		setEntry(uint32_t blockno, uint32_t entry);
+	void		releaseEntry(uint32_t entry);
+	bool		flushHead();
+	bool		setup();
+	bool		isFree(uint32_t block);
+	bool		openHead(uint32_t units);
+	bool		compact(uint32_t spare);
+	bool		commit();
+
+public:
+				CompressedDevice(BlockDevice &parent, uint32_t sectors = 0);
+				~CompressedDevice();
+
+	/*! Mount the compressed layout on the parent.  Fails with ENODEV if
+	 *  the parent doesn't hold one, or EINVAL if it holds one made for a
+	 *  different size, and never formats by itself.
+	 */
+	bool		initialize();
+
+	/*! Set up an empty compressed layout on the parent, losing anything
+	 *  that was on it, and leave the device initialized.  Fails with EBUSY
+	 *  if it's already initialized.
+	 */
+	bool		format();
+	bool		eject();
+	bool		insert();
+
+	void		sync();
+	void		syncBlocks(uint32_t blockno, uint32_t count) { sync(); }
+	void		printCacheStats();
+
+	size_t		getCapacity() { return _sectors; }
+
+	static int	compress(const uint8_t *src, int len, uint8_t *dst, int max);
+	static int	decompress(const uint8_t *src, int len, uint8_t *dst, int max);
+};
+
+#endif
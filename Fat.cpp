@@ -31,14 +31,79 @@
 #include <FileSystem.h>
 
 
-Fat::Fat(BlockDevice &dev, uint8_t partition) {
+Fat::Fat(BlockDevice &dev, uint8_t partition) : _partDev(dev, partition) {
 	_dev = &dev;
+	_vol = &_partDev;
 	_part = partition & 0x03;
 	_type = 0;
 	_cwd = 0;
-	_cachedFatNumber = 0xFFFFFFFFUL;
-	_cachedBlockNumber = 0xFFFFFFFFUL;
+	_fatCache = NULL;
+	_fatCacheSlot = NULL;
+	_fatCacheSlots = 0;
+	_fatCacheWanted = FAT_CACHE_SECTORS;
+	_fatCacheClock = 0;
+	_fatInRAM = false;
+	_fatDirtyFirst = 0xFFFFFFFFUL;
+	_fatDirtyLast = 0;
+	_freeMap = NULL;
+	_fsInfoSector = 0;
+	_fsInfoDirty = false;
+	_dentryClock = 0;
+	invalidateDentries(0xFFFFFFFFUL);
+	_bloomRejects = 0;
+	_bloomPasses = 0;
+	_bloomFalse = 0;
+	_bloomBuild = NULL;
+	_indexParent = 0;
+	_dirBuffer = NULL;
+	_dirBufferSize = 0;
+	_dirBufferBlock = 0xFFFFFFFFUL;
+	_dirBufferCount = 0;
+	_blockShift = 9;
+	_clusterShift = 0;
+	selectEngine();
 }
+
+// Mount a device that is itself the filesystem, such as a PartitionDevice
+// or an unpartitioned device.
+Fat::Fat(BlockDevice &dev) : _partDev(dev, (uint8_t)0) {
+	_dev = &dev;
+	_vol = &dev;
+	_part = 0;
+	_type = 0;
+	_cwd = 0;
+	_fatCache = NULL;
+	_fatCacheSlot = NULL;
+	_fatCacheSlots = 0;
+	_fatCacheWanted = FAT_CACHE_SECTORS;
+	_fatCacheClock = 0;
+	_fatInRAM = false;
+	_fatDirtyFirst = 0xFFFFFFFFUL;
+	_fatDirtyLast = 0;
+	_freeMap = NULL;
+	_fsInfoSector = 0;
+	_fsInfoDirty = false;
+	_dentryClock = 0;
+	invalidateDentries(0xFFFFFFFFUL);
+	_bloomRejects = 0;
+	_bloomPasses = 0;
+	_bloomFalse = 0;
+	_bloomBuild = NULL;
+	_indexParent = 0;
+	_dirBuffer = NULL;
+	_dirBufferSize = 0;
+	_dirBufferBlock = 0xFFFFFFFFUL;
+	_dirBufferCount = 0;
+	_blockShift = 9;
+	_clusterShift = 0;
+	selectEngine();
+}
+Fat::~Fat() {
+	free(_dirBuffer);
+	free(_freeMap);
+	freeFatCache();
+}
+
 void Fat::dumpBlock(uint8_t *data) {
     char temp[32];
     char ascii[32];
@@ -60,345 +125,2169 @@ bool Fat::begin() {
 	if (!_dev->initialize()) {
 		return false;
 	}
-    _blockSize = _dev->getSectorSize();
+	if ((_vol != _dev) && !_vol->initialize()) {
+		return false;
+	}
+	if (_type != 0) {
+		// Don't lose anything still waiting to go out.
+		flushFat();
+		writeFsInfo();
+	}
+	return mount();
+}
+
+bool Fat::mount() {
+    _blockSize = _vol->getSectorSize();
+	invalidateDentries(0xFFFFFFFFUL);
 
 	uint8_t buffer[_blockSize];
 
 	struct bootblock *bb = (struct bootblock *)buffer;
 
-	if (!_dev->readRelativeSystemBlock(_part, 0, buffer)) {
+	if (!_vol->readSystemBlock(0, buffer)) {
 		errno = -10;
 		return false;
 	}
 
+	_cluster_size = bb->sectors_per_cluster;
+	_bytes_per_sector = bb->bytes_per_sector;
+
+	// Everything below works in device blocks, so a filesystem with a
+	// different sector size needs a LogicalSectorDevice in between.
+	if (_bytes_per_sector != _blockSize) {
+		errno = EINVAL;
+		return false;
+	}
+
+	for (_blockShift = 0; (1UL << _blockShift) < _blockSize; _blockShift++);
+	for (_clusterShift = 0; (1UL << _clusterShift) < _cluster_size; _clusterShift++);
+	if (((1UL << _blockShift) != _blockSize) || ((1UL << _clusterShift) != _cluster_size)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	_dirBufferCount = 0;
+	if (_dirBufferSize != _blockSize) {
+		free(_dirBuffer);
+		_dirBuffer = (uint8_t *)malloc(FAT_DIR_BLOCKS * _blockSize);
+		if (_dirBuffer == NULL) {
+			_dirBufferSize = 0;
+			errno = ENOMEM;
+			return false;
+		}
+		_dirBufferSize = _blockSize;
+	}
+
+	uint32_t total = (bb->total_sectors != 0) ? bb->total_sectors : bb->total_sectors_16;
+	_fat_copies = bb->fat_copies;
+	_fsInfoSector = 0;
+	_fsInfoDirty = false;
+
 	if (!strncmp((const char *)bb->fstype_16, "FAT16", 5)) {
 		_type = 16;
-        _root_block = (bb->fat_copies * bb->sectors_per_fat) + 1;
         _fat_start = bb->reserved_sectors;
-        _data_start = _root_block + ((bb->root_entries * sizeof(struct fat_dirent)) / _blockSize);
+        _fat_sectors = bb->sectors_per_fat;
+        _root_block = _fat_start + (bb->fat_copies * bb->sectors_per_fat);
+        _root_sectors = ((bb->root_entries * sizeof(struct fat_dirent) + _blockSize - 1) / _blockSize);
+        _root_cluster = 0;
+        _data_start = _root_block + _root_sectors;
 	} else 	if (!strncmp((const char *)bb->fstype_32, "FAT32", 5)) {
-        _data_start = bb->reserved_sectors + (bb->fat_copies * bb->sectors_per_fat_32);
         _fat_start = bb->reserved_sectors;
-        _root_block = _data_start;
+        _fat_sectors = bb->sectors_per_fat_32;
+        _data_start = _fat_start + (bb->fat_copies * bb->sectors_per_fat_32);
+        _root_block = _data_start + ((bb->root_start_32 - 2) * _cluster_size);
+        _root_sectors = 0;
+        _root_cluster = bb->root_start_32;
 		_type = 32;
+		if (bb->mirror_flags_32 & 0x80) {
+			// Mirroring is off: only the active FAT is used.
+			_fat_start += (bb->mirror_flags_32 & 0x0F) * _fat_sectors;
+			_fat_copies = 1;
+		}
+		if ((bb->fs_info_sector_32 != 0) && (bb->fs_info_sector_32 != 0xFFFF)) {
+			_fsInfoSector = bb->fs_info_sector_32;
+		}
 	} else {
 		errno = -20; //EINVAL;
 		return false;
 	}
 
+	_clusters = (total - _data_start) >> _clusterShift;
+	uint32_t perSector = _blockSize >> ((_type == 32) ? 2 : 1);
+	if (_clusters + 2 > _fat_sectors * perSector) {
+		_clusters = _fat_sectors * perSector - 2;
+	}
+
+	// Pick up the free space hints, if the volume has them.
+	_freeCount = 0xFFFFFFFFUL;
+	_nextFree = 2;
+	if (_fsInfoSector != 0) {
+		struct fsinfo *fsi = (struct fsinfo *)buffer;
+		if (_vol->readBlocks(_fsInfoSector, 1, buffer) &&
+			(fsi->lead_sig == FSINFO_LEAD_SIG) && (fsi->struct_sig == FSINFO_STRUCT_SIG)) {
+			if (fsi->free_count <= _clusters) {
+				_freeCount = fsi->free_count;
+			}
+			if ((fsi->next_free >= 2) && (fsi->next_free < _clusters + 2)) {
+				_nextFree = fsi->next_free;
+			}
+		} else {
+			_fsInfoSector = 0;
+		}
+	}
+
+	free(_freeMap);
+	_freeMap = (uint8_t *)malloc((_fat_sectors + 7) / 8);
+	if (_freeMap == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	memset(_freeMap, 0xFF, (_fat_sectors + 7) / 8);
+
+	selectEngine();
+	return initFatCache();
+}
+
+void Fat::freeFatCache() {
+	free(_fatCache);
+	free(_fatCacheSlot);
+	_fatCache = NULL;
+	_fatCacheSlot = NULL;
+	_fatCacheSlots = 0;
+	_fatInRAM = false;
+	_fatDirtyFirst = 0xFFFFFFFFUL;
+	_fatDirtyLast = 0;
+}
+
+bool Fat::initFatCache() {
+	freeFatCache();
+
+	if (_fatCacheWanted == FAT_CACHE_WHOLE) {
+		_fatCache = (uint8_t *)malloc(_fat_sectors * _blockSize);
+		if (_fatCache != NULL) {
+			if (_vol->readBlocks(_fat_start, _fat_sectors, _fatCache)) {
+				_fatInRAM = true;
+				return true;
+			}
+			free(_fatCache);
+			_fatCache = NULL;
+		}
+	}
+
+	// Fall back to a window if the whole FAT won't fit.
+	uint8_t slots = (_fatCacheWanted == FAT_CACHE_WHOLE) ? FAT_CACHE_SECTORS : _fatCacheWanted;
+	_fatCache = (uint8_t *)malloc(slots * _blockSize);
+	_fatCacheSlot = (struct fatcacheslot *)malloc(slots * sizeof(struct fatcacheslot));
+	if ((_fatCache == NULL) || (_fatCacheSlot == NULL)) {
+		freeFatCache();
+		errno = ENOMEM;
+		return false;
+	}
+	for (uint8_t i = 0; i < slots; i++) {
+		_fatCacheSlot[i].sector = 0xFFFFFFFFUL;
+		_fatCacheSlot[i].used = 0;
+		_fatCacheSlot[i].dirty = false;
+	}
+	_fatCacheSlots = slots;
+	_fatCacheClock = 0;
 	return true;
 }
 
-uint32_t Fat::findDirectoryEntry(uint32_t parent, const char *path) {
-	uint8_t block[_blockSize];
-	uint32_t offset = 0;
+bool Fat::setFatCache(uint8_t sectors) {
+	_fatCacheWanted = sectors;
+	if (_type == 0) {
+		// Not mounted yet - it will be set up then.
+		return true;
+	}
+	if (!flushFat()) {
+		return false;
+	}
+	return initFatCache();
+}
+
+// Return a FAT sector (counted from the start of the FAT) from RAM,
+// reading it into the least recently used slot if it isn't there.  Pass
+// dirty as true if the sector is going to be changed.
+uint8_t *Fat::getFatSector(uint32_t sector, bool dirty) {
+	if (_fatInRAM) {
+		if (sector >= _fat_sectors) {
+			return NULL;
+		}
+		if (dirty) {
+			_fatDirtyFirst = min(_fatDirtyFirst, sector);
+			_fatDirtyLast = max(_fatDirtyLast, sector);
+		}
+		return _fatCache + (sector * _blockSize);
+	}
 
-	if (parent == 0) {
-		offset = _root_block;
-	} else {
-		offset = _data_start + ((parent - 2) * _cluster_size);
+	if (_fatCacheSlots == 0) {
+		return NULL;
 	}
 
-	char lfn[256];
-	bzero(lfn, 256);
-	bool has_lfn = false;
-	bool done = false;
-	while (!done) {
-		if (!_dev->readRelativeSystemBlock(_part, offset, block)) {
-			return 0;
+	uint8_t oldest = 0;
+	for (uint8_t i = 0; i < _fatCacheSlots; i++) {
+		if (_fatCacheSlot[i].sector == sector) {
+			_fatCacheSlot[i].used = ++_fatCacheClock;
+			_fatCacheSlot[i].dirty |= dirty;
+			return _fatCache + (i * _blockSize);
 		}
-		struct fat_dirent *p = (struct fat_dirent *)block;
-		for (uint32_t i = 0; i < _blockSize / sizeof(struct fat_dirent); i++) {
-			if ((p[i].attribs & ATTR_LFN) == ATTR_LFN) {
-				struct fat_lfnent *as_lfn = (struct fat_lfnent *)block;
-				// Deleted?
-				if (as_lfn[i].ordinal & 0x80) {
-					continue;
-				}
-				int chunk = ((as_lfn[i].ordinal & 0x3F) - 1) * 13;
-				for (int j = 0; j < 5; j++) {
-					lfn[chunk + j] = as_lfn[i].lfn1[j];
-				}
-				for (int j = 0; j < 6; j++) {
-					lfn[chunk + j + 5] = as_lfn[i].lfn2[j];
-				}
-				lfn[chunk + 11] = as_lfn[i].lfn3[0];
-				lfn[chunk + 12] = as_lfn[i].lfn3[1];
-				// Last entry?
-				if (as_lfn[i].ordinal & 0x40) {
-					has_lfn = true;
-				}
-				continue;
-			}
-	
-			if (p[i].attribs & ATTR_VOLUME) {
-				continue;
+		if (_fatCacheSlot[i].used < _fatCacheSlot[oldest].used) {
+			oldest = i;
+		}
+	}
+
+	uint8_t *data = _fatCache + (oldest * _blockSize);
+	if (_fatCacheSlot[oldest].dirty) {
+		if (!writeFatSector(_fatCacheSlot[oldest].sector, data)) {
+			return NULL;
+		}
+		_fatCacheSlot[oldest].dirty = false;
+	}
+	if (!_vol->readBlocks(_fat_start + sector, 1, data)) {
+		_fatCacheSlot[oldest].sector = 0xFFFFFFFFUL;
+		_fatCacheSlot[oldest].used = 0;
+		return NULL;
+	}
+	_fatCacheSlot[oldest].sector = sector;
+	_fatCacheSlot[oldest].used = ++_fatCacheClock;
+	_fatCacheSlot[oldest].dirty = dirty;
+	return data;
+}
+
+// Write a FAT sector out to every copy of the FAT.
+bool Fat::writeFatSector(uint32_t sector, const uint8_t *data) {
+	for (uint8_t i = 0; i < _fat_copies; i++) {
+		if (!_vol->writeBlocks(_fat_start + (i * _fat_sectors) + sector, 1, data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Fat::flushFat() {
+	if (_fatInRAM) {
+		for (uint32_t i = _fatDirtyFirst; (i <= _fatDirtyLast) && (i < _fat_sectors); i++) {
+			if (!writeFatSector(i, _fatCache + (i * _blockSize))) {
+				return false;
 			}
-	
-			if (p[i].filename[0] == 0) {
-				done = true;
-				break;
+		}
+		_fatDirtyFirst = 0xFFFFFFFFUL;
+		_fatDirtyLast = 0;
+		return true;
+	}
+
+	for (uint8_t i = 0; i < _fatCacheSlots; i++) {
+		if (_fatCacheSlot[i].dirty) {
+			if (!writeFatSector(_fatCacheSlot[i].sector, _fatCache + (i * _blockSize))) {
+				return false;
 			}
+			_fatCacheSlot[i].dirty = false;
+		}
+	}
+	return true;
+}
+
+bool Fat::writeFsInfo() {
+	if ((_fsInfoSector == 0) || !_fsInfoDirty) {
+		return true;
+	}
+
+	uint8_t buffer[_blockSize];
+	struct fsinfo *fsi = (struct fsinfo *)buffer;
+	if (!_vol->readBlocks(_fsInfoSector, 1, buffer)) {
+		return false;
+	}
+	fsi->free_count = _freeCount;
+	fsi->next_free = _nextFree;
+	if (!_vol->writeBlocks(_fsInfoSector, 1, buffer)) {
+		return false;
+	}
+	_fsInfoDirty = false;
+	return true;
+}
+
+void Fat::sync() {
+	flushFat();
+	writeFsInfo();
+	_vol->sync();
+}
+
+// The data goes first, then the FAT, then the directory entry, so the entry
+// never points at anything that isn't there yet.
+void Fat::syncFile(uint32_t entryBlock, uint32_t first, uint32_t last) {
+	if ((first >= 2) && (first <= last)) {
+		_vol->syncBlocks(_data_start + ((first - 2) << _clusterShift), (last - first + 1) << _clusterShift);
+	}
+	flushFat();
+	writeFsInfo();
+	if (entryBlock != 0) {
+		_vol->syncBlocks(entryBlock, 1);
+	}
+}
+
+bool Fat::format(uint8_t sectorsPerCluster) {
+	errno = 0;
 
+	// Whatever was mounted before is about to go, changes and all.
+	freeFatCache();
+	_fsInfoDirty = false;
 
-			uint32_t cluster = (p[i].cluster_high << 16) | p[i].cluster_low;
+	if (!_dev->initialize()) {
+		return false;
+	}
+	if ((_vol != _dev) && !_vol->initialize()) {
+		return false;
+	}
+
+	uint32_t bps = _vol->getSectorSize();
+	uint32_t total = _vol->getCapacity();
+	uint8_t buffer[bps];
+	struct bootblock *bb = (struct bootblock *)buffer;
 
-			if (has_lfn) {
-				if (!strcmp(lfn, path)) {
-					return cluster;
+	// The type goes by the number of clusters, the way a PC works it out
+	// when mounting: FAT16 for up to 65524 of them, FAT32 from 65525.  The
+	// size gives a first guess; if the layout comes out on the wrong side
+	// the other type is tried.
+	uint8_t type = ((uint64_t)total * bps <= 0x7FFF0000ULL) ? 16 : 32;
+	uint32_t spc;
+	uint32_t reserved;
+	uint32_t rootEntries;
+	uint32_t rootSectors;
+	uint32_t fats = 2;
+	uint32_t spf;
+	uint32_t clusters;
+	for (uint8_t tries = 0; ; tries++) {
+		spc = sectorsPerCluster;
+		if (spc == 0) {
+			if (type == 16) {
+				spc = 1;
+				while ((total / spc > 65524) && (spc < 64)) {
+					spc <<= 1;
 				}
 			} else {
-				char fn[12];
-                char ext[4];
-                fn[0] = p[i].filename[0];
-                fn[1] = p[i].filename[1];
-                fn[2] = p[i].filename[2];
-                fn[3] = p[i].filename[3];
-                fn[4] = p[i].filename[4];
-                fn[5] = p[i].filename[5];
-                fn[6] = p[i].filename[6];
-                fn[7] = p[i].filename[7];
-                fn[8] = 0;
-                ext[0] = p[i].filename[8];
-                ext[1] = p[i].filename[9];
-                ext[2] = p[i].filename[10];
-                ext[3] = 0;
-
-                while ((strlen(ext) > 0) && (fn[strlen(ext)-1] == ' ')) {
-                    fn[strlen(ext)-1] = 0;
-                }
-                while ((strlen(fn) > 0) && (fn[strlen(fn)-1] == ' ')) {
-                    fn[strlen(fn)-1] = 0;
-                }
-                if (strlen(ext) > 0) {
-                    strcat(fn, ".");
-                    strcat(fn, ext);
-                }
-
-				if (!strcmp(fn, path)) {
-					return cluster;
-				}
+				uint32_t mb = ((uint64_t)total * bps) >> 20;
+				spc = mb <= 8192 ? 8 : mb <= 16384 ? 16 : mb <= 32768 ? 32 : 64;
+				spc = max(1UL, (spc * 512) / bps);
 			}
 		}
-		offset++;
-	}	
-	errno = ENOENT;
-	return 0;	
-}
 
-uint32_t Fat::getInode(uint32_t parent, const char *path, uint32_t *ancestor) {
-	char *parts[MAX_DEPTH];
-	int len = FileSystem::parsePath(path, parts);
+		reserved = (type == 16) ? 1 : 32;
+		rootEntries = (type == 16) ? 512 : 0;
+		rootSectors = (rootEntries * sizeof(struct fat_dirent) + bps - 1) / bps;
+		uint32_t entrySize = (type == 16) ? 2 : 4;
 
-	if (len == 1) {
-		free(parts[0]);
-		if (ancestor != NULL) {
-			*ancestor = 0;
+		// Size the FAT to fit the clusters left over once the FAT itself is placed.
+		spf = 1;
+		while (true) {
+			if (total <= reserved + fats * spf + rootSectors + spc) {
+				errno = ENOSPC;
+				return false;
+			}
+			clusters = (total - reserved - fats * spf - rootSectors) / spc;
+			uint32_t need = ((clusters + 2) * entrySize + bps - 1) / bps;
+			if (need <= spf) {
+				break;
+			}
+			spf = need;
 		}
-		return findDirectoryEntry(parent, path);
-	}
-	uint32_t inode = parent;
-	for (int i = 0; i < len; i++) {
-		if (ancestor != NULL) {
-			*ancestor = inode;
+
+		if ((type == 16) == (clusters <= 65524)) {
+			break;
 		}
-		inode = getInode(inode, parts[i], ancestor);
-		if (inode == 0) {
-			free(parts[0]);
-			return 0;
+
+		// Right on the boundary FAT32's bigger FAT and reserved area can
+		// leave it too few clusters while FAT16 has too many.  Then it's
+		// FAT16, with the sectors past the last cluster left unused.
+		if (tries == 2) {
+			total = reserved + fats * spf + rootSectors + 65524 * spc;
+			break;
 		}
+		type = ((tries == 1) || (type == 32)) ? 16 : 32;
 	}
-	
-	free(parts[0]);
-	return inode;
-}
 
-uint32_t Fat::getNextInode(uint32_t inode) {
+	uint32_t hidden = _vol->getBlockOffset();
 
-	uint32_t inodesPerBlock = 0;
-	if (_type == 32) {
-		inodesPerBlock = _blockSize / 4;		
+	memset(buffer, 0, bps);
+	bb->bs_start[0] = 0xEB;
+	bb->bs_start[1] = (type == 16) ? 0x3C : 0x58;
+	bb->bs_start[2] = 0x90;
+	memcpy(bb->mfg_desc, "MSWIN4.1", 8);
+	bb->bytes_per_sector = bps;
+	bb->sectors_per_cluster = spc;
+	bb->reserved_sectors = reserved;
+	bb->fat_copies = fats;
+	bb->root_entries = rootEntries;
+	bb->media_descriptor = 0xF8;
+	bb->sectors_per_track = 63;
+	bb->heads = 255;
+
+	if (type == 16) {
+		bb->total_sectors = (total < 65536) ? total : 0;
+		bb->sectors_per_fat = spf;
+		bb->hidden_sectors_16 = hidden;
+		bb->total_sectors_16 = (total < 65536) ? 0 : total;
+		bb->logical_drive_16 = 0x80;
+		bb->extended_signature_16 = 0x29;
+		bb->serial_number_16 = millis();
+		memcpy(bb->label_16, "NO NAME    ", 11);
+		memcpy(bb->fstype_16, "FAT16   ", 8);
 	} else {
-		inodesPerBlock = _blockSize / 2;
+		bb->hidden_sectors_32 = hidden;
+		bb->total_sectors_32 = total;
+		bb->sectors_per_fat_32 = spf;
+		bb->root_start_32 = 2;
+		bb->fs_info_sector_32 = 1;
+		bb->backup_boot_32 = 6;
+		bb->logical_drive_32 = 0x80;
+		bb->extended_signature_32 = 0x29;
+		bb->serial_number_32 = millis();
+		memcpy(bb->label_32, "NO NAME    ", 11);
+		memcpy(bb->fstype_32, "FAT32   ", 8);
 	}
+	buffer[510] = 0x55;
+	buffer[511] = 0xAA;
 
-	uint32_t block = inode / inodesPerBlock;
-	uint32_t inner = inode % inodesPerBlock;
+	if (!_vol->writeBlocks(0, 1, buffer)) {
+		return false;
+	}
 
-    block += _fat_start;
+	if (type == 32) {
+		if (!_vol->writeBlocks(6, 1, buffer)) {
+			return false;
+		}
 
+		struct fsinfo *fsi = (struct fsinfo *)buffer;
+		memset(buffer, 0, bps);
+		fsi->lead_sig = FSINFO_LEAD_SIG;
+		fsi->struct_sig = FSINFO_STRUCT_SIG;
+		fsi->free_count = 0xFFFFFFFFUL;
+		fsi->next_free = 3;
+		fsi->trail_sig = FSINFO_TRAIL_SIG;
+		if (!_vol->writeBlocks(1, 1, buffer)) {
+			return false;
+		}
+	}
 
-	if (_cachedFatNumber != (block)) {
-		if (!_dev->readRelativeSystemBlock(_part, block, _cachedFat)) {
-			_cachedFatNumber = 0xFFFFFFFFUL;
-			return 0;
+	// Empty FATs, with the two reserved entries (and the FAT32 root
+	// directory's cluster) filled in.
+	for (uint32_t f = 0; f < fats; f++) {
+		for (uint32_t i = 0; i < spf; i++) {
+			memset(buffer, 0, bps);
+			if (i == 0) {
+				if (type == 16) {
+					uint16_t *e = (uint16_t *)buffer;
+					e[0] = 0xFFF8;
+					e[1] = 0xFFFF;
+				} else {
+					uint32_t *e = (uint32_t *)buffer;
+					e[0] = 0x0FFFFFF8UL;
+					e[1] = 0x0FFFFFFFUL;
+					e[2] = 0x0FFFFFFFUL;
+				}
+			}
+			if (!_vol->writeBlocks(reserved + f * spf + i, 1, buffer)) {
+				return false;
+			}
 		}
-		_cachedFatNumber = (block);
 	}
-	uint32_t nextInode = 0;
-	if (_type == 32) {
-		nextInode = _cachedFat[(inner * 4)] | (_cachedFat[(inner * 4)+1] << 8) | (_cachedFat[(inner * 4)+2] << 16) | (_cachedFat[(inner * 4)+3] << 24);
-	} else {
-		nextInode = _cachedFat[(inner * 2)] | (_cachedFat[(inner * 2)+1] << 8);
+
+	// Empty root directory.
+	memset(buffer, 0, bps);
+	uint32_t rootStart = reserved + fats * spf;
+	uint32_t rootLength = (type == 16) ? rootSectors : spc;
+	for (uint32_t i = 0; i < rootLength; i++) {
+		if (!_vol->writeBlocks(rootStart + i, 1, buffer)) {
+			return false;
+		}
+	}
+
+	return mount();
+}
+
+// FNV-1a of the name folded to lower case, since FAT names are matched
+// without regard to case.  The length is kept alongside to make collisions
+// rarer still.
+uint32_t Fat::hashName(const char *name, size_t len) {
+	uint32_t hash = 2166136261UL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)tolower(name[i]);
+		hash *= 16777619UL;
 	}
-	return nextInode;
+	return hash;
 }
 
-File Fat::open(const char *filename) {
-	uint32_t inode;
-	uint32_t parent;
+// Work out how many long name entries the name needs and what its 8.3
+// form is, if it is a valid 8.3 name at all.
+void Fat::prepareMatch(struct fat_namematch *match, const char *name, size_t len) {
+	match->name = name;
+	match->len = len;
+	match->slots = (len <= FAT_NAME_MAX) ? (len + 12) / 13 : 0;
 
-	if (filename[0] == '/') {
-		inode = getInode(0, filename+1, &parent);
-	} else {
-		inode = getInode(_cwd, filename+1, &parent);		
+	memset(match->shortName, ' ', 11);
+	match->hasShort = false;
+
+	// "." and ".." are stored as they are.
+	if ((len <= 2) && (name[0] == '.') && (name[len - 1] == '.')) {
+		memcpy(match->shortName, name, len);
+		match->hasShort = true;
+		return;
+	}
+
+	size_t pos = 0;
+	size_t dot = len;
+	for (size_t i = 0; i < len; i++) {
+		char c = name[i];
+		if (c == '.') {
+			if ((dot != len) || (i == 0) || (i > 8)) {
+				return;
+			}
+			dot = i;
+			pos = 8;
+			continue;
+		}
+		if ((c <= ' ') || ((uint8_t)c >= 0x80) || strchr("\"*+,/:;<=>?[\\]|", c)) {
+			return;
+		}
+		if ((dot == len) ? (pos >= 8) : (pos >= 11)) {
+			return;
+		}
+		match->shortName[pos++] = toupper(c);
+	}
+	if ((dot != len) && (dot == len - 1)) {
+		// Trailing dot
+		return;
 	}
-	return File(this, parent, inode, inode == 0 ? false : true);
+	if (match->shortName[0] == 0xE5) {
+		match->shortName[0] = 0x05;
+	}
+	match->hasShort = true;
 }
 
-uint32_t Fat::getInodeSize(uint32_t parent, uint32_t child) {
-	uint8_t block[_blockSize];
-	uint32_t offset = 0;
-	if (parent == 0) {
-		offset = _root_block;
-	} else {
-		offset = _data_start + ((parent - 2) * _cluster_size);
+// Compare the part of the name held in one long name entry.
+bool Fat::matchFragment(const struct fat_namematch *match, const struct fat_lfnent *lfn, uint8_t ordinal) {
+	uint16_t chars[13];
+	memcpy(chars, lfn->lfn1, 10);
+	memcpy(chars + 5, lfn->lfn2, 12);
+	memcpy(chars + 11, lfn->lfn3, 4);
+
+	size_t base = (ordinal - 1) * 13;
+	for (int j = 0; j < 13; j++) {
+		size_t pos = base + j;
+		if (pos == match->len) {
+			// The name must stop here too.
+			return chars[j] == 0;
+		}
+		uint8_t c = match->name[pos];
+		if (chars[j] >= 0x80) {
+			if (chars[j] != c) {
+				return false;
+			}
+		} else if (tolower(chars[j]) != tolower(c)) {
+			return false;
+		}
 	}
+	return true;
+}
 
-	bool done = false;
-	while (!done) {
-		if (!_dev->readRelativeSystemBlock(0, offset, block)) {
-			return 0;
+// Copy the part of a long name held in one entry into place.  Characters
+// past 0xFF can never be matched, so a name holding one isn't worth keeping
+// and false is returned.
+bool Fat::collectFragment(const struct fat_lfnent *lfn, uint8_t ordinal, char *name, size_t *len) {
+	uint16_t chars[13];
+	memcpy(chars, lfn->lfn1, 10);
+	memcpy(chars + 5, lfn->lfn2, 12);
+	memcpy(chars + 11, lfn->lfn3, 4);
+
+	size_t base = (ordinal - 1) * 13;
+	for (int j = 0; (j < 13) && (base + j < *len); j++) {
+		if (chars[j] == 0) {
+			*len = base + j;
+			break;
 		}
-		struct fat_dirent *p = (struct fat_dirent *)block;
-		for (uint32_t i = 0; i < _blockSize / sizeof(struct fat_dirent); i++) {
-			if ((p[i].attribs & ATTR_LFN) == ATTR_LFN) {
-				continue;
+		if (chars[j] > 0xFF) {
+			return false;
+		}
+		name[base + j] = chars[j];
+	}
+	return true;
+}
+
+uint8_t Fat::lfnChecksum(const uint8_t *shortName) {
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++) {
+		sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+	}
+	return sum;
+}
+
+// The hash only narrows it down - two names can share one, so the name
+// itself has to match too.
+struct fat_dentry *Fat::lookupDentry(uint32_t parent, uint32_t hash, const char *name, size_t len) {
+	if (len > FAT_DENTRY_NAME) {
+		return NULL;
+	}
+	for (int i = 0; i < FAT_DENTRY_CACHE; i++) {
+		if ((_dentry[i].used != 0) && (_dentry[i].hash == hash) &&
+			(_dentry[i].parent == parent) && (_dentry[i].length == len)) {
+			size_t j;
+			for (j = 0; j < len; j++) {
+				if (tolower(_dentryName[i][j]) != tolower(name[j])) {
+					break;
+				}
 			}
-	
-			if (p[i].attribs & ATTR_VOLUME) {
+			if (j < len) {
 				continue;
 			}
-	
-			if (p[i].filename[0] == 0) {
-				done = true;
-				break;
-			}
-
-			uint32_t cluster = (p[i].cluster_high << 16) | p[i].cluster_low;
-			if (cluster == child) {
-				return p[i].size;
-			}
+			_dentry[i].used = ++_dentryClock;
+			return &_dentry[i];
 		}
-		offset++;
-	}	
-	return 0;	
+	}
+	return NULL;
 }
 
-int Fat::readFileByte(uint32_t start, uint32_t offset) {
-	uint32_t clusterNumber = offset / (_cluster_size * _blockSize);
-	uint32_t clusterOffset = offset % (_cluster_size * _blockSize);
-	uint32_t clusterBlock = clusterOffset / _blockSize;
-	uint32_t blockOffset = clusterOffset % _blockSize;
-
-	uint32_t inode = start;
-	for (uint32_t i = 0; i < clusterNumber; i++) {
-		inode = getNextInode(inode);
+void Fat::cacheDentry(uint32_t parent, uint32_t hash, const char *name, size_t len, struct fat_dentry *entry) {
+	if (len > FAT_DENTRY_NAME) {
+		return;
+	}
+	int oldest = 0;
+	for (int i = 0; i < FAT_DENTRY_CACHE; i++) {
+		if (_dentry[i].used < _dentry[oldest].used) {
+			oldest = i;
+		}
 	}
+	_dentry[oldest] = *entry;
+	_dentry[oldest].parent = parent;
+	_dentry[oldest].hash = hash;
+	_dentry[oldest].length = len;
+	_dentry[oldest].used = ++_dentryClock;
+	memcpy(_dentryName[oldest], name, len);
+}
 
-	uint32_t block = (inode - 2) * _cluster_size + clusterBlock + _data_start;
+// Forget everything cached about a directory, or everything at all if
+// given 0xFFFFFFFF.  Anything that changes a directory must call this, with
+// names false if it only changed what the entries say and not what they're
+// called.  The index isn't dropped for one directory - anything that changes
+// names must keep it up to date itself.
+void Fat::invalidateDentries(uint32_t parent, bool names) {
+	for (int i = 0; i < FAT_DENTRY_CACHE; i++) {
+		if ((parent == 0xFFFFFFFFUL) || (_dentry[i].parent == parent)) {
+			_dentry[i].used = 0;
+		}
+	}
+	if (!names) {
+		return;
+	}
+	for (int i = 0; i < FAT_BLOOM_CACHE; i++) {
+		if ((parent == 0xFFFFFFFFUL) || (_bloom[i].parent == parent)) {
+			_bloom[i].used = 0;
+		}
+	}
+	if (parent == 0xFFFFFFFFUL) {
+		dropIndex();
+	}
+}
 
-	if (block != _cachedBlockNumber) {
-		_dev->readRelativeBlock(_part, block, _cachedBlock);
-		_cachedBlockNumber = block;
-		
+struct fat_bloom *Fat::findBloom(uint32_t parent) {
+	for (int i = 0; i < FAT_BLOOM_CACHE; i++) {
+		if ((_bloom[i].used != 0) && (_bloom[i].parent == parent)) {
+			_bloom[i].used = ++_dentryClock;
+			return &_bloom[i];
+		}
 	}
+	return NULL;
+}
 
-	return _cachedBlock[blockOffset];
+void Fat::storeBloom(uint32_t parent, const uint8_t *bits) {
+	int oldest = 0;
+	for (int i = 0; i < FAT_BLOOM_CACHE; i++) {
+		if (_bloom[i].used < _bloom[oldest].used) {
+			oldest = i;
+		}
+	}
+	_bloom[oldest].parent = parent;
+	_bloom[oldest].used = ++_dentryClock;
+	memcpy(_bloom[oldest].bits, bits, FAT_BLOOM_BITS / 8);
 }
 
-int Fat::readClusterByte(uint32_t inode, uint32_t offset) {
-	uint32_t clusterBlock = offset / _blockSize;
-	uint32_t blockOffset = offset % _blockSize;
+// The bits for a name come from its hash, stepped on by a rotated copy of
+// itself (double hashing).
+void Fat::bloomAdd(uint8_t *bits, uint32_t hash) {
+	uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+	for (int i = 0; i < FAT_BLOOM_HASHES; i++) {
+		uint32_t bit = hash & (FAT_BLOOM_BITS - 1);
+		bits[bit >> 3] |= 1 << (bit & 7);
+		hash += step;
+	}
+}
 
-	uint32_t block = (inode - 2) * _cluster_size + clusterBlock + _data_start;
-	if (block != _cachedBlockNumber) {	
-		_dev->readRelativeBlock(_part, block, _cachedBlock);
-		_cachedBlockNumber = block;
+bool Fat::bloomTest(const uint8_t *bits, uint32_t hash) {
+	uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+	for (int i = 0; i < FAT_BLOOM_HASHES; i++) {
+		uint32_t bit = hash & (FAT_BLOOM_BITS - 1);
+		if (!(bits[bit >> 3] & (1 << (bit & 7)))) {
+			return false;
+		}
+		hash += step;
 	}
-	return _cachedBlock[blockOffset];
+	return true;
 }
 
-uint32_t Fat::readFileBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len) {
+// Hash an 8.3 name the way it would be typed - "NAME.EXT" - so it lands on
+// the same bits as any name prepareMatch() would turn into it.
+uint32_t Fat::hashShortName(const uint8_t *shortName) {
+	char name[12];
+	size_t len = 0;
+	for (int i = 0; (i < 8) && (shortName[i] != ' '); i++) {
+		name[len++] = ((i == 0) && (shortName[0] == 0x05)) ? 0xE5 : shortName[i];
+	}
+	if (shortName[8] != ' ') {
+		name[len++] = '.';
+		for (int i = 8; (i < 11) && (shortName[i] != ' '); i++) {
+			name[len++] = shortName[i];
+		}
+	}
+	return hashName(name, len);
+}
 
-	uint32_t currentBlock = 0xFFFFFFFFUL;
-	uint8_t data[_blockSize];
-	uint32_t numRead = 0;
+void Fat::printLookupStats() {
+	Serial.print("Filter rejects: ");
+	Serial.println(_bloomRejects);
+	Serial.print("Filter passes: ");
+	Serial.println(_bloomPasses);
+	Serial.print("False positives: ");
+	Serial.println(_bloomFalse);
+	Serial.print("False positive percent: ");
+	Serial.print((_bloomFalse + _bloomRejects) ? (_bloomFalse * 100) / (_bloomFalse + _bloomRejects) : 0);
+	Serial.println("%");
+}
 
-	uint32_t clusterNumber = (offset) / (_cluster_size * _blockSize);
-	uint32_t clusterOffset = (offset) % (_cluster_size * _blockSize);
-	uint32_t clusterBlock = clusterOffset / _blockSize;
-	uint32_t blockOffset = clusterOffset % _blockSize;
-	uint32_t relativeBlock = clusterNumber * _cluster_size + clusterBlock;
+// Walk a directory on from wherever "dir" is, looking for a name, and fill
+// in "found" if it's there.  With "one" set it stops after the first file,
+// to check a place the index pointed at.  If "collect" is given it's handed
+// the hash of every name passed and where that file's entries start.
+// Returns false, with errno 0, if the name isn't there.
+bool Fat::scanDirectory(struct fat_dir *dir, const struct fat_namematch *match, struct fat_dentry *found, NameCollector collect, bool one) {
+	// Long name entries are checked against the name as they go past, last
+	// part first, so most names are rejected at the first entry.
+	bool lfnMatch = false;
+	uint8_t expect = 0;
+	uint8_t checksum = 0;
 
-	uint32_t inode = start;
+	// Collecting names needs each long name whole.
+	char longName[(collect != NULL) ? FAT_NAME_MAX : 1];
+	size_t longLen = 0;
+	uint8_t longExpect = 0;
+	uint8_t longChecksum = 0;
+	uint32_t startBlock = 0;
+	uint16_t startIndex = 0;
 
-	for (uint32_t j = 0; j < clusterNumber; j++) {
-		inode = getNextInode(inode);
-	}
-	uint32_t currentCluster = clusterNumber;
+	struct fat_dirent *p;
+	uint32_t block;
+	uint16_t index;
+	while ((p = nextDirent(dir, &block, &index)) != NULL) {
+		if (p->filename[0] == 0) {
+			errno = 0;
+			break;
+		}
 
-	for (uint32_t i = 0; i < len; i++) {
-		clusterNumber = (offset + i) / (_cluster_size * _blockSize);
-		clusterOffset = (offset + i) % (_cluster_size * _blockSize);
-		clusterBlock = clusterOffset / _blockSize;
-		blockOffset = clusterOffset % _blockSize;
-		relativeBlock = clusterNumber * _cluster_size + clusterBlock;
-		
-		if (currentBlock != relativeBlock) {
-			currentBlock = relativeBlock;
-			uint32_t inode = start;
+		if (p->filename[0] == 0xE5) {
+			lfnMatch = false;
+			longLen = 0;
+			continue;
+		}
 
-			if (currentCluster != clusterNumber) {
-				currentCluster++;
-				inode = getNextInode(inode);
+		if ((p->attribs & ATTR_LFN) == ATTR_LFN) {
+			struct fat_lfnent *lfn = (struct fat_lfnent *)p;
+			uint8_t ordinal = lfn->ordinal & 0x3F;
+			if (match == NULL) {
+				// Only collecting.
+			} else if (lfn->ordinal & 0x40) {
+				lfnMatch = (ordinal == match->slots) && matchFragment(match, lfn, ordinal);
+				checksum = lfn->checksum;
+				expect = ordinal - 1;
+			} else if (lfnMatch) {
+				lfnMatch = (ordinal == expect) && (lfn->checksum == checksum) && matchFragment(match, lfn, ordinal);
+				expect--;
+			}
+			if (collect != NULL) {
+				if (lfn->ordinal & 0x40) {
+					longLen = min((uint32_t)ordinal * 13, (uint32_t)FAT_NAME_MAX);
+					longChecksum = lfn->checksum;
+					longExpect = ordinal;
+					startBlock = block;
+					startIndex = index;
+				}
+				if ((longLen != 0) && (ordinal == longExpect) && (lfn->checksum == longChecksum) &&
+					collectFragment(lfn, ordinal, longName, &longLen)) {
+					longExpect = ordinal - 1;
+				} else {
+					longLen = 0;
+				}
 			}
-			uint32_t thisBlock = (inode - 2) * _cluster_size + clusterBlock + _data_start;
+			continue;
+		}
 
-			if (!_dev->readRelativeBlock(_part, thisBlock, data)) {
-				break;
+		if (p->attribs & ATTR_VOLUME) {
+			lfnMatch = false;
+			longLen = 0;
+			continue;
+		}
+
+		if (collect != NULL) {
+			if ((longLen != 0) && (longExpect == 0) && (lfnChecksum((const uint8_t *)p->filename) == longChecksum)) {
+				(this->*collect)(hashName(longName, longLen), startBlock, startIndex);
+				(this->*collect)(hashShortName((const uint8_t *)p->filename), startBlock, startIndex);
+			} else {
+				(this->*collect)(hashShortName((const uint8_t *)p->filename), block, index);
 			}
+			longLen = 0;
 		}
-		numRead++;
-		buffer[i] = data[blockOffset];
-	}
 
-	return numRead;
+		bool hit = (match != NULL) &&
+			((lfnMatch && (expect == 0) && (lfnChecksum((const uint8_t *)p->filename) == checksum)) ||
+			(match->hasShort && !memcmp(p->filename, match->shortName, 11)));
+		lfnMatch = false;
+
+		if (hit) {
+			found->flags = 0;
+			found->attribs = p->attribs;
+			found->cluster = ((uint32_t)p->cluster_high << 16) | p->cluster_low;
+			found->size = p->size;
+			found->date = p->write_date;
+			found->time = p->write_time;
+			found->block = block;
+			found->index = index;
+			errno = 0;
+			return true;
+		}
+		if (one) {
+			errno = 0;
+			break;
+		}
+	}
+	return false;
 }
 
-uint32_t Fat::readClusterBytes(uint32_t inode, uint32_t offset, uint8_t *buffer, uint32_t len) {
+// Look a name up in a directory, returning its first cluster and, if asked,
+// the whole of its entry.  An empty file has no cluster, so it's errno that
+// says whether the name was found.
+uint32_t Fat::findDirectoryEntry(uint32_t parent, const char *name, size_t len, struct fat_dentry *entry) {
+	uint32_t hash = hashName(name, len);
+	struct fat_dentry found;
 
-	uint32_t currentBlock = 0xFFFFFFFFUL;
-	uint32_t numRead = 0;
-	
-	for (uint32_t i = 0; i < len; i++) {
-		uint32_t clusterBlock = (offset + i) / _blockSize;
-		uint32_t blockOffset = (offset + i) % _blockSize;
-		
-		if (currentBlock != clusterBlock) {
-			currentBlock = clusterBlock;
-
-			uint32_t thisBlock = (inode - 2) * _cluster_size + clusterBlock + _data_start;
-			if (thisBlock != _cachedBlockNumber) {
-				if (!_dev->readRelativeBlock(_part, thisBlock, _cachedBlock)) {
-					break;
-				}
-				_cachedBlockNumber = thisBlock;
+	struct fat_dentry *cached = lookupDentry(parent, hash, name, len);
+	if (cached != NULL) {
+		if (cached->flags & DENTRY_NEGATIVE) {
+			errno = ENOENT;
+			return 0;
+		}
+		if (entry != NULL) {
+			*entry = *cached;
+		}
+		errno = 0;
+		return cached->cluster;
+	}
+
+	struct fat_namematch match;
+	prepareMatch(&match, name, len);
+
+	struct fat_dir dir;
+	bool hit = false;
+
+	if ((_index != NULL) && (_indexParent == parent)) {
+		// Only the files with the same hash need looking at.
+		for (uint32_t i = findIndex(hash); (i < _indexCount) && (_index[i].hash == hash) && !hit; i++) {
+			seekDir(&dir, _index[i].block, _index[i].index);
+			hit = scanDirectory(&dir, &match, &found, NULL, true);
+			if (!hit && (errno != 0)) {
+				return 0;
+			}
+		}
+	} else {
+		// Most names that aren't there can be turned away without reading
+		// the directory at all.
+		struct fat_bloom *bloom = findBloom(parent);
+		if (bloom != NULL) {
+			if (!bloomTest(bloom->bits, hash)) {
+				_bloomRejects++;
+				errno = ENOENT;
+				return 0;
+			}
+			_bloomPasses++;
+		}
+
+		if (!openDir(parent, &dir)) {
+			return 0;
+		}
+
+		// Without a filter for the directory, one is built on the way
+		// through.
+		uint8_t bits[(bloom == NULL) ? FAT_BLOOM_BITS / 8 : 1];
+		if (bloom == NULL) {
+			memset(bits, 0, sizeof(bits));
+			_bloomBuild = bits;
+		}
+		hit = scanDirectory(&dir, &match, &found, (bloom == NULL) ? &Fat::collectBloom : NULL, false);
+		if (!hit) {
+			if (errno != 0) {
+				return 0;
+			}
+			if (bloom == NULL) {
+				storeBloom(parent, bits);
+			} else {
+				_bloomFalse++;
 			}
 		}
-		numRead++;
-		buffer[i] = _cachedBlock[blockOffset];
 	}
 
-	return numRead;
+	if (hit) {
+		cacheDentry(parent, hash, name, len, &found);
+		if (entry != NULL) {
+			*entry = found;
+		}
+		errno = 0;
+		return found.cluster;
+	}
+
+	// Remember that it isn't there, too.
+	found.flags = DENTRY_NEGATIVE;
+	found.cluster = 0;
+	cacheDentry(parent, hash, name, len, &found);
+	errno = ENOENT;
+	return 0;	
+}
+
+void Fat::collectBloom(uint32_t hash, uint32_t block, uint16_t index) {
+	bloomAdd(_bloomBuild, hash);
+}
+
+// Names go on the end while the index is built, and are sorted after.  The
+// count carries on past the end if they don't fit, to show they didn't.
+void Fat::collectIndex(uint32_t hash, uint32_t block, uint16_t index) {
+	if (_indexCount < _indexMax) {
+		_index[_indexCount].hash = hash;
+		_index[_indexCount].block = block;
+		_index[_indexCount].index = index;
+	}
+	_indexCount++;
+}
+
+int Fat::compareIndex(const void *a, const void *b) {
+	uint32_t ha = ((const struct fat_index *)a)->hash;
+	uint32_t hb = ((const struct fat_index *)b)->hash;
+	return (ha < hb) ? -1 : (ha > hb) ? 1 : 0;
+}
+
+// Where in the index the first name with this hash is, or would go.
+uint32_t Fat::findIndex(uint32_t hash) {
+	uint32_t lo = 0;
+	uint32_t hi = _indexCount;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (_index[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+bool Fat::insertIndex(uint32_t hash, uint32_t block, uint16_t index) {
+	if (_indexCount >= _indexMax) {
+		return false;
+	}
+	uint32_t i = findIndex(hash);
+	memmove(&_index[i + 1], &_index[i], (_indexCount - i) * sizeof(struct fat_index));
+	_index[i].hash = hash;
+	_index[i].block = block;
+	_index[i].index = index;
+	_indexCount++;
+	return true;
+}
+
+// Point a directory iterator at a given entry.
+void Fat::seekDir(struct fat_dir *dir, uint32_t block, uint16_t index) {
+	if (block < _data_start) {
+		dir->cluster = 0;
+		dir->block = block - _root_block;
+	} else {
+		dir->cluster = ((block - _data_start) >> _clusterShift) + 2;
+		dir->block = (block - _data_start) & (_cluster_size - 1);
+	}
+	dir->entry = index;
+	dir->done = false;
+}
+
+bool Fat::indexDirectory(const char *path, void *memory, size_t bytes) {
+	dropIndex();
+
+	struct file_record record;
+	if (!lookup(path, &record)) {
+		return false;
+	}
+	if (!(record.attribs & ATTR_DIRECTORY)) {
+		errno = ENOTDIR;
+		return false;
+	}
+
+	// The memory may come from anywhere, so line it up.
+	uintptr_t start = ((uintptr_t)memory + sizeof(uint32_t) - 1) & ~(uintptr_t)(sizeof(uint32_t) - 1);
+	if (bytes < start - (uintptr_t)memory) {
+		errno = ENOMEM;
+		return false;
+	}
+	_index = (struct fat_index *)start;
+	_indexMax = (bytes - (start - (uintptr_t)memory)) / sizeof(struct fat_index);
+	_indexCount = 0;
+
+	struct fat_dir dir;
+	openDir(record.cluster, &dir);
+	scanDirectory(&dir, NULL, NULL, &Fat::collectIndex, false);
+	if (errno != 0) {
+		dropIndex();
+		return false;
+	}
+	if (_indexCount > _indexMax) {
+		dropIndex();
+		errno = ENOMEM;
+		return false;
+	}
+	qsort(_index, _indexCount, sizeof(struct fat_index), compareIndex);
+	_indexParent = record.cluster;
+	return true;
+}
+
+void Fat::dropIndex() {
+	_index = NULL;
+	_indexCount = 0;
+	_indexMax = 0;
+}
+
+// Make up a unique 8.3 alias for a long name, NAME~N.EXT style.
+bool Fat::makeShortName(uint32_t parent, const char *name, size_t len, uint8_t *shortName) {
+	const char *dot = NULL;
+	for (size_t i = 1; i < len; i++) {
+		if (name[i] == '.') {
+			dot = name + i;
+		}
+	}
+
+	// Upper case, without spaces or dots, and '_' for anything that isn't
+	// allowed in a short name.
+	char base[8];
+	char ext[3];
+	int baseLen = 0;
+	int extLen = 0;
+	const char *end = (dot != NULL) ? dot : name + len;
+	for (const char *c = name; (c < end) && (baseLen < 8); c++) {
+		if ((*c == ' ') || (*c == '.')) {
+			continue;
+		}
+		base[baseLen++] = (((uint8_t)*c >= 0x80) || strchr("+,;=[]", *c)) ? '_' : toupper(*c);
+	}
+	for (const char *c = (dot != NULL) ? dot + 1 : end; (c < name + len) && (extLen < 3); c++) {
+		if (*c == ' ') {
+			continue;
+		}
+		ext[extLen++] = (((uint8_t)*c >= 0x80) || strchr("+,;=[]", *c)) ? '_' : toupper(*c);
+	}
+	if (baseLen == 0) {
+		base[baseLen++] = '_';
+	}
+
+	uint8_t extPad[3];
+	memset(extPad, ' ', 3);
+	memcpy(extPad, ext, extLen);
+
+	// One pass through the directory marks which ~N tails this base and
+	// extension already have, a window of FAT_ALIAS_WINDOW at a time, and
+	// the lowest one left over is taken.
+	for (uint32_t from = 1; from < 1000000UL; from += FAT_ALIAS_WINDOW) {
+		uint8_t taken[FAT_ALIAS_WINDOW / 8];
+		memset(taken, 0, sizeof(taken));
+
+		struct fat_dir dir;
+		struct fat_dirent *p;
+		uint32_t block;
+		uint16_t index;
+		openDir(parent, &dir);
+		while ((p = nextDirent(&dir, &block, &index)) != NULL) {
+			if (p->filename[0] == 0) {
+				break;
+			}
+			if ((p->filename[0] == 0xE5) || (p->attribs & ATTR_VOLUME)) {
+				continue;
+			}
+			if (memcmp(p->extension, extPad, 3) != 0) {
+				continue;
+			}
+
+			// NAME~123 - digits back from the end of the name, then the '~'
+			int t = 8;
+			while ((t > 0) && (p->filename[t - 1] == ' ')) {
+				t--;
+			}
+			int digits = t;
+			uint32_t n = 0;
+			while ((t > 0) && isdigit(p->filename[t - 1])) {
+				t--;
+			}
+			digits -= t;
+			if ((digits == 0) || (digits > 6) || (t == 0) || (p->filename[t - 1] != '~') || (p->filename[t] == '0')) {
+				continue;
+			}
+			for (int i = 0; i < digits; i++) {
+				n = (n * 10) + (p->filename[t + i] - '0');
+			}
+			t--;
+			if ((t != min(baseLen, 8 - (digits + 1))) || (memcmp(p->filename, base, t) != 0)) {
+				continue;
+			}
+			if ((n >= from) && (n - from < FAT_ALIAS_WINDOW)) {
+				taken[(n - from) / 8] |= 1 << ((n - from) % 8);
+			}
+		}
+		if (errno != 0) {
+			return false;
+		}
+
+		for (uint32_t i = 0; (i < FAT_ALIAS_WINDOW) && (from + i < 1000000UL); i++) {
+			if (taken[i / 8] & (1 << (i % 8))) {
+				continue;
+			}
+			uint32_t n = from + i;
+			char tail[8];
+			int tailLen = sprintf(tail, "~%lu", (unsigned long)n);
+			int keep = min(baseLen, 8 - tailLen);
+
+			char alias[13];
+			int aliasLen = 0;
+			memset(shortName, ' ', 11);
+			memcpy(shortName, base, keep);
+			memcpy(shortName + keep, tail, tailLen);
+			memcpy(shortName + 8, ext, extLen);
+			memcpy(alias, shortName, keep + tailLen);
+			aliasLen = keep + tailLen;
+			if (extLen > 0) {
+				alias[aliasLen++] = '.';
+				memcpy(alias + aliasLen, ext, extLen);
+				aliasLen += extLen;
+			}
+
+			// No short name has it, but a long name still could.
+			findDirectoryEntry(parent, alias, aliasLen);
+			if (errno == ENOENT) {
+				errno = 0;
+				return true;
+			}
+			if (errno != 0) {
+				return false;
+			}
+		}
+	}
+	errno = EEXIST;
+	return false;
+}
+
+// Add an entry for a new, empty file or directory, with long name entries
+// in front of it if the name needs them.  The directory is grown if there
+// isn't a long enough run of free entries in it.
+bool Fat::addDirectoryEntry(uint32_t parent, const char *name, size_t len, uint8_t attribs, struct fat_dentry *entry) {
+	if (len > FAT_NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (((uint8_t)name[i] < ' ') || strchr("\"*/:<>?\\|", name[i])) {
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	struct fat_namematch match;
+	prepareMatch(&match, name, len);
+
+	// Keep the case of anything that isn't all upper case in a long name.
+	bool needLfn = !match.hasShort;
+	for (size_t i = 0; i < len; i++) {
+		if (islower(name[i])) {
+			needLfn = true;
+		}
+	}
+
+	uint8_t shortName[11];
+	if (needLfn) {
+		if (!makeShortName(parent, name, len, shortName)) {
+			return false;
+		}
+	} else {
+		memcpy(shortName, match.shortName, 11);
+	}
+	uint8_t slots = needLfn ? match.slots + 1 : 1;
+
+	// Find a run of free entries long enough ...
+	uint32_t runBlock[(FAT_NAME_MAX + 12) / 13 + 1];
+	uint16_t runIndex[(FAT_NAME_MAX + 12) / 13 + 1];
+	uint8_t run = 0;
+
+	struct fat_dir dir;
+	struct fat_dirent *p;
+	uint32_t block;
+	uint16_t index;
+	openDir(parent, &dir);
+	while ((run < slots) && ((p = nextDirent(&dir, &block, &index)) != NULL)) {
+		if ((p->filename[0] == 0) || (p->filename[0] == 0xE5)) {
+			runBlock[run] = block;
+			runIndex[run++] = index;
+		} else {
+			run = 0;
+		}
+	}
+
+	// ... or carry it on into new clusters on the end.
+	if (run < slots) {
+		if (errno != 0) {
+			return false;
+		}
+		if (dir.cluster == 0) {
+			// The FAT16 root directory can't grow.
+			errno = ENOSPC;
+			return false;
+		}
+		uint32_t perBlock = _blockSize / sizeof(struct fat_dirent);
+		uint32_t last = dir.cluster;
+		while (run < slots) {
+			uint32_t cluster = allocateCluster(last);
+			if ((cluster == 0) || !zeroCluster(cluster)) {
+				return false;
+			}
+			uint32_t first = _data_start + ((cluster - 2) << _clusterShift);
+			for (uint32_t i = 0; (i < (_cluster_size * perBlock)) && (run < slots); i++) {
+				runBlock[run] = first + (i / perBlock);
+				runIndex[run++] = i % perBlock;
+			}
+			last = cluster;
+		}
+	}
+
+	uint8_t checksum = lfnChecksum(shortName);
+	for (uint8_t i = 0; i < slots; i++) {
+		uint8_t *data = _vol->lockBlock(runBlock[i]);
+		if (data == NULL) {
+			return false;
+		}
+		struct fat_dirent *d = (struct fat_dirent *)data + runIndex[i];
+		memset(d, 0, sizeof(struct fat_dirent));
+
+		if (i < slots - 1) {
+			// Long name parts go last part first.
+			struct fat_lfnent *lfn = (struct fat_lfnent *)d;
+			uint8_t ordinal = slots - 1 - i;
+			lfn->ordinal = ordinal | ((i == 0) ? 0x40 : 0);
+			lfn->attribs = ATTR_LFN;
+			lfn->checksum = checksum;
+
+			uint16_t chars[13];
+			size_t base = (ordinal - 1) * 13;
+			for (int j = 0; j < 13; j++) {
+				size_t pos = base + j;
+				chars[j] = (pos < len) ? (uint8_t)name[pos] : (pos == len) ? 0x0000 : 0xFFFF;
+			}
+			memcpy(lfn->lfn1, chars, 10);
+			memcpy(lfn->lfn2, chars + 5, 12);
+			memcpy(lfn->lfn3, chars + 11, 4);
+		} else {
+			memcpy(d->filename, shortName, 8);
+			memcpy(d->extension, shortName + 8, 3);
+			d->attribs = attribs;
+			d->update_date = FAT_DEFAULT_DATE;
+			d->access_date = FAT_DEFAULT_DATE;
+			d->write_date = FAT_DEFAULT_DATE;
+		}
+		_vol->unlockBlock(runBlock[i], true);
+	}
+
+	_dirBufferCount = 0;
+	invalidateDentries(parent);
+
+	// Keep the index up to date rather than losing it.
+	if ((_index != NULL) && (_indexParent == parent)) {
+		bool ok = insertIndex(hashShortName(shortName), runBlock[0], runIndex[0]);
+		if (ok && needLfn) {
+			ok = insertIndex(hashName(name, len), runBlock[0], runIndex[0]);
+		}
+		if (!ok) {
+			dropIndex();
+		}
+	}
+
+	entry->flags = 0;
+	entry->attribs = attribs;
+	entry->cluster = 0;
+	entry->size = 0;
+	entry->date = FAT_DEFAULT_DATE;
+	entry->time = 0;
+	entry->block = runBlock[slots - 1];
+	entry->index = runIndex[slots - 1];
+	return true;
+}
+
+// Write a file's first cluster and size back into its directory entry.
+bool Fat::updateInode(uint32_t parent, uint32_t entryBlock, uint16_t entryIndex, uint32_t inode, uint32_t size) {
+	uint8_t *data = _vol->lockBlock(entryBlock);
+	if (data == NULL) {
+		return false;
+	}
+	struct fat_dirent *d = (struct fat_dirent *)data + entryIndex;
+	d->cluster_high = inode >> 16;
+	d->cluster_low = inode & 0xFFFF;
+	d->size = size;
+	d->attribs |= ATTR_ARCHIVE;
+	d->write_date = FAT_DEFAULT_DATE;
+	_vol->unlockBlock(entryBlock, true);
+
+	if ((entryBlock >= _dirBufferBlock) && (entryBlock < _dirBufferBlock + _dirBufferCount)) {
+		_dirBufferCount = 0;
+	}
+	// No names changed.
+	invalidateDentries(parent, false);
+	return true;
+}
+
+bool Fat::openDir(uint32_t cluster, struct fat_dir *dir) {
+	if ((cluster == 0) && (_type == 32)) {
+		cluster = _root_cluster;
+	}
+	dir->cluster = cluster;
+	dir->block = 0;
+	dir->entry = 0;
+	dir->done = false;
+	errno = 0;
+	return true;
+}
+
+bool Fat::openDir(const char *path, struct fat_dir *dir) {
+	uint8_t attribs;
+	uint32_t cluster = resolvePath((path[0] == '/') ? 0 : _cwd, path, NULL, &attribs);
+	if (errno != 0) {
+		return false;
+	}
+	if (!(attribs & ATTR_DIRECTORY)) {
+		errno = ENOTDIR;
+		return false;
+	}
+	return openDir(cluster, dir);
+}
+
+// Step to the next raw 32-byte entry of a directory, following its cluster
+// chain and reading FAT_DIR_BLOCKS blocks at a time.  The pointer is only
+// good until the next call.
+struct fat_dirent *Fat::nextDirent(struct fat_dir *dir, uint32_t *block, uint16_t *index) {
+	uint32_t perBlock = _blockSize / sizeof(struct fat_dirent);
+
+	if (dir->done) {
+		errno = 0;
+		return NULL;
+	}
+
+	if (dir->entry == perBlock) {
+		dir->entry = 0;
+		dir->block++;
+	}
+
+	uint32_t first;
+	uint32_t blocks;
+	if (dir->cluster == 0) {
+		first = _root_block;
+		blocks = _root_sectors;
+	} else {
+		first = _data_start + ((dir->cluster - 2) * _cluster_size);
+		blocks = _cluster_size;
+	}
+
+	if (dir->block == blocks) {
+		if (dir->cluster == 0) {
+			dir->done = true;
+			errno = 0;
+			return NULL;
+		}
+		uint32_t next = getNextInode(dir->cluster);
+		if (isEndOfChain(next)) {
+			dir->done = true;
+			errno = 0;
+			return NULL;
+		}
+		dir->cluster = next;
+		dir->block = 0;
+		first = _data_start + ((next - 2) * _cluster_size);
+	}
+
+	uint32_t vb = first + dir->block;
+	if ((vb < _dirBufferBlock) || (vb >= _dirBufferBlock + _dirBufferCount)) {
+		uint32_t count = min((uint32_t)FAT_DIR_BLOCKS, blocks - dir->block);
+		if (!_vol->readBlocks(vb, count, _dirBuffer)) {
+			_dirBufferCount = 0;
+			dir->done = true;
+			return NULL;
+		}
+		_dirBufferBlock = vb;
+		_dirBufferCount = count;
+	}
+
+	*block = vb;
+	*index = dir->entry;
+	struct fat_dirent *p = (struct fat_dirent *)(_dirBuffer + ((vb - _dirBufferBlock) * _blockSize));
+	return &p[dir->entry++];
+}
+
+bool Fat::readDir(struct fat_dir *dir, struct fat_direntry *entry) {
+	bool has_lfn = false;
+	uint8_t checksum = 0;
+	struct fat_dirent *p;
+	uint32_t block;
+	uint16_t index;
+
+	while ((p = nextDirent(dir, &block, &index)) != NULL) {
+		if (p->filename[0] == 0) {
+			dir->done = true;
+			errno = 0;
+			return false;
+		}
+
+		// Deleted
+		if (p->filename[0] == 0xE5) {
+			has_lfn = false;
+			continue;
+		}
+
+		if ((p->attribs & ATTR_LFN) == ATTR_LFN) {
+			struct fat_lfnent *lfn = (struct fat_lfnent *)p;
+			uint8_t ordinal = lfn->ordinal & 0x3F;
+			if ((ordinal == 0) || (ordinal > (FAT_NAME_MAX + 12) / 13)) {
+				has_lfn = false;
+				continue;
+			}
+			uint32_t chunk = (ordinal - 1) * 13;
+			// The last part comes first, and says how long the name is.
+			if (lfn->ordinal & 0x40) {
+				has_lfn = true;
+				checksum = lfn->checksum;
+				entry->name[min(chunk + 13, (uint32_t)FAT_NAME_MAX)] = 0;
+			} else if (lfn->checksum != checksum) {
+				has_lfn = false;
+			}
+			uint16_t chars[13];
+			memcpy(chars, lfn->lfn1, 10);
+			memcpy(chars + 5, lfn->lfn2, 12);
+			memcpy(chars + 11, lfn->lfn3, 4);
+			for (int j = 0; (j < 13) && (chunk + j < FAT_NAME_MAX); j++) {
+				if (chars[j] == 0) {
+					entry->name[chunk + j] = 0;
+					break;
+				}
+				entry->name[chunk + j] = (chars[j] < 0x80) ? chars[j] : '?';
+			}
+			continue;
+		}
+
+		if (p->attribs & ATTR_VOLUME) {
+			has_lfn = false;
+			continue;
+		}
+
+		memcpy(entry->shortName, p->filename, 8);
+		memcpy(entry->shortName + 8, p->extension, 3);
+		entry->attribs = p->attribs;
+		entry->cluster = ((uint32_t)p->cluster_high << 16) | p->cluster_low;
+		entry->size = p->size;
+		entry->date = p->write_date;
+		entry->time = p->write_time;
+		entry->block = block;
+		entry->index = index;
+
+		// A long name left behind by something that doesn't know about
+		// them belongs to a different short entry.
+		if (has_lfn && (lfnChecksum(entry->shortName) != checksum)) {
+			has_lfn = false;
+		}
+
+		if (!has_lfn) {
+			int len = 0;
+			for (int j = 0; (j < 8) && (p->filename[j] != ' '); j++) {
+				entry->name[len++] = p->filename[j];
+			}
+			if (p->extension[0] != ' ') {
+				entry->name[len++] = '.';
+				for (int j = 0; (j < 3) && (p->extension[j] != ' '); j++) {
+					entry->name[len++] = p->extension[j];
+				}
+			}
+			entry->name[len] = 0;
+			// A leading 0xE5 is stored as 0x05
+			if ((uint8_t)entry->name[0] == 0x05) {
+				entry->name[0] = 0xE5;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+// Resolve a path one component at a time from the given directory.  The
+// directories passed through are kept so ".." costs nothing.  Returns 0
+// with errno set if it isn't found - and 0 with errno clear for the root,
+// or for an empty file, which has no cluster either.
+uint32_t Fat::getInode(uint32_t parent, const char *path, uint32_t *ancestor) {
+	return resolvePath(parent, path, ancestor, NULL);
+}
+
+// The same, also giving the attributes of what the path ends at so an empty
+// file can be told from the root.  Anything but the last part of the path
+// has to be a directory, or it fails with ENOTDIR.
+uint32_t Fat::resolvePath(uint32_t parent, const char *path, uint32_t *ancestor, uint8_t *attribs) {
+	uint32_t above[MAX_DEPTH];
+	int depth = 0;
+	uint32_t inode = (path[0] == '/') ? 0 : parent;
+	uint8_t type = ATTR_DIRECTORY;
+	struct fat_dentry entry;
+
+	PathParser parts(path);
+	const char *name;
+	size_t len;
+
+	errno = 0;
+	while (parts.next(&name, &len)) {
+		if (!(type & ATTR_DIRECTORY)) {
+			errno = ENOTDIR;
+			return 0;
+		}
+		if ((len == 1) && (name[0] == '.')) {
+			continue;
+		}
+		if ((len == 2) && (name[0] == '.') && (name[1] == '.')) {
+			if (depth > 0) {
+				inode = above[--depth];
+			} else if (inode != 0) {
+				// Started below the root, so ask the directory itself.
+				inode = findDirectoryEntry(inode, name, len);
+				if ((inode == 0) && (errno != 0)) {
+					return 0;
+				}
+			}
+			continue;
+		}
+		if (depth == MAX_DEPTH) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		above[depth++] = inode;
+		inode = findDirectoryEntry(inode, name, len, &entry);
+		if (errno != 0) {
+			return 0;
+		}
+		type = entry.attribs;
+	}
+
+	if (ancestor != NULL) {
+		*ancestor = (depth > 0) ? above[depth - 1] : 0;
+	}
+	if (attribs != NULL) {
+		*attribs = type;
+	}
+	return inode;
+}
+
+// A FAT entry is a single little-endian load: the FAT sectors are held in
+// malloc'd, hence aligned, buffers.
+template <uint8_t EntryShift>
+uint32_t Fat::loadEntry(const uint8_t *fat, uint32_t inner) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	if (EntryShift == 2) {
+		return ((const uint32_t *)fat)[inner];
+	}
+	return ((const uint16_t *)fat)[inner];
+#else
+	const uint8_t *p = fat + (inner << EntryShift);
+	if (EntryShift == 2) {
+		return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	return p[0] | (p[1] << 8);
+#endif
+}
+
+template <uint8_t EntryShift>
+bool Fat::endOfChain(uint32_t inode) {
+	if (inode < 2) {
+		return true;
+	}
+	if (EntryShift == 2) {
+		return (inode & 0x0FFFFFFFUL) >= 0x0FFFFFF7UL;
+	}
+	return inode >= 0xFFF7;
+}
+
+template <uint8_t EntryShift, uint8_t BlockShift>
+uint32_t Fat::nextInodeFor(uint32_t inode) {
+	const uint8_t perBlockShift = (BlockShift ? BlockShift : _blockShift) - EntryShift;
+
+	uint8_t *fat = getFatSector(inode >> perBlockShift);
+	if (fat == NULL) {
+		return 0;
+	}
+	return loadEntry<EntryShift>(fat, inode & ((1UL << perBlockShift) - 1));
+}
+
+uint32_t Fat::getNextInode(uint32_t inode) {
+	return (this->*_nextInode)(inode);
+}
+
+bool Fat::isEndOfChain(uint32_t inode) {
+	if (_type == 32) {
+		return endOfChain<2>(inode);
+	}
+	return endOfChain<1>(inode);
+}
+
+bool Fat::setNextInode(uint32_t inode, uint32_t next) {
+	uint8_t perSectorShift = _blockShift - ((_type == 32) ? 2 : 1);
+	uint8_t *fat = getFatSector(inode >> perSectorShift, true);
+	if (fat == NULL) {
+		return false;
+	}
+
+	uint32_t inner = inode & ((1UL << perSectorShift) - 1);
+	if (_type == 32) {
+		// The top four bits are reserved, and must be left alone.
+		next = (loadEntry<2>(fat, inner) & 0xF0000000UL) | (next & 0x0FFFFFFFUL);
+		uint8_t *p = fat + (inner * 4);
+		p[0] = next;
+		p[1] = next >> 8;
+		p[2] = next >> 16;
+		p[3] = next >> 24;
+	} else {
+		uint8_t *p = fat + (inner * 2);
+		p[0] = next;
+		p[1] = next >> 8;
+	}
+	return true;
+}
+
+// Find a free cluster, looking first straight after "last" so files stay
+// in one piece, then on from the last one handed out, wrapping round to the
+// start of the volume.  FAT sectors known to be full are skipped.
+uint32_t Fat::allocateCluster(uint32_t last) {
+	uint8_t perSectorShift = _blockShift - ((_type == 32) ? 2 : 1);
+	uint32_t end = _clusters + 2;
+	uint32_t cluster = (last >= 2) ? last + 1 : _nextFree;
+	if ((cluster < 2) || (cluster >= end)) {
+		cluster = 2;
+	}
+
+	uint32_t found = 0;
+	uint32_t left = _clusters;
+	while ((left > 0) && (found == 0)) {
+		uint32_t sector = cluster >> perSectorShift;
+		uint32_t base = sector << perSectorShift;
+		uint32_t count = min(min((sector + 1) << perSectorShift, end) - cluster, left);
+
+		if (_freeMap[sector >> 3] & (1 << (sector & 7))) {
+			uint8_t *fat = getFatSector(sector);
+			if (fat == NULL) {
+				return 0;
+			}
+			for (uint32_t c = cluster; c < cluster + count; c++) {
+				uint32_t next = (_type == 32) ? (loadEntry<2>(fat, c - base) & 0x0FFFFFFFUL) : loadEntry<1>(fat, c - base);
+				if (next == 0) {
+					found = c;
+					break;
+				}
+			}
+			// Only a sector searched from end to end is known to be full.
+			if ((found == 0) && (cluster <= max(base, 2UL)) && (cluster + count == min(base + (1UL << perSectorShift), end))) {
+				_freeMap[sector >> 3] &= ~(1 << (sector & 7));
+			}
+		}
+
+		left -= count;
+		cluster += count;
+		if (cluster >= end) {
+			cluster = 2;
+		}
+	}
+
+	if (found == 0) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	if (!setNextInode(found, (_type == 32) ? 0x0FFFFFFFUL : 0xFFFF)) {
+		return 0;
+	}
+	if ((last >= 2) && !setNextInode(last, found)) {
+		setNextInode(found, 0);
+		return 0;
+	}
+
+	_nextFree = (found + 1 < end) ? found + 1 : 2;
+	if (_freeCount != 0xFFFFFFFFUL) {
+		_freeCount--;
+	}
+	_fsInfoDirty = true;
+	return found;
+}
+
+// Find "count" free clusters in a row, preferring a run that starts on an
+// erase unit boundary of the underlying device, and chain them up.
+uint32_t Fat::allocateContiguous(uint32_t count) {
+	uint8_t perSectorShift = _blockShift - ((_type == 32) ? 2 : 1);
+	uint32_t end = _clusters + 2;
+	uint32_t erase = _vol->getEraseSize();
+	uint32_t offset = _vol->getBlockOffset() + _data_start;
+
+	if ((count == 0) || (count > _clusters)) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	uint32_t start = 0;
+	for (int pass = 0; (pass < 2) && (start == 0); pass++) {
+		// Second time round take any run at all.
+		uint32_t align = (pass == 0) ? erase : 1;
+		if ((pass == 1) && (erase <= 1)) {
+			break;
+		}
+
+		uint32_t run = 0;
+		uint32_t cluster = 2;
+		while ((cluster < end) && (start == 0)) {
+			uint32_t sector = cluster >> perSectorShift;
+			uint32_t base = sector << perSectorShift;
+			uint32_t sectorEnd = min(base + (1UL << perSectorShift), end);
+
+			if (!(_freeMap[sector >> 3] & (1 << (sector & 7)))) {
+				run = 0;
+				cluster = sectorEnd;
+				continue;
+			}
+
+			uint8_t *fat = getFatSector(sector);
+			if (fat == NULL) {
+				return 0;
+			}
+			for (; cluster < sectorEnd; cluster++) {
+				uint32_t next = (_type == 32) ? (loadEntry<2>(fat, cluster - base) & 0x0FFFFFFFUL) : loadEntry<1>(fat, cluster - base);
+				if (next != 0) {
+					run = 0;
+					continue;
+				}
+				if ((run == 0) && (((offset + ((cluster - 2) << _clusterShift)) % align) != 0)) {
+					continue;
+				}
+				if (++run == count) {
+					start = cluster - count + 1;
+					break;
+				}
+			}
+		}
+	}
+
+	if (start == 0) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t next = (i == count - 1) ? ((_type == 32) ? 0x0FFFFFFFUL : 0xFFFF) : start + i + 1;
+		if (!setNextInode(start + i, next)) {
+			return 0;
+		}
+	}
+
+	_nextFree = (start + count < end) ? start + count : 2;
+	if (_freeCount != 0xFFFFFFFFUL) {
+		_freeCount -= count;
+	}
+	_fsInfoDirty = true;
+	return start;
+}
+
+bool Fat::truncateChain(uint32_t start, uint32_t keep) {
+	if (keep == 0) {
+		return freeChain(start);
+	}
+
+	uint32_t inode = start;
+	for (uint32_t i = 1; i < keep; i++) {
+		inode = getNextInode(inode);
+		if (isEndOfChain(inode)) {
+			// Already short enough.
+			return true;
+		}
+	}
+
+	uint32_t next = getNextInode(inode);
+	if (isEndOfChain(next)) {
+		return true;
+	}
+	if (!setNextInode(inode, (_type == 32) ? 0x0FFFFFFFUL : 0xFFFF)) {
+		return false;
+	}
+	return freeChain(next);
+}
+
+bool Fat::freeChain(uint32_t start) {
+	uint8_t perSectorShift = _blockShift - ((_type == 32) ? 2 : 1);
+	uint32_t inode = start;
+
+	// Counted, so a damaged FAT with a loop in it can't hang us.
+	for (uint32_t n = 0; (n < _clusters) && !isEndOfChain(inode) && (inode < _clusters + 2); n++) {
+		uint32_t next = getNextInode(inode);
+		if (!setNextInode(inode, 0)) {
+			return false;
+		}
+		uint32_t sector = inode >> perSectorShift;
+		_freeMap[sector >> 3] |= 1 << (sector & 7);
+		if (_freeCount != 0xFFFFFFFFUL) {
+			_freeCount++;
+		}
+		inode = next;
+	}
+	_fsInfoDirty = true;
+	return true;
+}
+
+bool Fat::zeroCluster(uint32_t cluster) {
+	uint8_t zero[_blockSize];
+	memset(zero, 0, _blockSize);
+	uint32_t first = _data_start + ((cluster - 2) << _clusterShift);
+	for (uint32_t i = 0; i < _cluster_size; i++) {
+		if (!_vol->writeBlocks(first + i, 1, zero)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Walk a path once, down to the directory entry at the end of it.  The last
+// part of the path is handed back in "leaf".  If it's only that last part
+// that's missing, errno is ENOENT and the entry's parent is still filled in,
+// ready for creating it.  The root has no entry, so leaf is NULL for it, as
+// it is if the path fails before the last part.
+bool Fat::lookupEntry(const char *path, struct fat_dentry *entry, const char **leaf, size_t *leafLen) {
+	PathParser parts(path);
+	const char *name;
+	size_t len;
+	*leaf = NULL;
+	*leafLen = 0;
+	while (parts.next(&name, &len)) {
+		*leaf = name;
+		*leafLen = len;
+	}
+
+	errno = 0;
+	if (*leaf == NULL) {
+		entry->parent = 0;
+		return true;
+	}
+
+	char dirPath[*leaf - path + 1];
+	memcpy(dirPath, path, *leaf - path);
+	dirPath[*leaf - path] = 0;
+
+	// Everything up to the leaf has to be a directory - 0 is the root
+	// there, never an empty file.
+	uint8_t attribs;
+	entry->parent = resolvePath(_cwd, dirPath, NULL, &attribs);
+	if ((errno == 0) && !(attribs & ATTR_DIRECTORY)) {
+		errno = ENOTDIR;
+	}
+	if (errno != 0) {
+		*leaf = NULL;
+		return false;
+	}
+
+	uint32_t parent = entry->parent;
+	findDirectoryEntry(parent, *leaf, *leafLen, entry);
+	entry->parent = parent;
+	return errno == 0;
+}
+
+bool Fat::lookup(const char *path, struct file_record *record) {
+	struct fat_dentry entry;
+	const char *leaf;
+	size_t leafLen;
+
+	if (!lookupEntry(path, &entry, &leaf, &leafLen)) {
+		return false;
+	}
+
+	record->parent = entry.parent;
+	if (leaf == NULL) {
+		record->cluster = 0;
+		record->size = 0;
+		record->attribs = ATTR_DIRECTORY;
+		record->date = 0;
+		record->time = 0;
+		record->block = 0;
+		record->index = 0;
+		return true;
+	}
+	record->cluster = entry.cluster;
+	record->size = entry.size;
+	record->attribs = entry.attribs;
+	record->date = entry.date;
+	record->time = entry.time;
+	record->block = entry.block;
+	record->index = entry.index;
+	return true;
+}
+
+File Fat::open(const char *filename, uint8_t mode) {
+	struct fat_dentry entry;
+	const char *leaf;
+	size_t leafLen;
+
+	bool found = lookupEntry(filename, &entry, &leaf, &leafLen);
+	if ((leaf == NULL) && !found) {
+		return File();
+	}
+	if ((leaf == NULL) || ((leaf[0] == '.') && ((leafLen == 1) || ((leafLen == 2) && (leaf[1] == '.'))))) {
+		errno = EISDIR;
+		return File();
+	}
+
+	uint32_t parent = entry.parent;
+	if (errno == ENOENT) {
+		if (!(mode & FILE_CREATE)) {
+			return File();
+		}
+		if (!addDirectoryEntry(parent, leaf, leafLen, ATTR_ARCHIVE, &entry)) {
+			return File();
+		}
+		// The new entry may be spread over several directory blocks, and
+		// the directory may have grown, so get it all out now.
+		sync();
+	} else if (errno != 0) {
+		return File();
+	} else if (mode & (FILE_WRITE | FILE_APPEND | FILE_TRUNCATE | FILE_LOG)) {
+		if (entry.attribs & ATTR_DIRECTORY) {
+			errno = EISDIR;
+			return File();
+		}
+		if (entry.attribs & ATTR_READONLY) {
+			errno = EACCES;
+			return File();
+		}
+	}
+
+	if (mode & (FILE_APPEND | FILE_LOG)) {
+		mode |= FILE_WRITE;
+	}
+	struct file_record record;
+	record.parent = parent;
+	record.cluster = entry.cluster;
+	record.size = entry.size;
+	record.attribs = entry.attribs;
+	record.date = entry.date;
+	record.time = entry.time;
+	record.block = entry.block;
+	record.index = entry.index;
+	return File(this, record, mode);
+}
+
+uint32_t Fat::getInodeSize(uint32_t parent, uint32_t child) {
+	// An empty file has no cluster to know it by.
+	if (child < 2) {
+		return 0;
+	}
+
+	for (int i = 0; i < FAT_DENTRY_CACHE; i++) {
+		if ((_dentry[i].used != 0) && !(_dentry[i].flags & DENTRY_NEGATIVE) &&
+			(_dentry[i].parent == parent) && (_dentry[i].cluster == child)) {
+			return _dentry[i].size;
+		}
+	}
+
+	struct fat_dir dir;
+	struct fat_direntry entry;
+
+	if (!openDir(parent, &dir)) {
+		return 0;
+	}
+	while (readDir(&dir, &entry)) {
+		if (entry.cluster == child) {
+			return entry.size;
+		}
+	}
+	return 0;	
+}
+
+int Fat::readFileByte(uint32_t start, uint32_t offset) {
+	uint8_t c;
+	if (readFileBytes(start, offset, &c, 1) != 1) {
+		return -1;
+	}
+	return c;
+}
+
+int Fat::readClusterByte(uint32_t inode, uint32_t offset) {
+	uint8_t c;
+	if (readClusterBytes(inode, offset, &c, 1) != 1) {
+		return -1;
+	}
+	return c;
+}
+
+template <uint8_t EntryShift, uint8_t BlockShift>
+uint32_t Fat::readFileBytesFor(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len) {
+	const uint8_t csShift = (BlockShift ? BlockShift : _blockShift) + _clusterShift;
+	const uint32_t cs = 1UL << csShift;
+	uint32_t inode = start;
+
+	for (uint32_t i = offset >> csShift; i > 0; i--) {
+		inode = nextInodeFor<EntryShift, BlockShift>(inode);
+		if (endOfChain<EntryShift>(inode)) {
+			return 0;
+		}
+	}
+	offset &= cs - 1;
+
+	uint32_t numRead = 0;
+	while (numRead < len) {
+		// Gather up as much of a contiguous run as is wanted ...
+		uint32_t run = 1;
+		uint32_t next = nextInodeFor<EntryShift, BlockShift>(inode);
+		while ((next == inode + run) && (offset + (len - numRead) > (run << csShift))) {
+			run++;
+			next = nextInodeFor<EntryShift, BlockShift>(next);
+		}
+
+		// ... and read it in one go.
+		uint32_t chunk = min(len - numRead, (run << csShift) - offset);
+		uint32_t n = readClusterBytesFor<BlockShift>(inode, offset, buffer + numRead, chunk);
+		numRead += n;
+		if ((n < chunk) || (numRead == len) || endOfChain<EntryShift>(next)) {
+			break;
+		}
+		inode = next;
+		offset = 0;
+	}
+
+	return numRead;
+}
+
+template <uint8_t BlockShift>
+uint32_t Fat::readClusterBytesFor(uint32_t inode, uint32_t offset, uint8_t *buffer, uint32_t len) {
+	const uint8_t bs = BlockShift ? BlockShift : _blockShift;
+	const uint32_t blockSize = 1UL << bs;
+	uint32_t block = ((inode - 2) << _clusterShift) + _data_start + (offset >> bs);
+	uint32_t blockOffset = offset & (blockSize - 1);
+	uint32_t numRead = 0;
+
+	while (numRead < len) {
+		uint32_t left = len - numRead;
+
+		// Whole blocks go straight from the device into the buffer ...
+		if ((blockOffset == 0) && (left >= blockSize)) {
+			uint32_t count = left >> bs;
+			if (!_vol->readBlocks(block, count, buffer + numRead)) {
+				break;
+			}
+			numRead += count << bs;
+			block += count;
+			continue;
+		}
+
+		// ... and the ends are copied out of the device's cache.
+		uint32_t n = min(left, blockSize - blockOffset);
+		uint8_t *data = _vol->lockBlock(block);
+		if (data == NULL) {
+			break;
+		}
+		memcpy(buffer + numRead, data + blockOffset, n);
+		_vol->unlockBlock(block, false);
+
+		numRead += n;
+		block++;
+		blockOffset = 0;
+	}
+
+	return numRead;
+}
+
+uint32_t Fat::readFileBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len) {
+	return (this->*_readFile)(start, offset, buffer, len);
+}
+
+uint32_t Fat::readClusterBytes(uint32_t inode, uint32_t offset, uint8_t *buffer, uint32_t len) {
+	return (this->*_readCluster)(inode, offset, buffer, len);
+}
+
+// Point the hot paths at the versions built for this volume's geometry.
+// 512 byte blocks are by far the most common, so they get their own.
+void Fat::selectEngine() {
+	if (_type == 32) {
+		if (_blockShift == 9) {
+			_nextInode = &Fat::nextInodeFor<2, 9>;
+			_readFile = &Fat::readFileBytesFor<2, 9>;
+		} else {
+			_nextInode = &Fat::nextInodeFor<2, 0>;
+			_readFile = &Fat::readFileBytesFor<2, 0>;
+		}
+	} else {
+		if (_blockShift == 9) {
+			_nextInode = &Fat::nextInodeFor<1, 9>;
+			_readFile = &Fat::readFileBytesFor<1, 9>;
+		} else {
+			_nextInode = &Fat::nextInodeFor<1, 0>;
+			_readFile = &Fat::readFileBytesFor<1, 0>;
+		}
+	}
+	if (_blockShift == 9) {
+		_readCluster = &Fat::readClusterBytesFor<9>;
+	} else {
+		_readCluster = &Fat::readClusterBytesFor<0>;
+	}
+}
+
+uint32_t Fat::writeClusterBytes(uint32_t inode, uint32_t offset, const uint8_t *buffer, uint32_t len) {
+	if ((inode < 2) || (inode >= _clusters + 2)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	uint32_t block = ((inode - 2) << _clusterShift) + _data_start + (offset >> _blockShift);
+	uint32_t blockOffset = offset & (_blockSize - 1);
+	uint32_t numWritten = 0;
+
+	while (numWritten < len) {
+		uint32_t left = len - numWritten;
+
+		// Whole blocks go straight out to the device ...
+		if ((blockOffset == 0) && (left >= _blockSize)) {
+			uint32_t count = left >> _blockShift;
+			if (!_vol->writeBlocks(block, count, buffer + numWritten)) {
+				break;
+			}
+			numWritten += count << _blockShift;
+			block += count;
+			continue;
+		}
+
+		// ... and the ends are merged into the device's cached copy.
+		uint32_t n = min(left, _blockSize - blockOffset);
+		uint8_t *data = _vol->lockBlock(block);
+		if (data == NULL) {
+			break;
+		}
+		memcpy(data + blockOffset, buffer + numWritten, n);
+		_vol->unlockBlock(block, true);
+
+		numWritten += n;
+		block++;
+		blockOffset = 0;
+	}
+
+	return numWritten;
 }
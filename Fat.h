@@ -122,18 +122,288 @@ struct bootblock {
     uint16_t signature;
 } __attribute__((packed));
 
+struct fsinfo {
+	uint32_t lead_sig;
+	uint8_t reserved[480];
+	uint32_t struct_sig;
+	uint32_t free_count;
+	uint32_t next_free;
+	uint8_t reserved2[12];
+	uint32_t trail_sig;
+} __attribute__((packed));
+
+#define FSINFO_LEAD_SIG		0x41615252UL
+#define FSINFO_STRUCT_SIG	0x61417272UL
+#define FSINFO_TRAIL_SIG	0xAA550000UL
+
+/*! Number of FAT sectors held in RAM at once, unless told otherwise */
+#ifndef FAT_CACHE_SECTORS
+# if RAMEND < 32768
+#  define FAT_CACHE_SECTORS 1
+# elif RAMEND < 65536
+#  define FAT_CACHE_SECTORS 2
+# else
+#  define FAT_CACHE_SECTORS 4
+# endif
+#endif
+
+/*! Pass to setFatCache() to hold the whole FAT in RAM */
+#define FAT_CACHE_WHOLE 0
+
+/*! Number of directory blocks read from the device in one go */
+#ifndef FAT_DIR_BLOCKS
+# if RAMEND < 32768
+#  define FAT_DIR_BLOCKS 1
+# elif RAMEND < 65536
+#  define FAT_DIR_BLOCKS 2
+# else
+#  define FAT_DIR_BLOCKS 4
+# endif
+#endif
+
+/*! Longest long file name */
+#define FAT_NAME_MAX 255
+
+/*! Number of ~N alias tails marked off per pass through a directory
+ *  when making up a short name - a multiple of 8.
+ */
+#ifndef FAT_ALIAS_WINDOW
+# define FAT_ALIAS_WINDOW 1024
+#endif
+
+/*! Date stamped on new and changed entries, since there's no clock to ask:
+ *  1st January 1980.
+ */
+#define FAT_DEFAULT_DATE 0x0021
+
+/*! Position of a directory iterator.  Set up with Fat::openDir(). */
+struct fat_dir {
+	uint32_t cluster;		// Cluster being read, 0 for the FAT16 root
+	uint32_t block;			// Block within that cluster (or the root)
+	uint32_t entry;			// Entry within that block
+	bool done;
+};
+
+/*! One directory entry as returned by Fat::readDir() */
+struct fat_direntry {
+	char name[FAT_NAME_MAX + 1];	// Long name if there is one, else NAME.EXT
+	uint8_t shortName[11];
+	uint8_t attribs;
+	uint32_t cluster;
+	uint32_t size;
+	uint16_t date;			// Last written
+	uint16_t time;
+	uint32_t block;			// Volume block holding the short entry ...
+	uint16_t index;			// ... and its index within the block
+};
+
+/*! A name being looked up, prepared for comparing against directory
+ *  entries as they stream past.
+ */
+struct fat_namematch {
+	const char *name;
+	size_t len;
+	uint8_t slots;			// Long name entries the name would take
+	uint8_t shortName[11];	// Its 8.3 form, if it has one
+	bool hasShort;
+};
+
+/*! Number of recently looked up directory entries to remember */
+#ifndef FAT_DENTRY_CACHE
+# define FAT_DENTRY_CACHE 16
+#endif
+
+/*! Longest name the directory entry cache will hold.  Each cache entry
+ *  keeps the whole name so a hit is never just a hash matching; longer
+ *  names are looked up afresh every time.
+ */
+#ifndef FAT_DENTRY_NAME
+# define FAT_DENTRY_NAME 32
+#endif
+
+/*! The cached entry records that the name does not exist */
+#define DENTRY_NEGATIVE 0x01
+
+/*! Number of directories to keep a Bloom filter of names for */
+#ifndef FAT_BLOOM_CACHE
+# define FAT_BLOOM_CACHE 4
+#endif
+
+/*! Size of each Bloom filter in bits - a power of two */
+#ifndef FAT_BLOOM_BITS
+# define FAT_BLOOM_BITS 1024
+#endif
+
+/*! Bits set in a Bloom filter for each name */
+#define FAT_BLOOM_HASHES 3
+
+/*! Every name in a directory, long and short, folded to lower case and
+ *  hashed into a few bits.  A name whose bits aren't all set isn't there.
+ */
+struct fat_bloom {
+	uint32_t parent;
+	uint32_t used;			// 0 if the slot is free
+	uint8_t bits[FAT_BLOOM_BITS / 8];
+};
+
+/*! One name in a directory index.  A file with a long name has two: one
+ *  for the long name and one for its 8.3 alias.
+ */
+struct fat_index {
+	uint32_t hash;			// hashName() of the name
+	uint32_t block;			// Volume block where the file's entries start ...
+	uint16_t index;			// ... and the entry within it
+};
+
+struct fat_dentry {
+	uint32_t parent;		// Directory cluster, 0 for the root
+	uint32_t hash;			// Hash of the name looked up
+	uint16_t length;		// Length of the name looked up
+	uint8_t flags;
+	uint8_t attribs;
+	uint32_t cluster;
+	uint32_t size;
+	uint16_t date;			// Last written
+	uint16_t time;
+	uint32_t block;			// Volume block holding the directory entry ...
+	uint16_t index;			// ... and its index within the block
+	uint32_t used;
+};
+
+struct fatcacheslot {
+	uint32_t sector;
+	uint32_t used;
+	bool dirty;
+};
+
 class Fat : public FileSystem {
 private:
 //	BlockDevice 	*_dev;
 	uint8_t 		_part;
 	uint8_t 		_type;
 
-	uint32_t 		findDirectoryEntry(uint32_t parent, const char *path);
+	// All filesystem I/O goes through the volume: either the device itself,
+	// or a view of one partition of it.
+	BlockDevice		*_vol;
+	PartitionDevice	_partDev;
+
+	bool			mount();
+	uint32_t 		findDirectoryEntry(uint32_t parent, const char *name, size_t len, struct fat_dentry *entry = NULL);
+	bool			lookupEntry(const char *path, struct fat_dentry *entry, const char **leaf, size_t *leafLen);
+	uint32_t		resolvePath(uint32_t parent, const char *path, uint32_t *ancestor, uint8_t *attribs);
+	bool			addDirectoryEntry(uint32_t parent, const char *name, size_t len, uint8_t attribs, struct fat_dentry *entry);
+	bool			makeShortName(uint32_t parent, const char *name, size_t len, uint8_t *shortName);
 	uint32_t		_cwd;
-	uint8_t			_cachedFat[512];
-	uint32_t		_cachedFatNumber;
-	uint8_t			_cachedBlock[512];
-	uint32_t		_cachedBlockNumber;
+
+	// FAT sectors: a window of _fatCacheSlots recently used ones, or the
+	// whole FAT if _fatInRAM.
+	uint8_t			*_fatCache;
+	struct fatcacheslot	*_fatCacheSlot;
+	uint8_t			_fatCacheSlots;
+	uint8_t			_fatCacheWanted;
+	uint32_t		_fatCacheClock;
+	bool			_fatInRAM;
+	uint32_t		_fat_sectors;
+	uint8_t			_fat_copies;
+	uint32_t		_fatDirtyFirst;		// Changed sectors of a whole FAT in RAM
+	uint32_t		_fatDirtyLast;
+
+	// Free space.  A set bit in _freeMap means that FAT sector may have
+	// free clusters in it; bits are cleared as sectors are found to be full,
+	// so nothing needs scanning when mounting.
+	uint8_t			*_freeMap;
+	uint32_t		_clusters;
+	uint32_t		_freeCount;			// 0xFFFFFFFF if not known
+	uint32_t		_nextFree;			// Where to start looking
+	uint32_t		_fsInfoSector;		// 0 if there isn't one
+	bool			_fsInfoDirty;
+
+	// Directory entries recently looked up by name, found or not
+	struct fat_dentry	_dentry[FAT_DENTRY_CACHE];
+	char			_dentryName[FAT_DENTRY_CACHE][FAT_DENTRY_NAME];
+	uint32_t		_dentryClock;
+
+	struct fat_dentry	*lookupDentry(uint32_t parent, uint32_t hash, const char *name, size_t len);
+	void			cacheDentry(uint32_t parent, uint32_t hash, const char *name, size_t len, struct fat_dentry *entry);
+	void			invalidateDentries(uint32_t parent, bool names = true);
+	static uint32_t	hashName(const char *name, size_t len);
+
+	// Bloom filters of the names in recently searched directories, built
+	// while searching one for a name that isn't there
+	struct fat_bloom	_bloom[FAT_BLOOM_CACHE];
+	uint32_t		_bloomRejects;		// Misses answered by a filter alone
+	uint32_t		_bloomPasses;		// Names a filter let through ...
+	uint32_t		_bloomFalse;		// ... that weren't there after all
+
+	uint8_t			*_bloomBuild;		// Filter being built by collectBloom()
+
+	// The one directory that's indexed, in memory lent by the caller
+	struct fat_index	*_index;			// NULL if there isn't one
+	uint32_t		_indexCount;
+	uint32_t		_indexMax;
+	uint32_t		_indexParent;
+
+	// Something that's told about every name a directory scan goes past
+	typedef void	(Fat::*NameCollector)(uint32_t hash, uint32_t block, uint16_t index);
+
+	bool			scanDirectory(struct fat_dir *dir, const struct fat_namematch *match, struct fat_dentry *found, NameCollector collect, bool one);
+	void			collectBloom(uint32_t hash, uint32_t block, uint16_t index);
+	void			collectIndex(uint32_t hash, uint32_t block, uint16_t index);
+	static int		compareIndex(const void *a, const void *b);
+	uint32_t		findIndex(uint32_t hash);
+	bool			insertIndex(uint32_t hash, uint32_t block, uint16_t index);
+	void			seekDir(struct fat_dir *dir, uint32_t block, uint16_t index);
+
+	struct fat_bloom	*findBloom(uint32_t parent);
+	void			storeBloom(uint32_t parent, const uint8_t *bits);
+	static void		bloomAdd(uint8_t *bits, uint32_t hash);
+	static bool		bloomTest(const uint8_t *bits, uint32_t hash);
+	static uint32_t	hashShortName(const uint8_t *shortName);
+
+	static void		prepareMatch(struct fat_namematch *match, const char *name, size_t len);
+	static bool		matchFragment(const struct fat_namematch *match, const struct fat_lfnent *lfn, uint8_t ordinal);
+	static bool		collectFragment(const struct fat_lfnent *lfn, uint8_t ordinal, char *name, size_t *len);
+	static uint8_t	lfnChecksum(const uint8_t *shortName);
+
+	// A window of directory blocks shared by all the iterators, sized to
+	// the volume when it is mounted
+	uint8_t			*_dirBuffer;
+	uint32_t		_dirBufferSize;
+	uint32_t		_dirBufferBlock;
+	uint32_t		_dirBufferCount;
+	uint32_t		_root_sectors;
+	uint32_t		_root_cluster;
+
+	struct fat_dirent	*nextDirent(struct fat_dir *dir, uint32_t *block, uint16_t *index);
+
+	bool			initFatCache();
+	void			freeFatCache();
+	uint8_t			*getFatSector(uint32_t sector, bool dirty = false);
+	bool			writeFatSector(uint32_t sector, const uint8_t *data);
+	bool			flushFat();
+	bool			writeFsInfo();
+	bool			setNextInode(uint32_t inode, uint32_t next);
+	bool			zeroCluster(uint32_t cluster);
+
+	// FAT insists on power of two sector and cluster sizes, so the hot
+	// paths work in shifts: log2 of the block size, and of the blocks in
+	// a cluster.
+	uint8_t			_blockShift;
+	uint8_t			_clusterShift;
+
+	// The hot paths, specialised for the FAT entry width (EntryShift 1 for
+	// FAT16, 2 for FAT32) and block size (BlockShift 9 for 512 bytes, or 0
+	// to use _blockShift).  The right ones are picked when mounting.
+	uint32_t		(Fat::*_nextInode)(uint32_t inode);
+	uint32_t		(Fat::*_readFile)(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len);
+	uint32_t		(Fat::*_readCluster)(uint32_t inode, uint32_t offset, uint8_t *buffer, uint32_t len);
+
+	void			selectEngine();
+	template <uint8_t EntryShift> static uint32_t loadEntry(const uint8_t *fat, uint32_t inner);
+	template <uint8_t EntryShift> static bool endOfChain(uint32_t inode);
+	template <uint8_t EntryShift, uint8_t BlockShift> uint32_t nextInodeFor(uint32_t inode);
+	template <uint8_t EntryShift, uint8_t BlockShift> uint32_t readFileBytesFor(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len);
+	template <uint8_t BlockShift> uint32_t readClusterBytesFor(uint32_t inode, uint32_t offset, uint8_t *buffer, uint32_t len);
 
 	uint32_t 		_root_block;
 	uint32_t		_cluster_size;
@@ -145,14 +415,70 @@ private:
 public:
 	
 					Fat(BlockDevice &dev, uint8_t partition);
+					Fat(BlockDevice &dev);
+					~Fat();
 	bool 			begin();
+
+	/*! Create a new, empty filesystem on the volume, FAT16 if it comes to
+	 *  no more than 65524 clusters and FAT32 if not, and mount it.  The cluster size is chosen to suit
+	 *  the volume unless given.  Very small volumes (RAM disks, say) are
+	 *  still laid out as FAT16 even though a PC would call them FAT12.
+	 */
+	bool			format(uint8_t sectorsPerCluster = 0);
+
+	/*! Set how many FAT sectors to keep in RAM.  FAT_CACHE_WHOLE reads the
+	 *  entire FAT in when the volume is mounted, so following a cluster
+	 *  chain never touches the device.  That is only sensible on small
+	 *  volumes; if there isn't the memory for it the normal window of
+	 *  FAT_CACHE_SECTORS is used instead.
+	 */
+	bool			setFatCache(uint8_t sectors);
 	uint32_t		getInode(const char *path) { return getInode(0, path, NULL); }
-	uint32_t 		getInode(uint32_t parent, const char *path) { return getInode(0, path, NULL); }
+	uint32_t 		getInode(uint32_t parent, const char *path) { return getInode(parent, path, NULL); }
 	uint32_t 		getInode(uint32_t parent, const char *path, uint32_t *ancestor);
 	
 	uint32_t		getNextInode(uint32_t inode);
 
-	File			open(const char *filename);
+	/*! Start reading a directory, by path or by its first cluster (0 for
+	 *  the root directory).
+	 */
+	bool			openDir(const char *path, struct fat_dir *dir);
+	bool			openDir(uint32_t cluster, struct fat_dir *dir);
+
+	/*! Fetch the next entry of a directory, long name and all.  Returns
+	 *  false at the end of the directory (errno 0) or on an error.
+	 */
+	bool			readDir(struct fat_dir *dir, struct fat_direntry *entry);
+
+	/*! Index the names in a directory, using memory the caller lends, so
+	 *  finding a name there is a binary search rather than a walk through
+	 *  the whole directory.  Each name takes a struct fat_index, and a long
+	 *  name with its 8.3 alias counts as two.  Fails with ENOMEM if they
+	 *  don't all fit.  Only one directory is indexed at a time; files
+	 *  created in it are added as they go, and if it outgrows the memory
+	 *  the index is dropped.
+	 *
+	 *      static struct fat_index names[20000];
+	 *      fs.indexDirectory("/logs", names, sizeof(names));
+	 */
+	bool			indexDirectory(const char *path, void *memory, size_t bytes);
+
+	/*! Stop using the index, so its memory can be used for something else */
+	void			dropIndex();
+	bool			isEndOfChain(uint32_t inode);
+
+	File			open(const char *filename) { return open(filename, FILE_READ); }
+	File			open(const char *filename, uint8_t mode);
+	bool			lookup(const char *path, struct file_record *record);
+	void			sync();
+	void			syncFile(uint32_t entryBlock, uint32_t first, uint32_t last);
+
+	uint32_t		allocateCluster(uint32_t last);
+	uint32_t		allocateContiguous(uint32_t count);
+	bool			freeChain(uint32_t start);
+	bool			truncateChain(uint32_t start, uint32_t keep);
+	uint32_t		writeClusterBytes(uint32_t start, uint32_t offset, const uint8_t *buffer, uint32_t len);
+	bool			updateInode(uint32_t parent, uint32_t entryBlock, uint16_t entryIndex, uint32_t inode, uint32_t size);
 	uint32_t		getInodeSize(uint32_t parent, uint32_t child);
 
 	int				readFileByte(uint32_t start, uint32_t offset);
@@ -161,8 +487,12 @@ public:
 	uint32_t		readClusterBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len);
 
 	uint32_t		getClusterSize() { return _cluster_size * _bytes_per_sector; }
+	uint32_t		getBlockSize() { return _blockSize; }
 
     void dumpBlock(uint8_t *block);
+
+	/*! Print how well the directory name filters are doing */
+	void			printLookupStats();
 };
 
 #endif
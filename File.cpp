@@ -31,81 +31,533 @@
 #include <FileSystem.h>
 
 File::~File() {
-	flush();
+	release();
+}
+
+// A File that isn't open - what open() returns when it fails.
+File::File() {
+	_fs = NULL;
+	_file = NULL;
+	_position = 0;
+	_mode = 0;
 }
 
 File::File(FileSystem *fs, uint32_t parent, uint32_t child, bool isValid) {
 	_fs = fs;
-	_parent = parent;
-	_inode = child;	
+	_file = NULL;
+	_position = 0;
+	_mode = 0;
+	if (isValid) {
+		attach(fs, parent, child, _fs->getInodeSize(parent, child), 0, 0, FILE_READ);
+	}
+}
 
-	_size = _fs->getInodeSize(_parent, _inode);
+// A file opened from the record of its directory entry, which the filesystem
+// has already looked up, so it never has to be searched for again.
+File::File(FileSystem *fs, const struct file_record &record, uint8_t mode) {
+	_fs = fs;
+	_file = NULL;
 	_position = 0;
-	_posInode = _inode;
-	_isValid = isValid;
+	_mode = 0;
+	attach(fs, record.parent, record.cluster, record.size, record.block, record.index, mode);
 }
 
-int File::read() {
-	if (_position >= _size) {
-		return -1;
+File::File(const File &other) {
+	_fs = other._fs;
+	_file = other._file;
+	_position = other._position;
+	_mode = other._mode;
+	if (_file != NULL) {
+		_file->refs++;
 	}
+}
 
-	uint32_t cs = _fs->getClusterSize();
-	int c = _fs->readClusterByte(_posInode, _position & cs);
-	_position++;
-	if ((_position % cs) == 0) {
-		_posInode = _fs->getNextInode(_posInode);
+File & File::operator =(const File &other) {
+	if (this == &other) {
+		return *this;
+	}
+	if (other._file != NULL) {
+		other._file->refs++;
+	}
+	release();
+	_fs = other._fs;
+	_file = other._file;
+	_position = other._position;
+	_mode = other._mode;
+	return *this;
+}
+
+// Join the file's entry in the open file table, or start one.  If the file
+// is to be truncated the entry is too, so any other File on it sees it.
+void File::attach(FileSystem *fs, uint32_t parent, uint32_t child, uint32_t size, uint32_t entryBlock, uint16_t entryIndex, uint8_t mode) {
+	_file = fs->claimFile(parent, child, size, entryBlock, entryIndex);
+	if (_file == NULL) {
+		return;
+	}
+	_mode = mode;
+
+	if ((mode & FILE_TRUNCATE) && (_file->inode >= 2)) {
+		if (!fs->updateInode(_file->parent, _file->entryBlock, _file->entryIndex, 0, 0) || !fs->freeChain(_file->inode)) {
+			release();
+			return;
+		}
+		_file->inode = 0;
+		_file->size = 0;
+		_file->committed = 0;
+		_file->dirty = false;
+		_file->prealloc = 0;
+		_file->written = 0;
+		_file->extentCount = 0;
+		_file->logBase = 0;
+		_file->logFill = 0;
+		_file->logSynced = 0;
+	}
+}
+
+// Find the run of clusters holding cluster "index" of the file, walking the
+// FAT on from the end of the map if it isn't known yet.  While walking, the
+// last run is grown as far as cluster "want" if it carries on contiguously,
+// so one read can cover it all.
+struct file_extent *File::mapExtent(uint32_t index, uint32_t want) {
+	if (_file->inode < 2) {
+		return NULL;
+	}
+
+	if ((_file->extentCount == 0) || (index < _file->extents[0].first)) {
+		_file->extents[0].first = 0;
+		_file->extents[0].cluster = _file->inode;
+		_file->extents[0].length = 1;
+		_file->extentCount = 1;
+	}
+
+	struct file_extent *last = &_file->extents[_file->extentCount - 1];
+	while ((index >= last->first + last->length) ||
+		((index >= last->first) && (want >= last->first + last->length))) {
+		uint32_t tail = last->cluster + last->length - 1;
+		uint32_t next = _fs->getNextInode(tail);
+
+		if (next == tail + 1) {
+			last->length++;
+			continue;
+		}
+
+		if (index < last->first + last->length) {
+			// The run ends short of "want", but "index" is in it.
+			break;
+		}
+
+		if (_fs->isEndOfChain(next)) {
+			return NULL;
+		}
+
+		// Slide the window along, keeping just the latest run.
+		if (_file->extentCount == FILE_MAX_EXTENTS) {
+			_file->extents[0] = *last;
+			_file->extentCount = 1;
+			last = &_file->extents[0];
+		}
+
+		uint32_t first = last->first + last->length;
+		last = &_file->extents[_file->extentCount++];
+		last->first = first;
+		last->cluster = next;
+		last->length = 1;
+	}
+
+	// Binary search the window.
+	uint32_t lo = 0;
+	uint32_t hi = _file->extentCount - 1;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi + 1) / 2;
+		if (_file->extents[mid].first <= index) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return &_file->extents[lo];
+}
+
+int File::read() {
+	uint8_t c;
+	if (readBytes((char *)&c, 1) != 1) {
+		return -1;
 	}
 	return c;
 }
 
 size_t File::readBytes(char *buffer, size_t len) {
-	size_t end = _position + len;
-	if (end > _size) {
-		end = _size;
+	if (_file == NULL) {
+		return 0;
 	}
-	len = end - _position;
-	uint32_t toRead = len;
+	// A log's tail may still be in its buffer.
+	drainLog();
+	if (_position >= _file->size) {
+		return 0;
+	}
+	if (len > _file->size - _position) {
+		len = _file->size - _position;
+	}
+
 	uint32_t cs = _fs->getClusterSize();
-	uint32_t totalRead = 0;
-	while (toRead > 0) {
-		uint32_t chunkLeft = cs - (_position % cs);
-		uint32_t thisChunk = min(chunkLeft, toRead);
-		uint32_t numRead = _fs->readClusterBytes(_posInode, _position % cs, (uint8_t *)buffer, thisChunk);
-		
-		_position += numRead;
-		if ((_position % cs) == 0) {
-			_posInode = _fs->getNextInode(_posInode);
+	uint32_t want = (_position + len - 1) / cs;
+	size_t totalRead = 0;
+
+	while (totalRead < len) {
+		uint32_t index = _position / cs;
+		struct file_extent *ext = mapExtent(index, want);
+		if (ext == NULL) {
+			break;
 		}
-		toRead -= numRead;
+
+		// Read as much of the run as is wanted in one go.
+		uint32_t offset = _position - (ext->first * cs);
+		uint32_t runLeft = (ext->length * cs) - offset;
+		uint32_t thisChunk = min(runLeft, (uint32_t)(len - totalRead));
+		uint32_t numRead = _fs->readClusterBytes(ext->cluster, offset, (uint8_t *)buffer + totalRead, thisChunk);
+
+		_position += numRead;
 		totalRead += numRead;
+		if (numRead < thisChunk) {
+			break;
+		}
 	}
 	return totalRead;
 }
 
+size_t File::write(const uint8_t *buffer, size_t len) {
+	if ((_file == NULL) || !(_mode & FILE_WRITE)) {
+		errno = EBADF;
+		return 0;
+	}
+	if (!(_mode & FILE_LOG)) {
+		return writeThrough(buffer, len);
+	}
+
+	// A log gathers its records a cluster at a time, and only goes to the
+	// volume when the cluster fills up or it's time to commit.
+	uint32_t cs = _fs->getClusterSize();
+	if (_file->logBuf == NULL) {
+		_file->logBuf = (uint8_t *)malloc(cs);
+		if (_file->logBuf == NULL) {
+			errno = ENOMEM;
+			return 0;
+		}
+		_file->logBase = _file->size - (_file->size % cs);
+		_file->logFill = _file->size % cs;
+		_file->logSynced = _file->logFill;
+	}
+
+	size_t totalWritten = 0;
+	while (totalWritten < len) {
+		uint32_t thisChunk = min(cs - _file->logFill, (uint32_t)(len - totalWritten));
+		memcpy(_file->logBuf + _file->logFill, buffer + totalWritten, thisChunk);
+		_file->logFill += thisChunk;
+		totalWritten += thisChunk;
+
+		if (_file->logFill == cs) {
+			if (!drainLog()) {
+				// Only keep what there was room for.
+				uint32_t keep = max(_file->logSynced, _file->logFill - thisChunk);
+				totalWritten -= _file->logFill - keep;
+				_file->logFill = keep;
+				break;
+			}
+			_file->logBase += cs;
+			_file->logFill = 0;
+			_file->logSynced = 0;
+		}
+	}
+
+	_file->size = _file->logBase + _file->logFill;
+	_position = _file->size;
+	if (totalWritten > 0) {
+		_file->dirty = true;
+	}
+
+	if (((_file->commitBytes != 0) && (_file->size - _file->committed >= _file->commitBytes)) ||
+		((_file->commitInterval != 0) && (millis() - _file->commitTime >= _file->commitInterval))) {
+		commit();
+	}
+	return totalWritten;
+}
+
+// Write at the current position, growing the chain as needed.
+size_t File::writeThrough(const uint8_t *buffer, size_t len) {
+	if (_mode & FILE_APPEND) {
+		_position = _file->size;
+	}
+	if (_position > _file->size) {
+		// FAT has no holes to seek over.
+		errno = EINVAL;
+		return 0;
+	}
+
+	uint32_t cs = _fs->getClusterSize();
+	size_t totalWritten = 0;
+
+	while (totalWritten < len) {
+		uint32_t index = _position / cs;
+		uint32_t want = (_position + (len - totalWritten) - 1) / cs;
+		struct file_extent *ext = mapExtent(index, want);
+
+		if (ext == NULL) {
+			// Off the end of the chain, so grow it - next to the last
+			// cluster if there's room there.
+			uint32_t last = 0;
+			if (_file->inode >= 2) {
+				struct file_extent *tail = &_file->extents[_file->extentCount - 1];
+				last = tail->cluster + tail->length - 1;
+			}
+			uint32_t cluster = _fs->allocateCluster(last);
+			if (cluster == 0) {
+				break;
+			}
+			if (_file->inode < 2) {
+				_file->inode = cluster;
+				_file->extentCount = 0;
+				_file->dirty = true;
+			}
+			// A log takes a few clusters at a time so it's in the FAT less.
+			for (uint8_t i = 1; (_mode & FILE_LOG) && (i < _file->logBatch); i++) {
+				cluster = _fs->allocateCluster(cluster);
+				if (cluster == 0) {
+					break;
+				}
+			}
+			continue;
+		}
+
+		uint32_t offset = _position - (ext->first * cs);
+		uint32_t runLeft = (ext->length * cs) - offset;
+		uint32_t thisChunk = min(runLeft, (uint32_t)(len - totalWritten));
+		uint32_t numWritten = _fs->writeClusterBytes(ext->cluster, offset, buffer + totalWritten, thisChunk);
+		if (numWritten > 0) {
+			_file->dirtyFirst = min(_file->dirtyFirst, ext->cluster + (offset / cs));
+			_file->dirtyLast = max(_file->dirtyLast, ext->cluster + ((offset + numWritten - 1) / cs));
+		}
+
+		_position += numWritten;
+		totalWritten += numWritten;
+		_file->written = max(_file->written, _position);
+		if (_position > _file->size) {
+			_file->size = _position;
+			_file->dirty = true;
+		}
+		if (numWritten < thisChunk) {
+			break;
+		}
+	}
+	return totalWritten;
+}
+
+bool File::preallocate(uint32_t size, bool trim) {
+	if ((_file == NULL) || !(_mode & FILE_WRITE)) {
+		errno = EBADF;
+		return false;
+	}
+	if ((_file->inode >= 2) || (_file->size != 0) || (size == 0)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	uint32_t cs = _fs->getClusterSize();
+	uint32_t count = (size + cs - 1) / cs;
+	uint32_t cluster = _fs->allocateContiguous(count);
+	if (cluster == 0) {
+		return false;
+	}
+
+	_file->inode = cluster;
+	_file->size = size;
+	_file->prealloc = count * cs;
+	_file->written = 0;
+	_file->trim = trim;
+	_file->extentCount = 0;
+
+	// The chain and the directory entry go out now, so streaming never
+	// has to touch the FAT or the directory.
+	if (!_fs->updateInode(_file->parent, _file->entryBlock, _file->entryIndex, _file->inode, _file->size)) {
+		return false;
+	}
+	_file->dirty = false;
+	_fs->syncFile(_file->entryBlock, 0xFFFFFFFFUL, 0);
+	return true;
+}
+
+uint32_t File::writeBlocks(const uint8_t *data, uint32_t count) {
+	if ((_file == NULL) || !(_mode & FILE_WRITE) || (_file->prealloc == 0)) {
+		errno = EBADF;
+		return 0;
+	}
+	uint32_t bs = _fs->getBlockSize();
+	if ((_position % bs) != 0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	// seek() can go past the run, and nothing there is ours to write.
+	if (_position >= _file->prealloc) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	count = min(count, (_file->prealloc - _position) / bs);
+	if (count == 0) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	// The clusters are contiguous, so this is one transfer.
+	uint32_t numWritten = _fs->writeClusterBytes(_file->inode, _position, data, count * bs);
+	_position += numWritten;
+	_file->written = max(_file->written, _position);
+	if (_position > _file->size) {
+		_file->size = _position;
+		_file->dirty = true;
+	}
+	return numWritten / bs;
+}
+
+// Put what a log has buffered on the volume, without touching the FAT or
+// directory beyond any clusters it needs.
+bool File::drainLog() {
+	if ((_file->logBuf == NULL) || (_file->logSynced == _file->logFill)) {
+		return true;
+	}
+	uint32_t want = _file->logFill - _file->logSynced;
+	uint32_t position = _position;
+	uint8_t mode = _mode;
+	_position = _file->logBase + _file->logSynced;
+	// The size already counts what's buffered, so FILE_APPEND would put
+	// it after itself.
+	_mode &= ~FILE_APPEND;
+	size_t numWritten = writeThrough(_file->logBuf + _file->logSynced, want);
+	_mode = mode;
+	_file->logSynced += numWritten;
+	_position = position;
+	return numWritten == want;
+}
+
+// Cut the chain back to "clusters" long.  The cut is made from the extent
+// holding the last cluster kept, rather than by walking the chain from the
+// start, since a log is trimmed at every commit.
+bool File::trimChain(uint32_t clusters) {
+	if (clusters == 0) {
+		if (!_fs->freeChain(_file->inode)) {
+			return false;
+		}
+		_file->inode = 0;
+		_file->extentCount = 0;
+		return true;
+	}
+
+	uint32_t index = clusters - 1;
+	struct file_extent *ext = mapExtent(index, index);
+	if (ext == NULL) {
+		// Already short enough.
+		errno = 0;
+		return true;
+	}
+	if (!_fs->truncateChain(ext->cluster + (index - ext->first), 1)) {
+		return false;
+	}
+	ext->length = index - ext->first + 1;
+	_file->extentCount = (ext - _file->extents) + 1;
+	return true;
+}
+
+void File::setLogCommit(uint32_t bytes, uint32_t interval, uint8_t batch) {
+	if (_file == NULL) {
+		return;
+	}
+	_file->commitBytes = bytes;
+	_file->commitInterval = interval;
+	_file->logBatch = max(batch, (uint8_t)1);
+}
+
+// The directory entry is only brought up to date here, so a run of writes
+// costs one directory update rather than one each.
+bool File::commit() {
+	if (_file == NULL) {
+		return false;
+	}
+	bool ok = drainLog();
+	if (!_file->dirty && (_file->dirtyFirst > _file->dirtyLast)) {
+		return ok;
+	}
+
+	// Never claim more than actually made it out.
+	uint32_t size = (_file->logBuf != NULL) ? _file->logBase + _file->logSynced : _file->size;
+
+	// A log takes clusters a batch at a time, ahead of need.  The ones
+	// past the end go back before the entry does, so the chain on the
+	// volume never runs on past the size the entry gives.
+	if ((_file->logBuf != NULL) && (_file->inode >= 2)) {
+		uint32_t cs = _fs->getClusterSize();
+		if (!trimChain((size + cs - 1) / cs)) {
+			ok = false;
+		} else if (_file->inode < 2) {
+			_file->dirty = true;
+		}
+	}
+	if (_file->dirty && _fs->updateInode(_file->parent, _file->entryBlock, _file->entryIndex, _file->inode, size)) {
+		_file->dirty = (size != _file->size);
+		_file->committed = size;
+	} else if (_file->dirty) {
+		ok = false;
+	}
+	_file->commitTime = millis();
+	_fs->syncFile(_file->entryBlock, _file->dirtyFirst, _file->dirtyLast);
+	_file->dirtyFirst = 0xFFFFFFFFUL;
+	_file->dirtyLast = 0;
+	return ok;
+}
+
 void File::flush() { 
-	_fs->sync();
+	commit();
 }
 
+// Let go of the open file.  The last File to do so gives back any clusters
+// that were taken and not used, writes the file out and frees the entry.
+void File::release() {
+	if (_file == NULL) {
+		return;
+	}
+	if (_file->refs > 1) {
+		_file->refs--;
+		_file = NULL;
+		return;
+	}
+
+	uint32_t cs = _fs->getClusterSize();
+	if ((_file->prealloc != 0) && _file->trim && (_file->written < _file->size)) {
+		if (_fs->truncateChain(_file->inode, (_file->written + cs - 1) / cs)) {
+			if (_file->written == 0) {
+				_file->inode = 0;
+			}
+			_file->size = _file->written;
+			_file->dirty = true;
+			_file->extentCount = 0;
+		}
+	}
+	commit();
+	free(_file->logBuf);
+	_file->logBuf = NULL;
+	_file->refs = 0;
+	_file = NULL;
+}
+
+void File::close() {
+	release();
+}
 File::operator bool() {
-	return _isValid;
+	return _file != NULL;
 }
 
 int File::available() {
-	if (_position >= _size) {
+	if ((_file == NULL) || (_position >= _file->size)) {
 		return -1;
 	}
-	return _size - _position;
+	return _file->size - _position;
 }
-
-#if 0
-File & File::operator =(const File &other) {
-    _parent = other._parent;
-    _inode = other._inode;
-    _position = other._position;
-    _fs = other._fs;
-    _posInode = other._posInode;
-    _isValid = other._isValid;
-    return *this;
-}
-#endif
@@ -30,21 +30,81 @@
 
 #include <FileSystem.h>
 
-int FileSystem::parsePath(const char *path, char **parts) {
-	int part = 0;
-	char *data = strdup(path);
-	char *tok = strtok(data, "/");
-
-	while (tok) {
-		parts[part++] = tok;
-		tok = strtok(NULL, "/");
+bool PathParser::next(const char **name, size_t *len) {
+	while (*_pos == '/') {
+		_pos++;
 	}
+	if (*_pos == 0) {
+		return false;
+	}
+	*name = _pos;
+	while ((*_pos != 0) && (*_pos != '/')) {
+		_pos++;
+	}
+	*len = _pos - *name;
+	return true;
+}
 
-	return part;
+FileSystem::FileSystem() {
+	for (int i = 0; i < FS_MAX_OPEN_FILES; i++) {
+		_files[i].refs = 0;
+	}
 }
 
 void FileSystem::sync() {
 	_dev->sync();
 }
 
+// Find the entry for a file that's already open, so a second open shares it,
+// or else set up a free one.  Files are known by where their directory entry
+// is, or by their first cluster if that isn't known.
+struct open_file *FileSystem::claimFile(uint32_t parent, uint32_t inode, uint32_t size, uint32_t entryBlock, uint16_t entryIndex) {
+	struct open_file *spare = NULL;
+
+	for (int i = 0; i < FS_MAX_OPEN_FILES; i++) {
+		struct open_file *f = &_files[i];
+		if (f->refs == 0) {
+			if (spare == NULL) {
+				spare = f;
+			}
+			continue;
+		}
+		if ((entryBlock != 0) ?
+			((f->entryBlock == entryBlock) && (f->entryIndex == entryIndex)) :
+			((inode >= 2) && (f->inode == inode))) {
+			f->refs++;
+			return f;
+		}
+	}
+
+	if (spare == NULL) {
+		errno = EMFILE;
+		return NULL;
+	}
+
+	spare->refs = 1;
+	spare->parent = parent;
+	spare->inode = inode;
+	spare->size = size;
+	spare->dirty = false;
+	spare->entryBlock = entryBlock;
+	spare->entryIndex = entryIndex;
+	spare->dirtyFirst = 0xFFFFFFFFUL;
+	spare->dirtyLast = 0;
+	spare->prealloc = 0;
+	spare->written = 0;
+	spare->trim = false;
+	spare->extentCount = 0;
+	spare->logBuf = NULL;
+	spare->logBase = 0;
+	spare->logFill = 0;
+	spare->logSynced = 0;
+	spare->committed = size;
+	spare->commitTime = millis();
+	spare->commitBytes = FILE_LOG_COMMIT_BYTES;
+	spare->commitInterval = FILE_LOG_COMMIT_INTERVAL;
+	spare->logBatch = FILE_LOG_BATCH;
+	return spare;
+}
+
 
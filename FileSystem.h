@@ -50,6 +50,7 @@
 #endif
 
 #include <errno.h>
+#include <ctype.h>
 
 /*! The partition structure describes the data stored in the
  * partition tablein the MBR.
@@ -175,24 +176,79 @@ protected:
 	void switchOffActivityLED();
 	virtual bool readBlockFromDisk(uint32_t blockno, uint8_t *data) = 0;
 	virtual bool writeBlockToDisk(uint32_t block, uint8_t *data) = 0;
+
+	/*! Transfer a run of consecutive blocks straight to or from the device.
+	 *  The default just loops over the single block functions; drivers that
+	 *  have a faster multi-block transfer override these.
+	 */
+	virtual bool readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data);
+	virtual bool writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data);
+
 	bool loadPartitionTable();
-    void initCacheBlocks();
+    virtual void initCacheBlocks();
+	virtual bool isCached(uint32_t blockno);
 
     size_t _blockSize;
 
 public:
+	BlockDevice();
 
 	/*! Read a single block of data.  Block can come from the cache or from
 	 *  the backing store. It's cached if not already in the cache.
 	 */
-	bool readBlock(uint32_t blockno, uint8_t *data);
-	bool readSystemBlock(uint32_t blockno, uint8_t *data);
+	virtual bool readBlock(uint32_t blockno, uint8_t *data);
+	virtual bool readSystemBlock(uint32_t blockno, uint8_t *data);
 
 	/*! Write a single block of data.  It caches the data. If write-through
 	 *  caching is enabled the data is also flushed immediately to the backing store.
 	 */
-	bool writeBlock(uint32_t blockno, uint8_t *data);
-	bool writeSystemBlock(uint32_t blockno, uint8_t *data);
+	virtual bool writeBlock(uint32_t blockno, uint8_t *data);
+	virtual bool writeSystemBlock(uint32_t blockno, uint8_t *data);
+
+	/*! Read a run of consecutive blocks, bypassing the cache.  Any dirty
+	 *  cached copies of the blocks are written out first so the data read
+	 *  is always current.
+	 */
+	virtual bool readBlocks(uint32_t blockno, uint32_t count, uint8_t *data);
+
+	/*! Write a run of consecutive blocks, bypassing the cache.  Any cached
+	 *  copies of the blocks are discarded.
+	 */
+	virtual bool writeBlocks(uint32_t blockno, uint32_t count, const uint8_t *data);
+
+	/*! Read part of a block.  Devices that can address individual bytes
+	 *  override this to fetch just the bytes wanted; otherwise the block
+	 *  goes through the data cache.
+	 */
+	virtual bool readBlockBytes(uint32_t blockno, uint32_t offset, uint32_t len, uint8_t *data);
+
+	/*! Pin a block in the data cache, reading it in if needed, and return a
+	 *  pointer to the cached data so it can be used in place without copying.
+	 *  The block stays in core until unlockBlock() is called; pass dirty as
+	 *  true if the data was changed.  Locks don't nest.  Returns NULL on a
+	 *  read error, or with errno EBUSY if every cache entry is already
+	 *  locked.  Reads and writes through the cache fail the same way then.
+	 */
+	virtual uint8_t *lockBlock(uint32_t blockno);
+	virtual void unlockBlock(uint32_t blockno, bool dirty);
+
+	/*! Returns true if the device is still busy completing an earlier write.
+	 *  Devices that always finish their writes before returning are never busy.
+	 */
+	virtual bool isBusy() { return false; }
+
+	/*! Number of blocks in the device's erase or allocation unit.  Writes
+	 *  of whole units starting on a unit boundary are the fastest it can
+	 *  do.  Devices with no such preference return 1.
+	 */
+	virtual uint32_t getEraseSize() { return 1; }
+
+	/*! Number of blocks of the physical device that come before this
+	 *  device's block 0, so erase units can be lined up from here.  Only
+	 *  devices that are a window onto another, such as a partition, have
+	 *  any.
+	 */
+	virtual uint32_t getBlockOffset() { return 0; }
 
 	/*! Read a single block of data within a partition.
 	 */
@@ -204,6 +260,12 @@ public:
 	bool writeRelativeBlock(uint8_t partition, uint32_t blockno, uint8_t *data);
 	bool writeRelativeSystemBlock(uint8_t partition, uint32_t blockno, uint8_t *data);
 
+	/*! Get the start block and length of a partition from the partition
+	 *  table.  Fails with ENODEV if the partition is empty or doesn't fit on
+	 *  the device.
+	 */
+	bool getPartition(uint8_t partition, uint32_t *start, uint32_t *length);
+
 	/*! Performs any configuration of the device.  Returns a simple true/false
 	 * bool on success or failure.  Sets errno accordingly.
 	 */
@@ -223,7 +285,11 @@ public:
 
 	/*! This function flushes any cached data to the block device.
 	 */
-	void sync();
+	virtual void sync();
+
+	/*! Flush just the cached blocks from "blockno" to "blockno + count - 1".
+	 */
+	virtual void syncBlocks(uint32_t blockno, uint32_t count);
 
 	/*! Returns the number of sectors on the device
 	 */
@@ -263,29 +329,182 @@ public:
     virtual size_t getSectorSize();
 };
 
-/*! The FileSystem class is an interface class which defines the functions
- *  used to access a filesystem.  It implements a subset of the POSIX functions
- *  for accessing files and directories.
+/*! The PathParser class steps through the components of a path in place.
+ *  Nothing is copied or allocated: each component is returned as a pointer
+ *  into the path and a length.  Repeated slashes are skipped.  "." and
+ *  ".." are returned like any other name for the filesystem to act on.
+ *
+ *      PathParser parts("/logs//today/data.txt");
+ *      const char *name;
+ *      size_t len;
+ *      while (parts.next(&name, &len)) {
+ *          ...
+ *      }
  */
+class PathParser {
+private:
+	const char	*_pos;
+
+public:
+				PathParser(const char *path) { _pos = path; }
+
+	/*! Get the next component.  Returns false when there are no more. */
+	bool		next(const char **name, size_t *len);
+};
 
 class FileSystem;
 
+/*! Number of runs of contiguous clusters an open file remembers.  A file in
+ *  more pieces than this keeps a sliding window of them.
+ */
+#define FILE_MAX_EXTENTS 8
+
+/** @name Open modes
+ *  Flags for FileSystem::open(), or'd together.
+ */
+///@{
+/*! Open for reading */
+#define FILE_READ		0x01
+/*! Open for writing, starting at the beginning unless seek()ed */
+#define FILE_WRITE		0x02
+/*! Create the file if it doesn't exist */
+#define FILE_CREATE		0x04
+/*! Every write goes on the end of the file */
+#define FILE_APPEND		0x08
+/*! Throw away the existing contents when opening */
+#define FILE_TRUNCATE	0x10
+/*! Append-only log: writes are buffered and committed in groups */
+#define FILE_LOG		0x20
+///@}
+
+/*! Default for how much a FILE_LOG file gathers before committing */
+#define FILE_LOG_COMMIT_BYTES		4096
+/*! Default for how long (ms) a FILE_LOG file waits before committing */
+#define FILE_LOG_COMMIT_INTERVAL	1000
+/*! Default for how many clusters a FILE_LOG file takes at a time */
+#define FILE_LOG_BATCH				4
+
+/*! One run of contiguous clusters in a file */
+struct file_extent {
+	uint32_t	first;		// Cluster number within the file
+	uint32_t	cluster;	// First cluster of the run on the volume
+	uint32_t	length;		// Number of clusters in the run
+};
+
+/*! What a lookup found: where a file is, and what its directory entry says */
+struct file_record {
+	uint32_t	parent;		// Directory holding the entry, 0 for the root
+	uint32_t	cluster;	// First cluster, 0 if the file is empty
+	uint32_t	size;
+	uint8_t		attribs;
+	uint16_t	date;		// Last written
+	uint16_t	time;
+	uint32_t	block;		// Volume block holding the directory entry ...
+	uint16_t	index;		// ... and its index within the block
+};
+
+/*! Number of different files a FileSystem can have open at once */
+#ifndef FS_MAX_OPEN_FILES
+#define FS_MAX_OPEN_FILES 4
+#endif
+
+/*! Everything about an open file that every File open on it shares.  The
+ *  FileSystem keeps a fixed table of these.
+ */
+struct open_file {
+	uint8_t		refs;			// Files using the entry, 0 if it's free
+	uint32_t	parent;
+	uint32_t	inode;
+	uint32_t	size;
+	bool		dirty;			// Size or first cluster changed since the last commit
+
+	// Where the filesystem keeps the file's directory entry
+	uint32_t	entryBlock;
+	uint16_t	entryIndex;
+
+	// Clusters written since the last commit that may still be in the cache
+	uint32_t	dirtyFirst;
+	uint32_t	dirtyLast;
+
+	// Set up by File::preallocate()
+	uint32_t	prealloc;		// Bytes of contiguous clusters reserved, 0 if none
+	uint32_t	written;		// Furthest written so far
+	bool		trim;			// Give back what wasn't written on close
+
+	struct file_extent	extents[FILE_MAX_EXTENTS];
+	uint8_t		extentCount;
+
+	// FILE_LOG state.  The buffer holds the cluster starting at logBase.
+	uint8_t		*logBuf;
+	uint32_t	logBase;
+	uint32_t	logFill;		// Bytes of the cluster in the buffer
+	uint32_t	logSynced;		// Bytes of the cluster already on the volume
+	uint32_t	committed;		// Size the directory entry says
+	uint32_t	commitTime;
+	uint32_t	commitBytes;
+	uint32_t	commitInterval;
+	uint8_t		logBatch;
+};
+
+/*! A handle on an open file.  Copying a File is cheap - the copy shares the
+ *  open file with the original, and the file is only written out and let go
+ *  of when the last File using it is closed or destroyed.
+ */
 class File : public Stream {
 private:
-	uint32_t	_parent;
-	uint32_t	_inode;
-	uint32_t	_position;
 	FileSystem 	*_fs;
-	uint32_t 	_size;
-	uint32_t 	_posInode;
-	bool		_isValid;
+	struct open_file *_file;	// NULL if not open
+	uint32_t	_position;
+	uint8_t		_mode;
+
+	void	attach(FileSystem *fs, uint32_t parent, uint32_t child, uint32_t size, uint32_t entryBlock, uint16_t entryIndex, uint8_t mode);
+	void	release();
+	struct file_extent *mapExtent(uint32_t index, uint32_t want);
+	size_t	writeThrough(const uint8_t *buffer, size_t len);
+	bool	drainLog();
+	bool	trimChain(uint32_t clusters);
 
 public:
 	// Stream interface functions
 	int 	read();
 	size_t	readBytes(char *, size_t);
 
-	size_t 	write(uint8_t c) { return 0; }
+	size_t 	write(uint8_t c) { return write(&c, 1); }
+	size_t	write(const uint8_t *buffer, size_t len);
+
+	/*! Reserve "size" bytes of contiguous clusters for an empty file, on a
+	 *  boundary of the device's erase unit if one can be found, and record
+	 *  them and the size on the volume straight away.  With trim true the
+	 *  file is cut back to what was actually written when it is closed.
+	 *
+	 *      File f = fs.open("/capture.bin", FILE_WRITE | FILE_CREATE | FILE_TRUNCATE);
+	 *      f.preallocate(16UL * 1024 * 1024);
+	 *      while (capturing) f.writeBlocks(samples, 8);
+	 *      f.close();
+	 */
+	bool	preallocate(uint32_t size, bool trim = true);
+
+	/*! Stream whole blocks into a preallocated file at the current position,
+	 *  which must be on a block boundary.  They go to the device in one
+	 *  multi-block write, with no FAT or directory updates at all.  Returns
+	 *  the number of blocks written, which stops short at the end of the
+	 *  preallocated space.
+	 */
+	uint32_t writeBlocks(const uint8_t *data, uint32_t count);
+
+	/*! Set when a FILE_LOG file commits by itself: once "bytes" have been
+	 *  written or "interval" ms have passed since the last commit, whichever
+	 *  comes first.  Clusters are taken "batch" at a time.  0 turns a limit
+	 *  off.
+	 */
+	void	setLogCommit(uint32_t bytes, uint32_t interval, uint8_t batch = FILE_LOG_BATCH);
+
+	/*! Put everything written so far on the volume, with the directory entry
+	 *  and FAT to match.  What was written before a commit survives losing
+	 *  power after it.  Only this file's blocks are written out, not the
+	 *  rest of the cache.
+	 */
+	bool	commit();
 	int		available();
 	int		peek() { return 0; }
 	void	flush();
@@ -293,47 +512,102 @@ public:
     void seek(uint32_t pos) { _position = pos; }
 
 	operator bool();
-//    File & operator =(const File &other);
 
 	// Constructors
 	File(FileSystem *fs, uint32_t parent, uint32_t child, bool);
-    File() { _isValid = false; };
+	File(FileSystem *fs, const struct file_record &record, uint8_t mode);
+    File();
+	File(const File &other);
+	File & operator =(const File &other);
 	~File();
-	uint32_t length() { return _size; }
-    void close() {}
-};
+	uint32_t length() { return (_file != NULL) ? _file->size : 0; }
 
+	/*! Let go of the file.  If no other File has it open it's written out. */
+    void close();
+};
 
+/*! The FileSystem class is an interface class which defines the functions
+ *  used to access a filesystem.  It implements a subset of the POSIX functions
+ *  for accessing files and directories.
+ */
 class FileSystem {
+	friend class File;
+
 protected:
 	File	*_root;
 	BlockDevice *_dev;
 
+	struct open_file _files[FS_MAX_OPEN_FILES];
+
+	struct open_file *claimFile(uint32_t parent, uint32_t inode, uint32_t size, uint32_t entryBlock, uint16_t entryIndex);
+
 public:
-	virtual bool begin() = 0;
+	FileSystem();
 
-	virtual int 			parsePath(String const &path, char **parts) { return parsePath(path.c_str(), parts); }
-	virtual int 			parsePath(const char *path, char **parts);
+	virtual bool begin() = 0;
 
 	virtual uint32_t		getInode(const char *path) { return getInode(0, path, NULL); }
-	virtual uint32_t 		getInode(uint32_t parent, const char *path) { return getInode(0, path, NULL); }
+	virtual uint32_t 		getInode(uint32_t parent, const char *path) { return getInode(parent, path, NULL); }
 	virtual uint32_t		getInode(uint32_t parent, const char *path, uint32_t *ancestor) = 0;
 	virtual uint32_t		getNextInode(uint32_t inode) = 0;
-
-	virtual uint32_t		getInodeSize(uint32_t parent, uint32_t child);
-	virtual int				readFileByte(uint32_t start, uint32_t offset);
-	virtual int				readClusterByte(uint32_t start, uint32_t offset);
-	virtual uint32_t		readFileBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len);
-	virtual uint32_t		readClusterBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len);
+	/*! True if a value returned by getNextInode() is not another cluster */
+	virtual bool			isEndOfChain(uint32_t inode) = 0;
+
+	virtual uint32_t		getInodeSize(uint32_t parent, uint32_t child) = 0;
+	virtual int				readFileByte(uint32_t start, uint32_t offset) = 0;
+	virtual int				readClusterByte(uint32_t start, uint32_t offset) = 0;
+	virtual uint32_t		readFileBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len) = 0;
+	/*! Read from a cluster.  The offset and length may run on past the end
+	 *  of the cluster into the ones physically following it, so a whole run
+	 *  of contiguous clusters can be read in one go.
+	 */
+	virtual uint32_t		readClusterBytes(uint32_t start, uint32_t offset, uint8_t *buffer, uint32_t len) = 0;
 	virtual uint32_t		getClusterSize() = 0;
 
-	virtual File			open(const char *filename) = 0;
+	/*! Open a file with a combination of the FILE_* modes.  The File is
+	 *  false if it can't be opened, with errno saying why.
+	 */
+	virtual File			open(const char *filename, uint8_t mode) = 0;
+	virtual File			open(const char *filename) { return open(filename, FILE_READ); }
+	/*! Find a file or directory, and fill in everything its directory entry
+	 *  says about it.
+	 */
+	virtual bool			lookup(const char *path, struct file_record *record) = 0;
 	virtual void			sync();
+	/*! Write out one file: the cached blocks of clusters "first" to "last",
+	 *  the block holding its directory entry, and whatever the volume needs
+	 *  to stay consistent with them.
+	 */
+	virtual void			syncFile(uint32_t entryBlock, uint32_t first, uint32_t last) { sync(); }
+
+	/*! Take a free cluster and chain it on after "last", or start a new
+	 *  chain if "last" is 0.  Returns 0 with errno ENOSPC when full.
+	 */
+	virtual uint32_t		allocateCluster(uint32_t last) = 0;
+	/*! Release every cluster of a chain */
+	virtual bool			freeChain(uint32_t start) = 0;
+	/*! The writing counterpart of readClusterBytes() */
+	virtual uint32_t		writeClusterBytes(uint32_t start, uint32_t offset, const uint8_t *buffer, uint32_t len) = 0;
+	/*! Take a run of "count" contiguous free clusters and chain them
+	 *  together, starting on an erase unit boundary if there is room.
+	 */
+	virtual uint32_t		allocateContiguous(uint32_t count) = 0;
+	/*! Cut a chain down to its first "keep" clusters, freeing the rest */
+	virtual bool			truncateChain(uint32_t start, uint32_t keep) = 0;
+	virtual uint32_t		getBlockSize() = 0;
+	/*! Record a file's first cluster and size in its directory entry */
+	virtual bool			updateInode(uint32_t parent, uint32_t entryBlock, uint16_t entryIndex, uint32_t inode, uint32_t size) = 0;
 };
 
 
 #include <SDCard.h>
 #include <SPIFlash.h>
+#include <StripedDevice.h>
+#include <PartitionDevice.h>
+#include <RamDisk.h>
+#include <CompressedDevice.h>
+#include <LogicalSectorDevice.h>
+#include <CachedBlockDevice.h>
 #include <Fat.h>
 
 #endif
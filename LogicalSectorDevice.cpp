@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+LogicalSectorDevice::LogicalSectorDevice(BlockDevice &parent, size_t sectorSize) {
+	_parent = &parent;
+	_blockSize = sectorSize;
+	_perBlock = 0;
+	_sectors = 0;
+}
+
+bool LogicalSectorDevice::initialize() {
+	uint32_t physical = _parent->getSectorSize();
+
+	if ((_blockSize == 0) || (physical < _blockSize) || (physical % _blockSize != 0)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	_perBlock = physical / _blockSize;
+	_sectors = _parent->getCapacity() * _perBlock;
+
+	// The partition table, if any, is in terms of logical sectors.
+	loadPartitionTable();
+	errno = 0;
+	return true;
+}
+
+bool LogicalSectorDevice::insert() {
+	return initialize();
+}
+
+bool LogicalSectorDevice::eject() {
+	_parent->sync();
+	return true;
+}
+
+// Copy sectors out of the parent's cached physical blocks, handing whole
+// aligned physical blocks straight to the parent.
+bool LogicalSectorDevice::readSectors(uint32_t block, uint32_t count, uint8_t *data) {
+	if ((block >= _sectors) || (count > _sectors - block)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	while (count > 0) {
+		uint32_t phys = block / _perBlock;
+		uint32_t sub = block % _perBlock;
+
+		if ((sub == 0) && (count >= _perBlock)) {
+			uint32_t whole = count / _perBlock;
+			if (!_parent->readBlocks(phys, whole, data)) {
+				return false;
+			}
+			block += whole * _perBlock;
+			count -= whole * _perBlock;
+			data += whole * _perBlock * _blockSize;
+			continue;
+		}
+
+		uint32_t n = min(count, _perBlock - sub);
+		uint8_t *cached = _parent->lockBlock(phys);
+		if (cached == NULL) {
+			return false;
+		}
+		memcpy(data, cached + (sub * _blockSize), n * _blockSize);
+		_parent->unlockBlock(phys, false);
+
+		block += n;
+		count -= n;
+		data += n * _blockSize;
+	}
+	return true;
+}
+
+// Merge sectors into the parent's cached physical blocks.  The parent writes
+// each block back once, however many of its sectors were changed.
+bool LogicalSectorDevice::writeSectors(uint32_t block, uint32_t count, const uint8_t *data) {
+	if ((block >= _sectors) || (count > _sectors - block)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	while (count > 0) {
+		uint32_t phys = block / _perBlock;
+		uint32_t sub = block % _perBlock;
+
+		if ((sub == 0) && (count >= _perBlock)) {
+			uint32_t whole = count / _perBlock;
+			if (!_parent->writeBlocks(phys, whole, data)) {
+				return false;
+			}
+			block += whole * _perBlock;
+			count -= whole * _perBlock;
+			data += whole * _perBlock * _blockSize;
+			continue;
+		}
+
+		uint32_t n = min(count, _perBlock - sub);
+		uint8_t *cached = _parent->lockBlock(phys);
+		if (cached == NULL) {
+			return false;
+		}
+		memcpy(cached + (sub * _blockSize), data, n * _blockSize);
+		_parent->unlockBlock(phys, true);
+
+		block += n;
+		count -= n;
+		data += n * _blockSize;
+	}
+	return true;
+}
+
+bool LogicalSectorDevice::readBlock(uint32_t block, uint8_t *data) {
+	return readSectors(block, 1, data);
+}
+
+bool LogicalSectorDevice::readSystemBlock(uint32_t block, uint8_t *data) {
+	return readSectors(block, 1, data);
+}
+
+bool LogicalSectorDevice::writeBlock(uint32_t block, uint8_t *data) {
+	return writeSectors(block, 1, data);
+}
+
+bool LogicalSectorDevice::writeSystemBlock(uint32_t block, uint8_t *data) {
+	return writeSectors(block, 1, data);
+}
+
+bool LogicalSectorDevice::readBlocks(uint32_t block, uint32_t count, uint8_t *data) {
+	return readSectors(block, count, data);
+}
+
+bool LogicalSectorDevice::writeBlocks(uint32_t block, uint32_t count, const uint8_t *data) {
+	return writeSectors(block, count, data);
+}
+
+bool LogicalSectorDevice::readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+	if ((block >= _sectors) || (offset >= _blockSize) || (len > _blockSize - offset)) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->readBlockBytes(block / _perBlock, ((block % _perBlock) * _blockSize) + offset, len, data);
+}
+
+uint8_t *LogicalSectorDevice::lockBlock(uint32_t block) {
+	if (block >= _sectors) {
+		errno = EINVAL;
+		return NULL;
+	}
+	uint8_t *cached = _parent->lockBlock(block / _perBlock);
+	if (cached == NULL) {
+		return NULL;
+	}
+	return cached + ((block % _perBlock) * _blockSize);
+}
+
+void LogicalSectorDevice::unlockBlock(uint32_t block, bool dirty) {
+	if (block < _sectors) {
+		_parent->unlockBlock(block / _perBlock, dirty);
+	}
+}
+
+bool LogicalSectorDevice::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	return readSectors(block, 1, data);
+}
+
+bool LogicalSectorDevice::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	return writeSectors(block, 1, data);
+}
+
+void LogicalSectorDevice::sync() {
+	_parent->sync();
+}
+
+bool LogicalSectorDevice::isBusy() {
+	return _parent->isBusy();
+}
+
+void LogicalSectorDevice::setCacheMode(uint8_t cacheMode) {
+	_parent->setCacheMode(cacheMode);
+}
+
+void LogicalSectorDevice::printCacheStats() {
+	Serial.print("Logical sectors: ");
+	Serial.print((uint32_t)_blockSize);
+	Serial.print(" bytes, ");
+	Serial.print(_perBlock);
+	Serial.println(" per physical block");
+	_parent->printCacheStats();
+}
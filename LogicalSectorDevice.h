@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The LogicalSectorDevice class presents a device with large blocks -
+ *  the 4096 byte erase blocks of a SPI flash chip, say - as a device with
+ *  small logical sectors that FAT is happy with.
+ *
+ *  It has no cache of its own.  Each sector is read or written in place in
+ *  the parent's cached copy of the physical block that holds it, so one
+ *  cached physical block serves all of its sectors and a run of sector
+ *  updates costs a single erase and program when the block is finally
+ *  written back:
+ *
+ *      SPIFlash flash(spi, 10);
+ *      flash.initialize();
+ *      LogicalSectorDevice sectors(flash);
+ *      Fat fs(sectors);
+ *      if (!fs.begin()) fs.format();
+ *
+ *  Transfers of whole, aligned physical blocks go straight through to the
+ *  parent.  As with a PartitionDevice the parent must be initialized first.
+ */
+
+#ifndef _LOGICALSECTORDEVICE_H
+#define _LOGICALSECTORDEVICE_H
+
+#include <FileSystem.h>
+
+class LogicalSectorDevice : public BlockDevice {
+private:
+	BlockDevice	*_parent;
+	uint32_t	_perBlock;		// Logical sectors per physical block
+	uint32_t	_sectors;
+
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+
+	bool		readSectors(uint32_t blockno, uint32_t count, uint8_t *data);
+	bool		writeSectors(uint32_t blockno, uint32_t count, const uint8_t *data);
+
+public:
+				LogicalSectorDevice(BlockDevice &parent, size_t sectorSize = 512);
+
+	bool		initialize();
+	bool		eject();
+	bool		insert();
+
+	bool		readBlock(uint32_t blockno, uint8_t *data);
+	bool		readSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		writeBlock(uint32_t blockno, uint8_t *data);
+	bool		writeSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		readBlocks(uint32_t blockno, uint32_t count, uint8_t *data);
+	bool		writeBlocks(uint32_t blockno, uint32_t count, const uint8_t *data);
+	bool		readBlockBytes(uint32_t blockno, uint32_t offset, uint32_t len, uint8_t *data);
+	uint8_t		*lockBlock(uint32_t blockno);
+	void		unlockBlock(uint32_t blockno, bool dirty);
+
+	void		sync();
+	void		syncBlocks(uint32_t blockno, uint32_t count) { sync(); }
+	bool		isBusy();
+	void		setCacheMode(uint8_t cacheMode);
+	void		printCacheStats();
+
+	size_t		getCapacity() { return _sectors; }
+};
+
+#endif
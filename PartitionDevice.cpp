@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+// Marks a device built from an explicit block range rather than a partition
+#define PARTITION_RANGE 0xFF
+
+PartitionDevice::PartitionDevice(BlockDevice &parent, uint8_t partition) {
+	_parent = &parent;
+	_partition = partition & 0x03;
+	_start = 0;
+	_length = 0;
+}
+
+PartitionDevice::PartitionDevice(BlockDevice &parent, uint32_t start, uint32_t length) {
+	_parent = &parent;
+	_partition = PARTITION_RANGE;
+	_start = start;
+	_length = length;
+}
+
+bool PartitionDevice::initialize() {
+	_blockSize = _parent->getSectorSize();
+
+	if (_partition != PARTITION_RANGE) {
+		return _parent->getPartition(_partition, &_start, &_length);
+	}
+
+	uint32_t capacity = _parent->getCapacity();
+	if ((_length == 0) || (_start >= capacity) || (_length > capacity - _start)) {
+		errno = ENODEV;
+		return false;
+	}
+	errno = 0;
+	return true;
+}
+
+bool PartitionDevice::insert() {
+	return initialize();
+}
+
+bool PartitionDevice::eject() {
+	_parent->sync();
+	return true;
+}
+
+bool PartitionDevice::readBlock(uint32_t block, uint8_t *data) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->readBlock(_start + block, data);
+}
+
+bool PartitionDevice::readSystemBlock(uint32_t block, uint8_t *data) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->readSystemBlock(_start + block, data);
+}
+
+bool PartitionDevice::writeBlock(uint32_t block, uint8_t *data) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->writeBlock(_start + block, data);
+}
+
+bool PartitionDevice::writeSystemBlock(uint32_t block, uint8_t *data) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->writeSystemBlock(_start + block, data);
+}
+
+bool PartitionDevice::readBlocks(uint32_t block, uint32_t count, uint8_t *data) {
+	if ((block >= _length) || (count > _length - block)) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->readBlocks(_start + block, count, data);
+}
+
+bool PartitionDevice::writeBlocks(uint32_t block, uint32_t count, const uint8_t *data) {
+	if ((block >= _length) || (count > _length - block)) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->writeBlocks(_start + block, count, data);
+}
+
+bool PartitionDevice::readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return false;
+	}
+	return _parent->readBlockBytes(_start + block, offset, len, data);
+}
+
+uint8_t *PartitionDevice::lockBlock(uint32_t block) {
+	if (block >= _length) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return _parent->lockBlock(_start + block);
+}
+
+void PartitionDevice::unlockBlock(uint32_t block, bool dirty) {
+	if (block < _length) {
+		_parent->unlockBlock(_start + block, dirty);
+	}
+}
+
+bool PartitionDevice::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	return readBlocks(block, 1, data);
+}
+
+bool PartitionDevice::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	return writeBlocks(block, 1, data);
+}
+
+void PartitionDevice::sync() {
+	_parent->sync();
+}
+
+void PartitionDevice::syncBlocks(uint32_t block, uint32_t count) {
+	if (block < _length) {
+		_parent->syncBlocks(_start + block, min(count, _length - block));
+	}
+}
+
+bool PartitionDevice::isBusy() {
+	return _parent->isBusy();
+}
+
+void PartitionDevice::setCacheMode(uint8_t cacheMode) {
+	_parent->setCacheMode(cacheMode);
+}
+
+void PartitionDevice::printCacheStats() {
+	_parent->printCacheStats();
+}
+
+size_t PartitionDevice::getSectorSize() {
+	return _parent->getSectorSize();
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The PartitionDevice class presents a single partition (or any fixed
+ *  range of blocks) of another block device as a block device in its own
+ *  right, with block 0 at the start of the partition.
+ *
+ *  It has no cache of its own - every access goes straight through to the
+ *  parent's cache with one bounds check and one addition - so any number
+ *  of partitions of the same device can be mounted at once:
+ *
+ *      sd.initialize();
+ *      PartitionDevice boot(sd, 0);
+ *      PartitionDevice data(sd, 1);
+ *      Fat bootfs(boot);
+ *      Fat datafs(data);
+ *
+ *  The parent is shared, so it is never initialized by the partition; that
+ *  must be done first.
+ */
+
+#ifndef _PARTITIONDEVICE_H
+#define _PARTITIONDEVICE_H
+
+#include <FileSystem.h>
+
+class PartitionDevice : public BlockDevice {
+private:
+	BlockDevice	*_parent;
+	uint8_t		_partition;
+	uint32_t	_start;
+	uint32_t	_length;
+
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+
+public:
+				PartitionDevice(BlockDevice &parent, uint8_t partition);
+				PartitionDevice(BlockDevice &parent, uint32_t start, uint32_t length);
+
+	bool		initialize();
+	bool		eject();
+	bool		insert();
+
+	bool		readBlock(uint32_t blockno, uint8_t *data);
+	bool		readSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		writeBlock(uint32_t blockno, uint8_t *data);
+	bool		writeSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		readBlocks(uint32_t blockno, uint32_t count, uint8_t *data);
+	bool		writeBlocks(uint32_t blockno, uint32_t count, const uint8_t *data);
+	bool		readBlockBytes(uint32_t blockno, uint32_t offset, uint32_t len, uint8_t *data);
+	uint8_t		*lockBlock(uint32_t blockno);
+	void		unlockBlock(uint32_t blockno, bool dirty);
+
+	void		sync();
+	void		syncBlocks(uint32_t blockno, uint32_t count);
+	bool		isBusy();
+	uint32_t	getEraseSize() { return _parent->getEraseSize(); }
+	uint32_t	getBlockOffset() { return _parent->getBlockOffset() + _start; }
+	void		setCacheMode(uint8_t cacheMode);
+	void		printCacheStats();
+
+	size_t		getCapacity() { return _length; }
+	size_t		getSectorSize();
+
+	/*! First block of the partition on the parent device */
+	uint32_t	getStart() { return _start; }
+};
+
+#endif
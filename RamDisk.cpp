@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+RamDisk::RamDisk(uint8_t *buffer, size_t sectors, size_t sectorSize) {
+	_data = buffer;
+	_sectors = sectors;
+	_blockSize = sectorSize;
+}
+
+bool RamDisk::initialize() {
+	if (_data == NULL) {
+		errno = ENODEV;
+		return false;
+	}
+	// Scratch disks are normally used whole, so a missing table is fine.
+	loadPartitionTable();
+	errno = 0;
+	return true;
+}
+
+bool RamDisk::insert() {
+	return initialize();
+}
+
+bool RamDisk::eject() {
+	return true;
+}
+
+bool RamDisk::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	return readBlocks(block, 1, data);
+}
+
+bool RamDisk::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	return writeBlocks(block, 1, data);
+}
+
+bool RamDisk::readBlock(uint32_t block, uint8_t *data) {
+	return readBlocks(block, 1, data);
+}
+
+bool RamDisk::readSystemBlock(uint32_t block, uint8_t *data) {
+	return readBlocks(block, 1, data);
+}
+
+bool RamDisk::writeBlock(uint32_t block, uint8_t *data) {
+	return writeBlocks(block, 1, data);
+}
+
+bool RamDisk::writeSystemBlock(uint32_t block, uint8_t *data) {
+	return writeBlocks(block, 1, data);
+}
+
+bool RamDisk::readBlocks(uint32_t block, uint32_t count, uint8_t *data) {
+	if ((block >= _sectors) || (count > _sectors - block)) {
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(data, _data + (block * _blockSize), count * _blockSize);
+	return true;
+}
+
+bool RamDisk::writeBlocks(uint32_t block, uint32_t count, const uint8_t *data) {
+	if ((block >= _sectors) || (count > _sectors - block)) {
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(_data + (block * _blockSize), data, count * _blockSize);
+	return true;
+}
+
+bool RamDisk::readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+	if ((block >= _sectors) || (offset >= _blockSize) || (len > _blockSize - offset)) {
+		errno = EINVAL;
+		return false;
+	}
+	memcpy(data, _data + (block * _blockSize) + offset, len);
+	return true;
+}
+
+uint8_t *RamDisk::lockBlock(uint32_t block) {
+	if (block >= _sectors) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return _data + (block * _blockSize);
+}
+
+void RamDisk::printCacheStats() {
+	Serial.print("RAM disk: ");
+	Serial.print((uint32_t)_sectors);
+	Serial.print(" sectors of ");
+	Serial.print((uint32_t)_blockSize);
+	Serial.println(" bytes, uncached");
+}
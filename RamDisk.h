@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The RamDisk class implements the BlockDevice interface over a block of
+ *  memory supplied by the caller - internal SRAM, external PSRAM, whatever.
+ *  It makes a fast scratch area that doesn't wear out any flash.
+ *
+ *  The data is already in memory, so the block cache is bypassed entirely:
+ *  reads and writes are a single memcpy and lockBlock() hands out pointers
+ *  straight into the buffer.
+ *
+ *      static uint8_t scratch[64 * 1024];
+ *      RamDisk ram(scratch, sizeof(scratch) / 512);
+ *      Fat tmp(ram);
+ *      tmp.format();
+ *
+ *  The contents are lost when the power goes, of course.
+ */
+
+#ifndef _RAMDISK_H
+#define _RAMDISK_H
+
+#include <FileSystem.h>
+
+class RamDisk : public BlockDevice {
+private:
+	uint8_t		*_data;
+	size_t		_sectors;
+
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+
+public:
+				RamDisk(uint8_t *buffer, size_t sectors, size_t sectorSize = 512);
+
+	bool		initialize();
+	bool		eject();
+	bool		insert();
+
+	bool		readBlock(uint32_t blockno, uint8_t *data);
+	bool		readSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		writeBlock(uint32_t blockno, uint8_t *data);
+	bool		writeSystemBlock(uint32_t blockno, uint8_t *data);
+	bool		readBlocks(uint32_t blockno, uint32_t count, uint8_t *data);
+	bool		writeBlocks(uint32_t blockno, uint32_t count, const uint8_t *data);
+	bool		readBlockBytes(uint32_t blockno, uint32_t offset, uint32_t len, uint8_t *data);
+	uint8_t		*lockBlock(uint32_t blockno);
+	void		unlockBlock(uint32_t blockno, bool dirty) {}
+
+	void		sync() {}
+	void		printCacheStats();
+
+	size_t		getCapacity() { return _sectors; }
+};
+
+#endif
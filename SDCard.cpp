@@ -30,33 +30,259 @@
  
 #include <FileSystem.h>
 
+// CRC7 (x^7 + x^3 + 1) of a single byte, used for command frames.
+static const uint8_t crc7Table[256] = {
+	0x00, 0x09, 0x12, 0x1b, 0x24, 0x2d, 0x36, 0x3f, 0x48, 0x41, 0x5a, 0x53, 0x6c, 0x65, 0x7e, 0x77,
+	0x19, 0x10, 0x0b, 0x02, 0x3d, 0x34, 0x2f, 0x26, 0x51, 0x58, 0x43, 0x4a, 0x75, 0x7c, 0x67, 0x6e,
+	0x32, 0x3b, 0x20, 0x29, 0x16, 0x1f, 0x04, 0x0d, 0x7a, 0x73, 0x68, 0x61, 0x5e, 0x57, 0x4c, 0x45,
+	0x2b, 0x22, 0x39, 0x30, 0x0f, 0x06, 0x1d, 0x14, 0x63, 0x6a, 0x71, 0x78, 0x47, 0x4e, 0x55, 0x5c,
+	0x64, 0x6d, 0x76, 0x7f, 0x40, 0x49, 0x52, 0x5b, 0x2c, 0x25, 0x3e, 0x37, 0x08, 0x01, 0x1a, 0x13,
+	0x7d, 0x74, 0x6f, 0x66, 0x59, 0x50, 0x4b, 0x42, 0x35, 0x3c, 0x27, 0x2e, 0x11, 0x18, 0x03, 0x0a,
+	0x56, 0x5f, 0x44, 0x4d, 0x72, 0x7b, 0x60, 0x69, 0x1e, 0x17, 0x0c, 0x05, 0x3a, 0x33, 0x28, 0x21,
+	0x4f, 0x46, 0x5d, 0x54, 0x6b, 0x62, 0x79, 0x70, 0x07, 0x0e, 0x15, 0x1c, 0x23, 0x2a, 0x31, 0x38,
+	0x41, 0x48, 0x53, 0x5a, 0x65, 0x6c, 0x77, 0x7e, 0x09, 0x00, 0x1b, 0x12, 0x2d, 0x24, 0x3f, 0x36,
+	0x58, 0x51, 0x4a, 0x43, 0x7c, 0x75, 0x6e, 0x67, 0x10, 0x19, 0x02, 0x0b, 0x34, 0x3d, 0x26, 0x2f,
+	0x73, 0x7a, 0x61, 0x68, 0x57, 0x5e, 0x45, 0x4c, 0x3b, 0x32, 0x29, 0x20, 0x1f, 0x16, 0x0d, 0x04,
+	0x6a, 0x63, 0x78, 0x71, 0x4e, 0x47, 0x5c, 0x55, 0x22, 0x2b, 0x30, 0x39, 0x06, 0x0f, 0x14, 0x1d,
+	0x25, 0x2c, 0x37, 0x3e, 0x01, 0x08, 0x13, 0x1a, 0x6d, 0x64, 0x7f, 0x76, 0x49, 0x40, 0x5b, 0x52,
+	0x3c, 0x35, 0x2e, 0x27, 0x18, 0x11, 0x0a, 0x03, 0x74, 0x7d, 0x66, 0x6f, 0x50, 0x59, 0x42, 0x4b,
+	0x17, 0x1e, 0x05, 0x0c, 0x33, 0x3a, 0x21, 0x28, 0x5f, 0x56, 0x4d, 0x44, 0x7b, 0x72, 0x69, 0x60,
+	0x0e, 0x07, 0x1c, 0x15, 0x2a, 0x23, 0x38, 0x31, 0x46, 0x4f, 0x54, 0x5d, 0x62, 0x6b, 0x70, 0x79
+};
+
+// CRC16-CCITT (x^16 + x^12 + x^5 + 1) tables for slice-by-4 processing of
+// data blocks.  crc16Table[k][b] is the CRC of byte b followed by k zero bytes.
+static const uint16_t crc16Table[4][256] = {
+	{
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+		0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+		0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+		0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+		0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+		0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+		0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+		0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+		0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+		0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+		0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+		0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+		0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+		0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+		0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+		0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+		0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+		0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+		0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+		0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+		0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+		0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+		0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+		0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+		0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+		0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+		0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+		0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+		0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+		0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+		0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+		0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+	},
+	{
+		0x0000, 0x3331, 0x6662, 0x5553, 0xccc4, 0xfff5, 0xaaa6, 0x9997,
+		0x89a9, 0xba98, 0xefcb, 0xdcfa, 0x456d, 0x765c, 0x230f, 0x103e,
+		0x0373, 0x3042, 0x6511, 0x5620, 0xcfb7, 0xfc86, 0xa9d5, 0x9ae4,
+		0x8ada, 0xb9eb, 0xecb8, 0xdf89, 0x461e, 0x752f, 0x207c, 0x134d,
+		0x06e6, 0x35d7, 0x6084, 0x53b5, 0xca22, 0xf913, 0xac40, 0x9f71,
+		0x8f4f, 0xbc7e, 0xe92d, 0xda1c, 0x438b, 0x70ba, 0x25e9, 0x16d8,
+		0x0595, 0x36a4, 0x63f7, 0x50c6, 0xc951, 0xfa60, 0xaf33, 0x9c02,
+		0x8c3c, 0xbf0d, 0xea5e, 0xd96f, 0x40f8, 0x73c9, 0x269a, 0x15ab,
+		0x0dcc, 0x3efd, 0x6bae, 0x589f, 0xc108, 0xf239, 0xa76a, 0x945b,
+		0x8465, 0xb754, 0xe207, 0xd136, 0x48a1, 0x7b90, 0x2ec3, 0x1df2,
+		0x0ebf, 0x3d8e, 0x68dd, 0x5bec, 0xc27b, 0xf14a, 0xa419, 0x9728,
+		0x8716, 0xb427, 0xe174, 0xd245, 0x4bd2, 0x78e3, 0x2db0, 0x1e81,
+		0x0b2a, 0x381b, 0x6d48, 0x5e79, 0xc7ee, 0xf4df, 0xa18c, 0x92bd,
+		0x8283, 0xb1b2, 0xe4e1, 0xd7d0, 0x4e47, 0x7d76, 0x2825, 0x1b14,
+		0x0859, 0x3b68, 0x6e3b, 0x5d0a, 0xc49d, 0xf7ac, 0xa2ff, 0x91ce,
+		0x81f0, 0xb2c1, 0xe792, 0xd4a3, 0x4d34, 0x7e05, 0x2b56, 0x1867,
+		0x1b98, 0x28a9, 0x7dfa, 0x4ecb, 0xd75c, 0xe46d, 0xb13e, 0x820f,
+		0x9231, 0xa100, 0xf453, 0xc762, 0x5ef5, 0x6dc4, 0x3897, 0x0ba6,
+		0x18eb, 0x2bda, 0x7e89, 0x4db8, 0xd42f, 0xe71e, 0xb24d, 0x817c,
+		0x9142, 0xa273, 0xf720, 0xc411, 0x5d86, 0x6eb7, 0x3be4, 0x08d5,
+		0x1d7e, 0x2e4f, 0x7b1c, 0x482d, 0xd1ba, 0xe28b, 0xb7d8, 0x84e9,
+		0x94d7, 0xa7e6, 0xf2b5, 0xc184, 0x5813, 0x6b22, 0x3e71, 0x0d40,
+		0x1e0d, 0x2d3c, 0x786f, 0x4b5e, 0xd2c9, 0xe1f8, 0xb4ab, 0x879a,
+		0x97a4, 0xa495, 0xf1c6, 0xc2f7, 0x5b60, 0x6851, 0x3d02, 0x0e33,
+		0x1654, 0x2565, 0x7036, 0x4307, 0xda90, 0xe9a1, 0xbcf2, 0x8fc3,
+		0x9ffd, 0xaccc, 0xf99f, 0xcaae, 0x5339, 0x6008, 0x355b, 0x066a,
+		0x1527, 0x2616, 0x7345, 0x4074, 0xd9e3, 0xead2, 0xbf81, 0x8cb0,
+		0x9c8e, 0xafbf, 0xfaec, 0xc9dd, 0x504a, 0x637b, 0x3628, 0x0519,
+		0x10b2, 0x2383, 0x76d0, 0x45e1, 0xdc76, 0xef47, 0xba14, 0x8925,
+		0x991b, 0xaa2a, 0xff79, 0xcc48, 0x55df, 0x66ee, 0x33bd, 0x008c,
+		0x13c1, 0x20f0, 0x75a3, 0x4692, 0xdf05, 0xec34, 0xb967, 0x8a56,
+		0x9a68, 0xa959, 0xfc0a, 0xcf3b, 0x56ac, 0x659d, 0x30ce, 0x03ff
+	},
+	{
+		0x0000, 0x3730, 0x6e60, 0x5950, 0xdcc0, 0xebf0, 0xb2a0, 0x8590,
+		0xa9a1, 0x9e91, 0xc7c1, 0xf0f1, 0x7561, 0x4251, 0x1b01, 0x2c31,
+		0x4363, 0x7453, 0x2d03, 0x1a33, 0x9fa3, 0xa893, 0xf1c3, 0xc6f3,
+		0xeac2, 0xddf2, 0x84a2, 0xb392, 0x3602, 0x0132, 0x5862, 0x6f52,
+		0x86c6, 0xb1f6, 0xe8a6, 0xdf96, 0x5a06, 0x6d36, 0x3466, 0x0356,
+		0x2f67, 0x1857, 0x4107, 0x7637, 0xf3a7, 0xc497, 0x9dc7, 0xaaf7,
+		0xc5a5, 0xf295, 0xabc5, 0x9cf5, 0x1965, 0x2e55, 0x7705, 0x4035,
+		0x6c04, 0x5b34, 0x0264, 0x3554, 0xb0c4, 0x87f4, 0xdea4, 0xe994,
+		0x1dad, 0x2a9d, 0x73cd, 0x44fd, 0xc16d, 0xf65d, 0xaf0d, 0x983d,
+		0xb40c, 0x833c, 0xda6c, 0xed5c, 0x68cc, 0x5ffc, 0x06ac, 0x319c,
+		0x5ece, 0x69fe, 0x30ae, 0x079e, 0x820e, 0xb53e, 0xec6e, 0xdb5e,
+		0xf76f, 0xc05f, 0x990f, 0xae3f, 0x2baf, 0x1c9f, 0x45cf, 0x72ff,
+		0x9b6b, 0xac5b, 0xf50b, 0xc23b, 0x47ab, 0x709b, 0x29cb, 0x1efb,
+		0x32ca, 0x05fa, 0x5caa, 0x6b9a, 0xee0a, 0xd93a, 0x806a, 0xb75a,
+		0xd808, 0xef38, 0xb668, 0x8158, 0x04c8, 0x33f8, 0x6aa8, 0x5d98,
+		0x71a9, 0x4699, 0x1fc9, 0x28f9, 0xad69, 0x9a59, 0xc309, 0xf439,
+		0x3b5a, 0x0c6a, 0x553a, 0x620a, 0xe79a, 0xd0aa, 0x89fa, 0xbeca,
+		0x92fb, 0xa5cb, 0xfc9b, 0xcbab, 0x4e3b, 0x790b, 0x205b, 0x176b,
+		0x7839, 0x4f09, 0x1659, 0x2169, 0xa4f9, 0x93c9, 0xca99, 0xfda9,
+		0xd198, 0xe6a8, 0xbff8, 0x88c8, 0x0d58, 0x3a68, 0x6338, 0x5408,
+		0xbd9c, 0x8aac, 0xd3fc, 0xe4cc, 0x615c, 0x566c, 0x0f3c, 0x380c,
+		0x143d, 0x230d, 0x7a5d, 0x4d6d, 0xc8fd, 0xffcd, 0xa69d, 0x91ad,
+		0xfeff, 0xc9cf, 0x909f, 0xa7af, 0x223f, 0x150f, 0x4c5f, 0x7b6f,
+		0x575e, 0x606e, 0x393e, 0x0e0e, 0x8b9e, 0xbcae, 0xe5fe, 0xd2ce,
+		0x26f7, 0x11c7, 0x4897, 0x7fa7, 0xfa37, 0xcd07, 0x9457, 0xa367,
+		0x8f56, 0xb866, 0xe136, 0xd606, 0x5396, 0x64a6, 0x3df6, 0x0ac6,
+		0x6594, 0x52a4, 0x0bf4, 0x3cc4, 0xb954, 0x8e64, 0xd734, 0xe004,
+		0xcc35, 0xfb05, 0xa255, 0x9565, 0x10f5, 0x27c5, 0x7e95, 0x49a5,
+		0xa031, 0x9701, 0xce51, 0xf961, 0x7cf1, 0x4bc1, 0x1291, 0x25a1,
+		0x0990, 0x3ea0, 0x67f0, 0x50c0, 0xd550, 0xe260, 0xbb30, 0x8c00,
+		0xe352, 0xd462, 0x8d32, 0xba02, 0x3f92, 0x08a2, 0x51f2, 0x66c2,
+		0x4af3, 0x7dc3, 0x2493, 0x13a3, 0x9633, 0xa103, 0xf853, 0xcf63
+	},
+	{
+		0x0000, 0x76b4, 0xed68, 0x9bdc, 0xcaf1, 0xbc45, 0x2799, 0x512d,
+		0x85c3, 0xf377, 0x68ab, 0x1e1f, 0x4f32, 0x3986, 0xa25a, 0xd4ee,
+		0x1ba7, 0x6d13, 0xf6cf, 0x807b, 0xd156, 0xa7e2, 0x3c3e, 0x4a8a,
+		0x9e64, 0xe8d0, 0x730c, 0x05b8, 0x5495, 0x2221, 0xb9fd, 0xcf49,
+		0x374e, 0x41fa, 0xda26, 0xac92, 0xfdbf, 0x8b0b, 0x10d7, 0x6663,
+		0xb28d, 0xc439, 0x5fe5, 0x2951, 0x787c, 0x0ec8, 0x9514, 0xe3a0,
+		0x2ce9, 0x5a5d, 0xc181, 0xb735, 0xe618, 0x90ac, 0x0b70, 0x7dc4,
+		0xa92a, 0xdf9e, 0x4442, 0x32f6, 0x63db, 0x156f, 0x8eb3, 0xf807,
+		0x6e9c, 0x1828, 0x83f4, 0xf540, 0xa46d, 0xd2d9, 0x4905, 0x3fb1,
+		0xeb5f, 0x9deb, 0x0637, 0x7083, 0x21ae, 0x571a, 0xccc6, 0xba72,
+		0x753b, 0x038f, 0x9853, 0xeee7, 0xbfca, 0xc97e, 0x52a2, 0x2416,
+		0xf0f8, 0x864c, 0x1d90, 0x6b24, 0x3a09, 0x4cbd, 0xd761, 0xa1d5,
+		0x59d2, 0x2f66, 0xb4ba, 0xc20e, 0x9323, 0xe597, 0x7e4b, 0x08ff,
+		0xdc11, 0xaaa5, 0x3179, 0x47cd, 0x16e0, 0x6054, 0xfb88, 0x8d3c,
+		0x4275, 0x34c1, 0xaf1d, 0xd9a9, 0x8884, 0xfe30, 0x65ec, 0x1358,
+		0xc7b6, 0xb102, 0x2ade, 0x5c6a, 0x0d47, 0x7bf3, 0xe02f, 0x969b,
+		0xdd38, 0xab8c, 0x3050, 0x46e4, 0x17c9, 0x617d, 0xfaa1, 0x8c15,
+		0x58fb, 0x2e4f, 0xb593, 0xc327, 0x920a, 0xe4be, 0x7f62, 0x09d6,
+		0xc69f, 0xb02b, 0x2bf7, 0x5d43, 0x0c6e, 0x7ada, 0xe106, 0x97b2,
+		0x435c, 0x35e8, 0xae34, 0xd880, 0x89ad, 0xff19, 0x64c5, 0x1271,
+		0xea76, 0x9cc2, 0x071e, 0x71aa, 0x2087, 0x5633, 0xcdef, 0xbb5b,
+		0x6fb5, 0x1901, 0x82dd, 0xf469, 0xa544, 0xd3f0, 0x482c, 0x3e98,
+		0xf1d1, 0x8765, 0x1cb9, 0x6a0d, 0x3b20, 0x4d94, 0xd648, 0xa0fc,
+		0x7412, 0x02a6, 0x997a, 0xefce, 0xbee3, 0xc857, 0x538b, 0x253f,
+		0xb3a4, 0xc510, 0x5ecc, 0x2878, 0x7955, 0x0fe1, 0x943d, 0xe289,
+		0x3667, 0x40d3, 0xdb0f, 0xadbb, 0xfc96, 0x8a22, 0x11fe, 0x674a,
+		0xa803, 0xdeb7, 0x456b, 0x33df, 0x62f2, 0x1446, 0x8f9a, 0xf92e,
+		0x2dc0, 0x5b74, 0xc0a8, 0xb61c, 0xe731, 0x9185, 0x0a59, 0x7ced,
+		0x84ea, 0xf25e, 0x6982, 0x1f36, 0x4e1b, 0x38af, 0xa373, 0xd5c7,
+		0x0129, 0x779d, 0xec41, 0x9af5, 0xcbd8, 0xbd6c, 0x26b0, 0x5004,
+		0x9f4d, 0xe9f9, 0x7225, 0x0491, 0x55bc, 0x2308, 0xb8d4, 0xce60,
+		0x1a8e, 0x6c3a, 0xf7e6, 0x8152, 0xd07f, 0xa6cb, 0x3d17, 0x4ba3
+	}
+};
+
+uint8_t SDCard::crc7(const uint8_t *data, size_t len) {
+	uint8_t crc = 0;
+	while (len--) {
+		crc = crc7Table[(crc << 1) ^ *data++];
+	}
+	return crc;
+}
+
+uint16_t SDCard::crc16(const uint8_t *data, size_t len) {
+	uint16_t crc = 0;
+	while (len >= 4) {
+		crc = crc16Table[3][data[0] ^ (crc >> 8)] ^
+		      crc16Table[2][data[1] ^ (crc & 0xFF)] ^
+		      crc16Table[1][data[2]] ^
+		      crc16Table[0][data[3]];
+		data += 4;
+		len -= 4;
+	}
+	while (len--) {
+		crc = (crc << 8) ^ crc16Table[0][(crc >> 8) ^ *data++];
+	}
+	return crc;
+}
+
 SDCard::SDCard(DSPI &spi, int cs) {
 	_spi = &spi;
+	_softSPI = NULL;
 	_cs = cs;
-	_miso = -1;
-	_mosi = -1;
-	_sck = -1;
     _blockSize = 512;
+	_busy = false;
+	_eraseSize = 0;
+	_speed = 0;
+	_maxSpeed = SD_SPI_SPEED;
+	_cardSerial = 0;
+	_ioErrors = 0;
+	_crc = false;
+	_crcErrors = 0;
+	_readCrcBlocks = 0;
+	_readCrcMicros = 0;
+	_readXferMicros = 0;
+	_writeCrcBlocks = 0;
+	_writeCrcMicros = 0;
+	_writeXferMicros = 0;
 }
 
-SDCard::SDCard(int miso, int mosi, int sck, int cs) {
+SDCard::SDCard(BitBangSPI &spi, int cs) {
 	_spi = NULL;
+	_softSPI = &spi;
 	_cs = cs;
-	_miso = miso;
-	_mosi = mosi;
-	_sck = sck;
     _blockSize = 512;
+	_busy = false;
+	_eraseSize = 0;
+	_speed = 0;
+	_maxSpeed = SD_SPI_SPEED;
+	_cardSerial = 0;
+	_ioErrors = 0;
+	_crc = false;
+	_crcErrors = 0;
+	_readCrcBlocks = 0;
+	_readCrcMicros = 0;
+	_readXferMicros = 0;
+	_writeCrcBlocks = 0;
+	_writeCrcMicros = 0;
+	_writeXferMicros = 0;
+}
+
+SDCard::SDCard(int miso, int mosi, int sck, int cs) : _pinSPI(miso, mosi, sck) {
+	_spi = NULL;
+	_softSPI = &_pinSPI;
+	_cs = cs;
+    _blockSize = 512;
+	_busy = false;
+	_eraseSize = 0;
+	_speed = 0;
+	_maxSpeed = SD_SPI_SPEED;
+	_cardSerial = 0;
+	_ioErrors = 0;
+	_crc = false;
+	_crcErrors = 0;
+	_readCrcBlocks = 0;
+	_readCrcMicros = 0;
+	_readXferMicros = 0;
+	_writeCrcBlocks = 0;
+	_writeCrcMicros = 0;
+	_writeXferMicros = 0;
 }
 
 void SDCard::initializeSPIInterface() {
 	if (_spi != NULL) {
 		_spi->begin();
 	} else {
-		pinMode(_mosi, OUTPUT);
-		pinMode(_miso, INPUT);
-		pinMode(_sck, OUTPUT);
-		digitalWrite(_mosi, LOW);
-		digitalWrite(_sck, HIGH);
+		_softSPI->begin();
 	}
 	pinMode(_cs, OUTPUT);
 	digitalWrite(_cs, HIGH);
@@ -66,23 +292,15 @@ void SDCard::spiSend(uint8_t in) {
 	if (_spi != NULL) {
 		_spi->transfer(in);
 	} else {
-		digitalWrite(_mosi, HIGH);
-		shiftOut(_mosi, _sck, MSBFIRST, in);
+		_softSPI->transfer(in);
 	}
 }
 
-extern "C" {
-    extern uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder);
-    extern void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, byte data);
-}
-
 uint8_t SDCard::spiReceive() {
 	if (_spi != NULL) {
 		return _spi->transfer(0xFF);
 	}
-	digitalWrite(_mosi,HIGH);
-	digitalWrite(_miso, HIGH);
-	return shiftIn(_miso, _sck, MSBFIRST);
+	return _softSPI->transfer(0xFF);
 }
 
 bool SDCard::waitReady(int limit) {
@@ -100,24 +318,30 @@ bool SDCard::waitReady(int limit) {
 int SDCard::command(uint32_t cmd, uint32_t addr) {
 	int reply = 0;
 
+	// A card still programming the last written block holds the bus
+	// busy, so allow it the full write timeout before the next command.
 	if (cmd != CMD_GO_IDLE) {
-		if (!waitReady(TIMO_WAIT_CMD)) {
+		if (!waitReady(_busy ? TIMO_WAIT_WDONE : TIMO_WAIT_CMD)) {
 			return -1;
 		}
+		_busy = false;
 	}
 
-	spiSend(cmd | 0x40);
-	spiSend(addr >> 24);
-	spiSend(addr >> 16);
-	spiSend(addr >> 8);
-	spiSend(addr);
+	uint8_t frame[6];
+	frame[0] = cmd | 0x40;
+	frame[1] = addr >> 24;
+	frame[2] = addr >> 16;
+	frame[3] = addr >> 8;
+	frame[4] = addr;
+	frame[5] = (crc7(frame, 5) << 1) | 0x01;
 
-	if (cmd == CMD_GO_IDLE) {
-		spiSend(0x95);
-	} else if (cmd == CMD_SEND_IF_COND) {
-		spiSend(0x87);
-	} else {
-		spiSend(0xFF);
+	for (int i = 0; i < 6; i++) {
+		spiSend(frame[i]);
+	}
+
+	// The byte straight after CMD12 is a stuff byte, not the response.
+	if (cmd == CMD_STOP) {
+		spiReceive();
 	}
 
 	for (int i = 0; i < TIMO_CMD; i++) {
@@ -143,26 +367,207 @@ bool SDCard::initialize() {
 void SDCard::setSlowSPI() {
 	if (_spi != NULL) {
 		_spi->setSpeed(250000);
+	} else {
+		_softSPI->setSlow(true);
 	}
 }
 
 void SDCard::setFastSPI() {
 	if (_spi != NULL) {
-        switch (_transSpeed) {
-            default:
-            case TRANS_SPEED_25MHZ:
-                _spi->setSpeed(SD_SPI_SPEED); // Todo: Make this a configurable variable
-                break;
-            case TRANS_SPEED_50MHZ:
-                _spi->setSpeed(50000000UL);
-                break;
-            case TRANS_SPEED_100MHZ:
-                _spi->setSpeed(100000000UL);
-                break;
-            case TRANS_SPEED_200MHZ:
-                _spi->setSpeed(200000000UL);
-                break;
-        }
+		_spi->setSpeed(_speed);
+	} else {
+		_softSPI->setSlow(false);
+	}
+}
+
+// Maximum clock speeds to try when calibrating, slowest first.
+static const uint32_t speedSteps[] = {
+	4000000UL, 8000000UL, 10000000UL, 13333333UL, 16000000UL, 20000000UL,
+	25000000UL, 26666666UL, 33333333UL, 40000000UL, 50000000UL
+};
+#define NUM_SPEED_STEPS (sizeof(speedSteps) / sizeof(speedSteps[0]))
+
+uint32_t SDCard::decodeTransSpeed(uint8_t ts) {
+	// TRAN_SPEED is a time value (in tenths) times a rate unit.
+	static const uint8_t value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+	static const uint32_t unit[4] = { 10000UL, 100000UL, 1000000UL, 10000000UL };
+
+	if ((ts & 0x07) > 3) {
+		return 25000000UL;
+	}
+	uint32_t speed = value[(ts >> 3) & 0x0F] * unit[ts & 0x07];
+
+	// Whatever the card claims, SPI mode tops out at 50MHz.
+	if ((speed == 0) || (speed > 50000000UL)) {
+		speed = 50000000UL;
+	}
+	return speed;
+}
+
+bool SDCard::readRegister(uint8_t cmd, uint8_t *data, int len) {
+	int reply;
+
+	selectCard();
+	reply = command(cmd, 0);
+	if (reply != 0) {
+		deselectCard();
+		errno = EIO;
+		return false;
+	}
+
+	for (int i = 0; ; i++) {
+		reply = spiReceive();
+		if (reply == DATA_START_BLOCK) {
+			break;
+		}
+		if (i >= TIMO_SEND_CSD) {
+			deselectCard();
+			errno = EIO;
+			return false;
+		}
+	}
+
+	for (int i = 0; i < len; i++) {
+		data[i] = spiReceive();
+	}
+	spiReceive();
+	spiReceive();
+	deselectCard();
+	return true;
+}
+
+bool SDCard::switchFunction(uint32_t arg, uint8_t *status) {
+	int reply;
+
+	selectCard();
+	reply = command(CMD_6, arg);
+	if (reply != 0) {
+		deselectCard();
+		return false;
+	}
+
+	for (int i = 0; ; i++) {
+		reply = spiReceive();
+		if (reply == DATA_START_BLOCK) {
+			break;
+		}
+		if (i >= TIMO_READ) {
+			deselectCard();
+			return false;
+		}
+	}
+
+	for (int i = 0; i < 64; i++) {
+		status[i] = spiReceive();
+	}
+	spiReceive();
+	spiReceive();
+	deselectCard();
+	return true;
+}
+
+bool SDCard::switchHighSpeed() {
+	uint8_t status[64];
+
+	// Ask first (mode 0), leaving every other function group alone (0xF).
+	if (!switchFunction(0x00FFFFF1, status)) {
+		return false;
+	}
+
+	_ma = status[0] << 8 | status[1];
+	_group[0] = status[12] << 8 | status[13];
+	_group[1] = status[10] << 8 | status[11];
+	_group[2] = status[8] << 8 | status[9];
+	_group[3] = status[6] << 8 | status[7];
+	_group[4] = status[4] << 8 | status[5];
+	_group[5] = status[2] << 8 | status[3];
+
+	if (!(_group[0] & (1 << 1))) {
+		return false;
+	}
+
+	// Now actually make the switch (mode 1).
+	if (!switchFunction(0x80FFFFF1, status)) {
+		return false;
+	}
+
+	if ((status[16] & 0x0F) != 1) {
+		return false;
+	}
+
+	// The card needs 8 clocks before running at the new speed.
+	spiSend(0xFF);
+	return true;
+}
+
+uint32_t SDCard::getSpeed() {
+	return _speed;
+}
+
+void SDCard::setSpeed(uint32_t speed) {
+	_speed = min(speed, _maxSpeed);
+	_ioErrors = 0;
+	setFastSPI();
+}
+
+uint32_t SDCard::calibrate(uint32_t block) {
+	uint8_t reference[_blockSize];
+	uint8_t check[_blockSize];
+
+	if (_spi == NULL) {
+		return 0;
+	}
+
+	// Take the reference copy at a speed every card can manage.
+	_speed = speedSteps[0];
+	setFastSPI();
+	if (!readBlockFromDisk(block, reference)) {
+		return 0;
+	}
+
+	uint32_t good = _speed;
+	for (uint32_t step = 1; step < NUM_SPEED_STEPS; step++) {
+		if (speedSteps[step] > _maxSpeed) {
+			break;
+		}
+
+		_speed = speedSteps[step];
+		setFastSPI();
+
+		bool ok = true;
+		for (int pass = 0; pass < SD_CALIBRATE_PASSES; pass++) {
+			if (!readBlockFromDisk(block, check) || memcmp(reference, check, _blockSize)) {
+				ok = false;
+				break;
+			}
+		}
+		if (!ok) {
+			break;
+		}
+		good = _speed;
+	}
+
+	_speed = good;
+	_ioErrors = 0;
+	setFastSPI();
+	errno = 0;
+	return _speed;
+}
+
+void SDCard::ioError() {
+	_ioErrors++;
+	if (_ioErrors < SD_DOWNSHIFT_ERRORS) {
+		return;
+	}
+	_ioErrors = 0;
+
+	// Drop to the next step below the current speed.
+	for (int step = NUM_SPEED_STEPS - 1; step >= 0; step--) {
+		if (speedSteps[step] < _speed) {
+			_speed = speedSteps[step];
+			setFastSPI();
+			return;
+		}
 	}
 }
 
@@ -186,6 +591,9 @@ bool SDCard::insert() {
 
     initCacheBlocks();
 
+	_busy = false;
+	_eraseSize = 0;
+
 	do {
 		deselectCard();
 		for (i = 0; i < 10; i++) {
@@ -256,84 +664,49 @@ bool SDCard::insert() {
     	}
     }
 
-    _isHighSpeed = false;
-
-    uint8_t status[64];
-    selectCard();
-    reply = command(CMD_6, 0x80000001);
-    if (reply == 0) {
-        bool fail = false;
-        for (int i = 0; ; i++) {
-            reply = spiReceive();
-            if (reply == DATA_START_BLOCK) {
-                break;
-            }
-            if (i >= 5000) {
-                fail = true;
-                break;
-            }
-        }
-        if (!fail) {
-            for (int i = 0; i < 64; i++) {
-                status[i] = spiReceive();
-            }
-            spiReceive();
-            spiReceive();
-
-            if ((status[16] & 0x0f) == 1) {
-                _isHighSpeed = true;
-            }
-        }
-    }
-    deselectCard();
+	if (!readRegister(CMD_SEND_CID, buffer, 16)) {
+		return false;
+	}
+	uint32_t serial = ((uint32_t)buffer[9] << 24) | ((uint32_t)buffer[10] << 16) | (buffer[11] << 8) | buffer[12];
 
-	selectCard();
-	reply = command(CMD_SEND_CSD, 0);
-	if (reply != 0) {
-		deselectCard();
-		errno = EIO;
+	if (!readRegister(CMD_SEND_CSD, buffer, 16)) {
 		return false;
 	}
 
-	for (i = 0; ; i++) {
-		reply = spiReceive();
-		if (reply == DATA_START_BLOCK) {
-			break;
-		}
-		if (i >= TIMO_SEND_CSD) {
-			deselectCard();
-			errno = EIO;
+	// Only cards supporting the switch command class (10) know about CMD6.
+	uint16_t ccc = (buffer[4] << 4) | (buffer[5] >> 4);
+	_isHighSpeed = false;
+	if (ccc & (1 << 10)) {
+		_isHighSpeed = switchHighSpeed();
+	}
+
+	// TRAN_SPEED is only updated once the card has switched, so re-read it.
+	if (_isHighSpeed) {
+		if (!readRegister(CMD_SEND_CSD, buffer, 16)) {
 			return false;
 		}
 	}
+	_transSpeed = buffer[3];
+	_maxSpeed = decodeTransSpeed(_transSpeed);
 
-    for (i = 0; i < 16; i++) {
-    	buffer[i] = spiReceive();
-    }
-    
-    spiReceive();
-    spiReceive();
-    deselectCard();
-
-    if (_isHighSpeed) {
-        _transSpeed = buffer[3];
-        _ma = status[0] << 8 | status[1];
-        _group[0] = status[12] << 8 | status[13];
-        _group[1] = status[10] << 8 | status[11];
-        _group[2] = status[8] << 8 | status[9];
-        _group[3] = status[6] << 8 | status[7];
-        _group[4] = status[4] << 8 | status[5];
-        _group[5] = status[2] << 8 | status[3];
-
-    } else {
-        _transSpeed = SD_SPI_SPEED;
-    }
+	// A card we have already calibrated keeps its speed across re-insertion.
+	if ((serial != _cardSerial) || (_speed == 0)) {
+		_cardSerial = serial;
+		_speed = min(SD_SPI_SPEED, _maxSpeed);
+	}
+	_speed = min(_speed, _maxSpeed);
+	_ioErrors = 0;
+
+	// Cards always come out of reset with CRC checking off.
+	if (_crc && !setCRC(true)) {
+		return false;
+	}
 
     setFastSPI();
 
     switch (buffer[0] >> 6) {
     	case 1:
-    		csize = buffer[9] + (buffer[8] << 8) + 1;
+    		csize = buffer[9] + (buffer[8] << 8) + ((uint32_t)(buffer[7] & 0x3F) << 16) + 1;
     		_sectors = csize << 10;
     		break;
     	case 0:
@@ -358,100 +731,332 @@ bool SDCard::insert() {
 
 bool SDCard::eject() {
 	sync();
-	return true;
+	return waitNotBusy();
 }
 
-bool SDCard::readBlockFromDisk(uint32_t block, uint8_t *data) {
-	int reply;
-	int i;
-
+bool SDCard::waitNotBusy() {
+	if (!_busy) {
+		return true;
+	}
 	selectCard();
-	if (_cardType != 3) {
-		block <<= 9;
+	bool ready = waitReady(TIMO_WAIT_WDONE);
+	deselectCard();
+	if (ready) {
+		_busy = false;
 	}
-	reply = command(CMD_READ_MULTIPLE, block);
-	if (reply != 0) {
-		deselectCard();
-		errno = EIO;
+	return ready;
+}
+
+bool SDCard::isBusy() {
+	if (!_busy) {
 		return false;
 	}
+	selectCard();
+	if (spiReceive() == 0xFF) {
+		_busy = false;
+	}
+	deselectCard();
+	return _busy;
+}
+
+uint32_t SDCard::getEraseSize() {
+	// AU_SIZE codes, in 512 byte blocks: not given, 16KB doubling up to
+	// 4MB, then 8, 12, 16, 24, 32 and 64MB.
+	static const uint32_t auBlocks[16] = {
+		1, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+		16384, 24576, 32768, 49152, 65536, 131072
+	};
+
+	if (_eraseSize != 0) {
+		return _eraseSize;
+	}
+
+	uint8_t status[64];
+	selectCard();
+	command(CMD_APP, 0);
+	deselectCard();
+	if (!readRegister(CMD_SD_STATUS, status, 64)) {
+		// Older cards don't have one.
+		_eraseSize = 1;
+		return 1;
+	}
+	_eraseSize = auBlocks[status[10] >> 4];
+	return _eraseSize;
+}
 
-	for (i = 0; ; i++) {
+bool SDCard::receiveDataBlock(uint8_t *data) {
+	int reply;
+	uint32_t start = 0;
+
+	for (int i = 0; ; i++) {
 		reply = spiReceive();
 		if (reply == DATA_START_BLOCK) {
 			break;
 		}
 		if (i >= TIMO_READ) {
-			deselectCard();
 			errno = EIO;
 			return false;
 		}
 	}
 
+	if (_crc) {
+		start = micros();
+	}
+
 	if (_spi != NULL) {
 		_spi->transfer(_blockSize, 0xFF, data);
 	} else {
-		for (i = 0; i < _blockSize; i++) {
-			data[i] = spiReceive();
+		_softSPI->receive(data, _blockSize);
+	}
+	uint16_t crc = spiReceive() << 8;
+	crc |= spiReceive();
+
+	if (_crc) {
+		uint32_t mid = micros();
+		uint16_t check = crc16(data, _blockSize);
+		_readXferMicros += mid - start;
+		_readCrcMicros += micros() - mid;
+		_readCrcBlocks++;
+		if (crc != check) {
+			_crcErrors++;
+			errno = EIO;
+			return false;
+		}
+	}
+	return true;
+}
+
+int SDCard::sendDataBlock(uint8_t token, const uint8_t *data) {
+	uint16_t crc = 0xFFFF;
+	uint32_t start = 0;
+
+	if (_crc) {
+		start = micros();
+		crc = crc16(data, _blockSize);
+		uint32_t mid = micros();
+		_writeCrcMicros += mid - start;
+		_writeCrcBlocks++;
+		start = mid;
+	}
+
+	spiSend(token);
+	if (_spi != NULL) {
+		_spi->transfer(_blockSize, (uint8_t *)data);
+	} else {
+		_softSPI->send(data, _blockSize);
+	}
+	spiSend(crc >> 8);
+	spiSend(crc & 0xFF);
+	if (_crc) {
+		_writeXferMicros += micros() - start;
+	}
+	return spiReceive() & 0x1F;
+}
+
+bool SDCard::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	if (_cardType != 3) {
+		block <<= 9;
+	}
+
+	for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++) {
+		selectCard();
+		if (command(CMD_READ_SINGLE, block) != 0) {
+			deselectCard();
+			ioError();
+			errno = EIO;
+			return false;
+		}
+
+		bool ok = receiveDataBlock(data);
+		deselectCard();
+		if (ok) {
+			_ioErrors = 0;
+			return true;
 		}
+		ioError();
+	}
+	errno = EIO;
+	return false;
+}
+
+bool SDCard::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	if (_cardType != 3) {
+		block <<= 9;
+	}
+
+	for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++) {
+		selectCard();
+		if (command(CMD_WRITE_SINGLE, block) != 0) {
+			deselectCard();
+			ioError();
+			errno = EIO;
+			return false;
+		}
+
+		spiSend(0xFF);
+		int reply = sendDataBlock(DATA_START_BLOCK, data);
+
+		if (reply == DATA_RES_ACCEPTED) {
+			// The data has been accepted. Don't hang around while the card
+			// programs it - the busy state is cleared by the next command,
+			// or by polling isBusy().
+			_busy = true;
+			deselectCard();
+			_ioErrors = 0;
+			return true;
+		}
+
+		deselectCard();
+		ioError();
+		if (reply == DATA_RES_CRC_ERROR) {
+			_crcErrors++;
+			continue;
+		}
+		break;
+	}
+	errno = EIO;
+	return false;
+}
+
+bool SDCard::readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data) {
+	uint32_t done = 0;
+	uint32_t addr = (_cardType != 3) ? (block << 9) : block;
+
+	selectCard();
+	if (command(CMD_READ_MULTIPLE, addr) != 0) {
+		deselectCard();
+		ioError();
+		errno = EIO;
+		return false;
+	}
+
+	while (done < count) {
+		if (!receiveDataBlock(data + (done * _blockSize))) {
+			break;
+		}
+		done++;
 	}
-	spiReceive();
-	spiReceive();
 
 	command(CMD_STOP, 0);
 	deselectCard();
+
+	if (done == count) {
+		_ioErrors = 0;
+		return true;
+	}
+
+	// Something went wrong part way through.  Fetch the rest one at a
+	// time so each block gets its own retries.
+	ioError();
+	for (; done < count; done++) {
+		if (!readBlockFromDisk(block + done, data + (done * _blockSize))) {
+			return false;
+		}
+	}
 	return true;
 }
 
-bool SDCard::writeBlockToDisk(uint32_t block, uint8_t *data) {
-    int reply, i;
+bool SDCard::writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data) {
+	uint32_t addr = (_cardType != 3) ? (block << 9) : block;
 
+	// Let the card know how much to pre-erase.
 	selectCard();
 	command(CMD_APP, 0);
-	reply = command(CMD_SET_WBECNT, 1);
-	if (reply != 0) {
+	if (command(CMD_SET_WBECNT, count) != 0) {
+		deselectCard();
+		ioError();
 		errno = EIO;
 		return false;
 	}
 
-    if (_cardType != 3) block <<= 9;
-    reply = command(CMD_WRITE_MULTIPLE, block);
-    if (reply != 0)
-    {
+	if (command(CMD_WRITE_MULTIPLE, addr) != 0) {
+		deselectCard();
+		ioError();
 		errno = EIO;
 		return false;
-    }
-    deselectCard();
-
-	selectCard();
-	waitReady(TIMO_WAIT_WDATA);
-
-	spiSend(WRITE_MULTIPLE_TOKEN);
+	}
 
-	if (_spi != NULL) {
-		_spi->transfer(_blockSize, data);
-	} else {
-		for (i = 0; i < _blockSize; i++) {
-			spiSend(data[i]);
+	spiSend(0xFF);
+	for (uint32_t i = 0; i < count; i++) {
+		// Each block has to be programmed before the next can be sent.
+		if (!waitReady(TIMO_WAIT_WDONE)) {
+			deselectCard();
+			ioError();
+			return false;
+		}
+		int reply = sendDataBlock(WRITE_MULTIPLE_TOKEN, data + (i * _blockSize));
+		if (reply != DATA_RES_ACCEPTED) {
+			if (reply == DATA_RES_CRC_ERROR) {
+				_crcErrors++;
+			}
+			waitReady(TIMO_WAIT_WDONE);
+			spiSend(STOP_TRAN_TOKEN);
+			_busy = true;
+			deselectCard();
+			ioError();
+			errno = EIO;
+			return false;
 		}
 	}
-	spiSend(0xFF);
-	spiSend(0xFF);
-	reply = spiReceive();
-	if ((reply & 0x1F) != 0x05) {
-		errno = EIO;
+
+	if (!waitReady(TIMO_WAIT_WDONE)) {
+		deselectCard();
+		ioError();
 		return false;
 	}
-	waitReady(TIMO_WAIT_WDONE);
+	spiSend(STOP_TRAN_TOKEN);
+
+	// As with single blocks, leave the card to finish in its own time.
+	_busy = true;
 	deselectCard();
+	_ioErrors = 0;
+	return true;
+}
+
+bool SDCard::setCRC(bool enable) {
 	selectCard();
-	waitReady(TIMO_WAIT_WSTOP);
-	spiSend(STOP_TRAN_TOKEN);
-	waitReady(TIMO_WAIT_WIDLE);
+	int reply = command(CMD_CRC_ON_OFF, enable ? 1 : 0);
 	deselectCard();
+	if (reply != 0) {
+		errno = EIO;
+		return false;
+	}
+	_crc = enable;
 	return true;
 }
 
+void SDCard::printCacheStats() {
+	BlockDevice::printCacheStats();
+	Serial.println();
+	Serial.print("SPI speed: ");
+	Serial.print(_speed);
+	Serial.println(_isHighSpeed ? " Hz (high speed)" : " Hz");
+	Serial.print("CRC: ");
+	Serial.println(_crc ? "on" : "off");
+	Serial.print("CRC errors: ");
+	Serial.println(_crcErrors);
+	if (_readCrcBlocks > 0) {
+		Serial.print("CRC time per block read: ");
+		Serial.print((uint32_t)(_readCrcMicros / _readCrcBlocks));
+		Serial.println("us");
+	}
+	if (_readXferMicros > 0) {
+		Serial.print("CRC cost vs read transfer: ");
+		Serial.print((uint32_t)((_readCrcMicros * 100) / _readXferMicros));
+		Serial.println("%");
+	}
+	if (_writeCrcBlocks > 0) {
+		Serial.print("CRC time per block written: ");
+		Serial.print((uint32_t)(_writeCrcMicros / _writeCrcBlocks));
+		Serial.println("us");
+	}
+	if (_writeXferMicros > 0) {
+		Serial.print("CRC cost vs write transfer: ");
+		Serial.print((uint32_t)((_writeCrcMicros * 100) / _writeXferMicros));
+		Serial.println("%");
+	}
+}
+
 size_t SDCard::getCapacity() {
 	return _sectors;
 }
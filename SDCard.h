@@ -37,12 +37,28 @@
 
 #include <FileSystem.h>
 #include <DSPI.h>
+#include <BitBangSPI.h>
 
-// How fast to run the SPI port
+// How fast to run the SPI port until calibrate() finds the card's real limit
 #ifndef SD_SPI_SPEED
 #define SD_SPI_SPEED 20000000UL
 #endif
 
+// Number of verified reads at each speed step while calibrating
+#ifndef SD_CALIBRATE_PASSES
+#define SD_CALIBRATE_PASSES 4
+#endif
+
+// Retries of a block transfer that failed its CRC check
+#ifndef SD_CRC_RETRIES
+#define SD_CRC_RETRIES 3
+#endif
+
+// Consecutive I/O errors before the SPI clock is stepped down
+#ifndef SD_DOWNSHIFT_ERRORS
+#define SD_DOWNSHIFT_ERRORS 3
+#endif
+
 
 // SD Card Commands
 
@@ -59,11 +75,13 @@
 #define CMD_READ_MULTIPLE       18
 #define CMD_SET_BCOUNT          23      /* (MMC) */
 #define CMD_SET_WBECNT          23      /* ACMD23 (SDC) */
+#define CMD_SD_STATUS           13      /* ACMD13 (SDC) */
 #define CMD_WRITE_SINGLE        24
 #define CMD_WRITE_MULTIPLE      25
 #define CMD_SEND_OP_SDC         41      /* ACMD41 (SDC) */
 #define CMD_APP                 55      /* CMD55 */
 #define CMD_READ_OCR            58
+#define CMD_CRC_ON_OFF          59
 
 // Timeout values
 
@@ -81,6 +99,9 @@
 #define STOP_TRAN_TOKEN         0xFD    /* stop token for write multiple */
 #define WRITE_MULTIPLE_TOKEN    0xFC    /* start data for write multiple */
 
+#define DATA_RES_ACCEPTED       0x05    /* data response: accepted */
+#define DATA_RES_CRC_ERROR      0x0B    /* data response: rejected, bad CRC */
+
 #define TRANS_SPEED_25MHZ   0x32
 #define TRANS_SPEED_50MHZ   0x5a
 #define TRANS_SPEED_100MHZ  0x0b
@@ -89,10 +110,9 @@
 class SDCard : public BlockDevice {
 private:
 	DSPI 		*_spi;
+	BitBangSPI	*_softSPI;
+	PinBitBangSPI _pinSPI;
 	int 		_cs;
-	int 		_miso;
-	int			_mosi;
-	int 		_sck;
 
 	int			_cardType;
 	size_t 		_sectors;
@@ -102,6 +122,25 @@ private:
     uint32_t    _ma;
     uint32_t    _group[6];
 
+    uint32_t    _speed;
+    uint32_t    _maxSpeed;
+    uint32_t    _cardSerial;
+    uint8_t     _ioErrors;
+
+    bool        _crc;
+    uint32_t    _crcErrors;
+    // CRC cost, kept apart for each direction so each can be set against
+    // its own transfer time
+    uint32_t    _readCrcBlocks;
+    uint64_t    _readCrcMicros;
+    uint64_t    _readXferMicros;
+    uint32_t    _writeCrcBlocks;
+    uint64_t    _writeCrcMicros;
+    uint64_t    _writeXferMicros;
+
+    bool        _busy;
+    uint32_t    _eraseSize;
+
 	
 	
 	void 		initializeSPIInterface();
@@ -112,16 +151,30 @@ private:
 	void		deselectCard();
 	void		selectCard();
 
-	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
-	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
-	
 	bool 		waitReady(int limit);
+	bool		waitNotBusy();
+	bool		readRegister(uint8_t cmd, uint8_t *data, int len);
+	bool		switchFunction(uint32_t arg, uint8_t *status);
+	bool		switchHighSpeed();
+	void		ioError();
+	bool		receiveDataBlock(uint8_t *data);
+	int			sendDataBlock(uint8_t token, const uint8_t *data);
+
+	static uint32_t decodeTransSpeed(uint8_t ts);
 	int 		command(uint32_t cmd, uint32_t addr);
 
 
 	
+protected:
+	// Left to BlockDevice's cache, or a CachedBlockDevice wrapped round it
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+	bool		readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data);
+	bool		writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data);
+
 public:
 				SDCard(DSPI &spi, int cs);
+				SDCard(BitBangSPI &spi, int cs);
 				SDCard(int miso, int mosi, int sck, int cs);
 		
 	bool 		initialize();
@@ -129,6 +182,43 @@ public:
 	bool 		insert();
 	
 	size_t 	getCapacity();
+
+	/*! Returns true if the card is still programming the last block
+	 *  written to it.  Never blocks - it just samples the card's data
+	 *  line once and returns.
+	 */
+	bool		isBusy();
+
+	/*! The card's allocation unit (AU) in blocks, from its SD status */
+	uint32_t	getEraseSize();
+
+	/*! Find the fastest SPI clock the card reliably works at.  The clock is
+	 *  stepped up from a safe speed, re-reading the given block and comparing
+	 *  it with a reference copy, until a read fails or differs.  The last good
+	 *  speed is kept for this card (and survives re-insertion of the same card)
+	 *  and returned, or 0 on failure.
+	 */
+	uint32_t	calibrate(uint32_t block = 0);
+
+	/*! Current SPI clock speed for the card.  Repeated I/O errors step it down
+	 *  automatically.
+	 */
+	uint32_t	getSpeed();
+
+	/*! Set the SPI clock speed, limited to what the card supports. */
+	void		setSpeed(uint32_t speed);
+
+	/*! Turn CRC checking (CMD59) on or off.  With it on every data block is
+	 *  checked in both directions and re-transferred, up to SD_CRC_RETRIES
+	 *  times, if it arrives damaged.
+	 */
+	bool		setCRC(bool enable);
+
+	/*! Cache statistics, plus the SPI speed and CRC error and cost counts */
+	void		printCacheStats();
+
+	static uint8_t	crc7(const uint8_t *data, size_t len);
+	static uint16_t	crc16(const uint8_t *data, size_t len);
 };
 
 #endif
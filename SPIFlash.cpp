@@ -119,6 +119,30 @@ bool SPIFlash::readBlockFromDisk(uint32_t block, uint8_t *data) {
 	return true;
 }
 
+bool SPIFlash::readBlockBytes(uint32_t block, uint32_t offset, uint32_t len, uint8_t *data) {
+    if ((offset >= _blockSize) || (len > _blockSize - offset)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // Anything cached may be newer than the flash.
+    if (isCached(block)) {
+        return BlockDevice::readBlockBytes(block, offset, len, data);
+    }
+
+    uint32_t startAddress = block * _blockSize + offset;
+    switchOnActivityLED();
+    selectChip();
+    _spi->transfer(0x03);
+    _spi->transfer((startAddress >> 16) & 0xFF);
+    _spi->transfer((startAddress >> 8) & 0xFF);
+    _spi->transfer(startAddress & 0xFF);
+    _spi->transfer(len, 0xFF, data);
+    deselectChip();
+    switchOffActivityLED();
+    return true;
+}
+
 bool SPIFlash::writeBlockToDisk(uint32_t block, uint8_t *data) {
     uint32_t startAddress = block * _blockSize;
 
@@ -164,7 +188,7 @@ void SPIFlash::waitReady() {
     while (status & 0x80) {
         selectChip();
         _spi->transfer(0x05);
-        uint8_t status = _spi->transfer(0xFF);
+        status = _spi->transfer(0xFF);
         deselectChip();
     }
 }
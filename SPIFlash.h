@@ -52,13 +52,15 @@ private:
 	void		deselectChip();
 	void		selectChip();
 
-	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
-	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
-	
 	int 		command(uint32_t cmd, uint32_t addr);
 
     void        waitReady();
 	
+protected:
+	// Left to BlockDevice's cache, or a CachedBlockDevice wrapped round it
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+
 public:
 				SPIFlash(DSPI &spi, int cs);
 		
@@ -67,6 +69,8 @@ public:
 	bool 		insert();
 	
 	size_t 	getCapacity() { return _sectors; }
+
+	bool		readBlockBytes(uint32_t blockno, uint32_t offset, uint32_t len, uint8_t *data);
 };
 
 #endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <FileSystem.h>
+
+StripedDevice::StripedDevice(BlockDevice **members, uint8_t count, uint32_t stripeSize) {
+	_members = members;
+	_count = count;
+	_stripeSize = stripeSize > 0 ? stripeSize : 1;
+	_sectors = 0;
+}
+
+bool StripedDevice::initialize() {
+	// Leaving members out would change where every block lives.
+	if (_count > STRIPE_MAX_MEMBERS) {
+		errno = EINVAL;
+		return false;
+	}
+	for (int i = 0; i < _count; i++) {
+		if (!_members[i]->initialize()) {
+			return false;
+		}
+	}
+	return configure();
+}
+
+bool StripedDevice::insert() {
+	if (_count > STRIPE_MAX_MEMBERS) {
+		errno = EINVAL;
+		return false;
+	}
+	for (int i = 0; i < _count; i++) {
+		if (!_members[i]->insert()) {
+			return false;
+		}
+	}
+	return configure();
+}
+
+bool StripedDevice::eject() {
+	sync();
+	bool ok = true;
+	for (int i = 0; i < _count; i++) {
+		if (!_members[i]->eject()) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool StripedDevice::configure() {
+	if (_count == 0) {
+		errno = ENODEV;
+		return false;
+	}
+
+	_blockSize = _members[0]->getSectorSize();
+	size_t smallest = _members[0]->getCapacity();
+	for (int i = 1; i < _count; i++) {
+		if (_members[i]->getSectorSize() != _blockSize) {
+			errno = EINVAL;
+			return false;
+		}
+		smallest = min(smallest, _members[i]->getCapacity());
+	}
+
+	// Only whole stripes are usable.
+	_sectors = (smallest / _stripeSize) * _stripeSize * _count;
+
+	initCacheBlocks();
+
+	// An unpartitioned set is fine - it can still be used whole.
+	if (!loadPartitionTable() && (errno == EIO)) {
+		return false;
+	}
+	errno = 0;
+	return true;
+}
+
+// Map a logical block to its member and the block within that member.
+// Also returns how many blocks remain in that stripe from that point.
+uint8_t StripedDevice::locate(uint32_t block, uint32_t *memberBlock, uint32_t *run) {
+	uint32_t stripe = block / _stripeSize;
+	uint32_t offset = block % _stripeSize;
+	*memberBlock = (stripe / _count) * _stripeSize + offset;
+	*run = _stripeSize - offset;
+	return stripe % _count;
+}
+
+bool StripedDevice::readBlockFromDisk(uint32_t block, uint8_t *data) {
+	return readBlocksFromDisk(block, 1, data);
+}
+
+bool StripedDevice::writeBlockToDisk(uint32_t block, uint8_t *data) {
+	return writeBlocksToDisk(block, 1, data);
+}
+
+bool StripedDevice::readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data) {
+	if (block + count > _sectors) {
+		errno = EINVAL;
+		return false;
+	}
+
+	while (count > 0) {
+		uint32_t memberBlock;
+		uint32_t run;
+		uint8_t member = locate(block, &memberBlock, &run);
+		run = min(run, count);
+
+		if (!_members[member]->readBlocks(memberBlock, run, data)) {
+			return false;
+		}
+
+		block += run;
+		count -= run;
+		data += run * _blockSize;
+	}
+	return true;
+}
+
+bool StripedDevice::writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data) {
+	if (block + count > _sectors) {
+		errno = EINVAL;
+		return false;
+	}
+
+	// Work through the request one row of stripes (one per member) at a time.
+	// Members that report themselves busy finishing their last chunk are left
+	// until last in the row, so the others are fed while they program.
+	while (count > 0) {
+		uint32_t rowStart[STRIPE_MAX_MEMBERS];
+		uint32_t rowCount[STRIPE_MAX_MEMBERS];
+		const uint8_t *rowData[STRIPE_MAX_MEMBERS];
+		uint8_t rowMember[STRIPE_MAX_MEMBERS];
+		uint8_t chunks = 0;
+
+		while ((count > 0) && (chunks < _count)) {
+			uint32_t run;
+			rowMember[chunks] = locate(block, &rowStart[chunks], &run);
+			rowCount[chunks] = min(run, count);
+			rowData[chunks] = data;
+
+			block += rowCount[chunks];
+			count -= rowCount[chunks];
+			data += rowCount[chunks] * _blockSize;
+			chunks++;
+		}
+
+		uint32_t pending = (1UL << chunks) - 1;
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < chunks; i++) {
+				if (!(pending & (1UL << i))) {
+					continue;
+				}
+				if ((pass == 0) && _members[rowMember[i]]->isBusy()) {
+					continue;
+				}
+				if (!_members[rowMember[i]]->writeBlocks(rowStart[i], rowCount[i], rowData[i])) {
+					return false;
+				}
+				pending &= ~(1UL << i);
+			}
+		}
+	}
+	return true;
+}
+
+bool StripedDevice::isBusy() {
+	for (int i = 0; i < _count; i++) {
+		if (_members[i]->isBusy()) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015, Majenko Technologies
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice, this
+ *   list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ * 
+ * * Neither the name of Majenko Technologies nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! The StripedDevice class implements the BlockDevice interface on top of
+ *  a set of other block devices, striping the logical blocks across them
+ *  (RAID-0).  Consecutive runs of `stripeSize` blocks go to consecutive
+ *  members, so a large transfer keeps every member busy at once.
+ *
+ *  The members are used through their uncached multi-block interface; the
+ *  striped device does the caching itself.  All members must have the same
+ *  sector size, and the capacity is limited by the smallest member.
+ *
+ *      SDCard card0(spi0, 10);
+ *      SDCard card1(spi1, 11);
+ *      BlockDevice *cards[] = { &card0, &card1 };
+ *      StripedDevice stripe(cards, 2, 64);
+ *      Fat fs(stripe, 0);
+ */
+
+#ifndef _STRIPEDDEVICE_H
+#define _STRIPEDDEVICE_H
+
+#include <FileSystem.h>
+
+/*! Maximum number of member devices in a stripe set.  A set with more
+ *  fails to initialize with EINVAL.
+ */
+#define STRIPE_MAX_MEMBERS 8
+
+class StripedDevice : public BlockDevice {
+private:
+	BlockDevice	**_members;
+	uint8_t		_count;
+	uint32_t	_stripeSize;
+	size_t		_sectors;
+
+	bool		configure();
+	uint8_t		locate(uint32_t block, uint32_t *memberBlock, uint32_t *run);
+
+protected:
+	// Left to BlockDevice's cache, or a CachedBlockDevice wrapped round it
+	bool		readBlockFromDisk(uint32_t blockno, uint8_t *data);
+	bool		writeBlockToDisk(uint32_t blockno, uint8_t *data);
+	bool		readBlocksFromDisk(uint32_t block, uint32_t count, uint8_t *data);
+	bool		writeBlocksToDisk(uint32_t block, uint32_t count, const uint8_t *data);
+
+public:
+				StripedDevice(BlockDevice **members, uint8_t count, uint32_t stripeSize);
+
+	bool		initialize();
+	bool		eject();
+	bool		insert();
+
+	size_t		getCapacity() { return _sectors; }
+	bool		isBusy();
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Software SPI on mocked ports: the bit-bang engine against the
+ * shiftIn()/shiftOut() path SDCard used before it, moving 512 byte blocks.
+ * The stub ports are plain memory, so what's timed is the work done around
+ * each register access.  A loopback port checks the engine clocks the
+ * right bits first.
+ */
+
+#include "test.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define UNIT "TSC ticks"
+static inline uint64_t ticks() { return __rdtsc(); }
+#else
+# define UNIT "ns"
+static inline uint64_t ticks() { return micros() * 1000ULL; }
+#endif
+
+#define MISO	16
+#define MOSI	17
+#define SCK		18
+#define BLOCKS	200
+#define PASSES	5
+
+/*! MISO wired back to MOSI, and the bits going out on MOSI collected on
+ *  each rising clock edge.
+ */
+class LoopPins {
+public:
+	bool level;
+	uint8_t shift;
+	int bits;
+	uint8_t sent[16];
+	int count;
+
+	void begin() { level = true; bits = 0; count = 0; }
+	bool miso() { return level; }
+	void mosiHigh() { level = true; }
+	void mosiLow() { level = false; }
+	void sckHigh() {
+		shift = (shift << 1) | level;
+		if (++bits == 8) {
+			sent[count++ % 16] = shift;
+			bits = 0;
+		}
+	}
+	void sckLow() {}
+};
+
+class LoopSPI : public BitBangSPIEngine<LoopPins> {
+public:
+	LoopPins &pins() { return _pins; }
+};
+
+/*! StaticBitBangPins with the stub ports: each register's address is a
+ *  link-time constant, as it is on the board.
+ */
+template <int PORT, uint32_t MISO_MASK, uint32_t MOSI_MASK, uint32_t SCK_MASK>
+class StubStaticPins {
+public:
+	void begin() {
+		stub_ioports[PORT].tris.set = MISO_MASK;
+		stub_ioports[PORT].tris.clr = MOSI_MASK | SCK_MASK;
+		mosiHigh();
+		sckLow();
+	}
+	inline bool miso() { return (stub_ioports[PORT].port.reg & MISO_MASK) != 0; }
+	inline void mosiHigh() { stub_ioports[PORT].lat.set = MOSI_MASK; }
+	inline void mosiLow() { stub_ioports[PORT].lat.clr = MOSI_MASK; }
+	inline void sckHigh() { stub_ioports[PORT].lat.set = SCK_MASK; }
+	inline void sckLow() { stub_ioports[PORT].lat.clr = SCK_MASK; }
+};
+
+typedef BitBangSPIEngine<StubStaticPins<digitalPinToPort(MISO), digitalPinToBitMask(MISO),
+	digitalPinToBitMask(MOSI), digitalPinToBitMask(SCK)> > StaticSPI;
+
+static uint8_t block[512];
+
+// The software SPI in SDCard before the engine, a byte at a time.
+static void legacyReceive(uint8_t *data, size_t len) {
+	while (len--) {
+		digitalWrite(MOSI, HIGH);
+		digitalWrite(MISO, HIGH);
+		*data++ = shiftIn(MISO, SCK, MSBFIRST);
+	}
+}
+
+static void legacySend(const uint8_t *data, size_t len) {
+	while (len--) {
+		digitalWrite(MOSI, HIGH);
+		shiftOut(MOSI, SCK, MSBFIRST, *data++);
+	}
+}
+
+static uint64_t shiftRecv = ~0ULL;
+static uint64_t shiftSend = ~0ULL;
+
+static void report(const char *label, uint64_t recv, uint64_t send) {
+	double bytes = BLOCKS * 512.0;
+	printf("  %-18s %7.1f %5.1fx %7.1f %5.1fx\n", label,
+		recv / bytes, (double)shiftRecv / recv, send / bytes, (double)shiftSend / send);
+}
+
+static void timeEngine(BitBangSPI &spi, uint64_t *recv, uint64_t *send) {
+	spi.begin();
+	spi.setSlow(false);
+	*recv = *send = ~0ULL;
+	for (int pass = 0; pass < PASSES; pass++) {
+		uint64_t start = ticks();
+		for (int i = 0; i < BLOCKS; i++) {
+			spi.receive(block, sizeof(block));
+		}
+		*recv = min(*recv, ticks() - start);
+		start = ticks();
+		for (int i = 0; i < BLOCKS; i++) {
+			spi.send(block, sizeof(block));
+		}
+		*send = min(*send, ticks() - start);
+	}
+}
+
+int main() {
+	// Bits go out MSB first, and what comes back on MISO is read in the
+	// same order.
+	LoopSPI loop;
+	loop.begin();
+	loop.setSlow(false);
+	for (int i = 0; i < 256; i++) {
+		CHECK(loop.transfer(i) == i);
+	}
+	const uint8_t out[7] = { 0x01, 0x80, 0x5A, 0xA5, 0xFF, 0x00, 0x3C };
+	loop.pins().begin();
+	loop.send(out, sizeof(out));
+	CHECK(loop.pins().count == sizeof(out));
+	CHECK(memcmp(loop.pins().sent, out, sizeof(out)) == 0);
+	uint8_t in[5];
+	loop.receive(in, sizeof(in));
+	for (int i = 0; i < 5; i++) {
+		CHECK(in[i] == 0xFF);
+	}
+	loop.setSlow(true);
+	CHECK(loop.transfer(0x81) == 0x81);
+
+	// The same clocking on the stub ports: a pattern on MISO comes back.
+	stub_ioports[digitalPinToPort(MISO)].port.reg = digitalPinToBitMask(MISO);
+	PinBitBangSPI pin(MISO, MOSI, SCK);
+	pin.begin();
+	pin.setSlow(false);
+	CHECK(pin.transfer(0x00) == 0xFF);
+	legacyReceive(block, 1);
+	CHECK(block[0] == 0xFF);
+
+	for (int pass = 0; pass < PASSES; pass++) {
+		uint64_t start = ticks();
+		for (int i = 0; i < BLOCKS; i++) {
+			legacyReceive(block, sizeof(block));
+		}
+		shiftRecv = min(shiftRecv, ticks() - start);
+		start = ticks();
+		for (int i = 0; i < BLOCKS; i++) {
+			legacySend(block, sizeof(block));
+		}
+		shiftSend = min(shiftSend, ticks() - start);
+	}
+
+	uint64_t pinRecv, pinSend;
+	timeEngine(pin, &pinRecv, &pinSend);
+	StaticSPI fixed;
+	uint64_t fixedRecv, fixedSend;
+	timeEngine(fixed, &fixedRecv, &fixedSend);
+
+	printf("bitbang: %s per byte over %d 512 byte blocks\n", UNIT, BLOCKS);
+	printf("  %-18s %14s %14s\n", "", "receive", "send");
+	report("shiftIn/shiftOut", shiftRecv, shiftSend);
+	report("PinBitBangSPI", pinRecv, pinSend);
+	report("static pins", fixedRecv, fixedSend);
+
+	return testResult("bench_bitbang");
+}
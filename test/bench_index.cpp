@@ -0,0 +1,121 @@
+/*
+ * Opening files in one big directory, with and without the sorted index
+ * from Fat::indexDirectory().  1000 opens of random names that are there
+ * and 1000 lookups of names that aren't, on a FAT32 volume with 4K
+ * clusters, counting the blocks read from the device and the time taken.
+ */
+
+#include "test.h"
+
+static struct fat_index names[60000];
+
+// Lay out a root directory of empty files F0000000.DAT, F0000001.DAT ...
+// straight onto a freshly formatted volume.  Making them through the
+// library would scan the directory for a free entry for every file, and
+// it's lookups being measured here, not creating.
+static void fillRoot(FileDevice &dev, uint32_t files) {
+	uint8_t block[512];
+	struct bootblock *bb = (struct bootblock *)block;
+	CHECK(dev.readBlock(0, block));
+	uint32_t spc = bb->sectors_per_cluster;
+	uint32_t fatStart = bb->reserved_sectors;
+	uint32_t spf = bb->sectors_per_fat_32;
+	uint32_t fats = bb->fat_copies;
+	uint32_t dataStart = fatStart + fats * spf;
+
+	// The root starts at cluster 2 and carries on through the clusters
+	// after it, with room left for an empty entry at the end.
+	uint32_t clusters = (files / (spc * 512 / 32)) + 1;
+	uint32_t last = 2 + clusters - 1;
+	for (uint32_t s = 0; s <= last / 128; s++) {
+		CHECK(dev.readBlock(fatStart + s, block));
+		uint32_t *e = (uint32_t *)block;
+		for (uint32_t i = 0; i < 128; i++) {
+			uint32_t c = s * 128 + i;
+			if ((c >= 2) && (c <= last)) {
+				e[i] = (c == last) ? 0x0FFFFFFFUL : c + 1;
+			}
+		}
+		for (uint32_t f = 0; f < fats; f++) {
+			CHECK(dev.writeBlock(fatStart + f * spf + s, block));
+		}
+	}
+
+	struct fat_dirent *d = (struct fat_dirent *)block;
+	for (uint32_t i = 0; i < clusters * spc * 16; i++) {
+		if ((i % 16) == 0) {
+			memset(block, 0, 512);
+		}
+		if (i < files) {
+			char name[9];
+			sprintf(name, "F%07lu", (unsigned long)i);
+			memcpy(d[i % 16].filename, name, 8);
+			memcpy(d[i % 16].extension, "DAT", 3);
+			d[i % 16].attribs = ATTR_ARCHIVE;
+		}
+		if ((i % 16) == 15) {
+			CHECK(dev.writeBlock(dataStart + (i / 16), block));
+		}
+	}
+	dev.sync();
+}
+
+static void lookups(Fat &fs, FileDevice &dev, uint32_t files, const char *label) {
+	char path[32];
+	int wrong = 0;
+	srand(1);
+
+	uint32_t reads = dev.reads;
+	unsigned long start = micros();
+	for (int i = 0; i < 1000; i++) {
+		sprintf(path, "/F%07lu.DAT", (unsigned long)(rand() % files));
+		File f = fs.open(path, FILE_READ);
+		if (!f) {
+			wrong++;
+		}
+	}
+	unsigned long hitMicros = micros() - start;
+	uint32_t hitReads = dev.reads - reads;
+
+	reads = dev.reads;
+	start = micros();
+	for (int i = 0; i < 1000; i++) {
+		sprintf(path, "/X%07lu.DAT", (unsigned long)(rand() % files));
+		errno = 0;
+		fs.getInode(path);
+		if (errno != ENOENT) {
+			wrong++;
+		}
+	}
+	unsigned long missMicros = micros() - start;
+	uint32_t missReads = dev.reads - reads;
+
+	printf("  %-6s %10.1f %8.1f %14.1f %8.1f\n", label,
+		hitReads / 1000.0, hitMicros / 1000.0, missReads / 1000.0, missMicros / 1000.0);
+	CHECK(wrong == 0);
+}
+
+int main() {
+	static const uint32_t sizes[] = { 1000, 10000, 50000 };
+
+	printf("index: 1000 opens and 1000 misses, FAT32 with 4K clusters\n");
+	printf("  entries     reads/open  us/open    reads/miss  us/miss\n");
+	for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		FileDevice dev(1024UL * 1024 * 2);
+		Fat fs(dev);
+		CHECK(fs.format(8));
+		fillRoot(dev, sizes[i]);
+		CHECK(fs.begin());
+
+		printf("  %lu\n", (unsigned long)sizes[i]);
+		lookups(fs, dev, sizes[i], "scan");
+
+		uint32_t reads = dev.reads;
+		unsigned long start = micros();
+		CHECK(fs.indexDirectory("/", names, sizeof(names)));
+		printf("  build  %10lu reads %5lu us\n", (unsigned long)(dev.reads - reads), (unsigned long)(micros() - start));
+		lookups(fs, dev, sizes[i], "index");
+	}
+
+	return testResult("bench_index");
+}
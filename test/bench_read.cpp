@@ -0,0 +1,134 @@
+/*
+ * The cost of reading a file, per byte through File::read() and per block
+ * through readBytes(), and of following a cluster chain, on a RAM disk so
+ * that only the filesystem's own work is timed.
+ */
+
+#include "test.h"
+
+#define SECTORS		81920
+#define FILE_BYTES	(2UL * 1024 * 1024)
+#define PASSES		5
+
+static uint8_t disk[SECTORS * 512];
+static uint8_t chunk[512];
+
+// Put DATA.BIN, FILE_BYTES long, in the root of a freshly formatted
+// volume by writing its FAT chain, directory entry and data straight to
+// the disk.  Only reading is measured, so this doesn't lean on the write
+// path, and the benchmark can be built against older trees that didn't
+// have one.  Returns the FAT type.
+static uint8_t layout(RamDisk &ram) {
+	uint8_t block[512];
+	struct bootblock *bb = (struct bootblock *)block;
+	ram.readBlock(0, block);
+	uint8_t type = (strncmp(bb->fstype_16, "FAT16", 5) == 0) ? 16 : 32;
+	uint32_t spc = bb->sectors_per_cluster;
+	uint32_t fatStart = bb->reserved_sectors;
+	uint32_t fats = bb->fat_copies;
+	uint32_t spf = (type == 16) ? bb->sectors_per_fat : bb->sectors_per_fat_32;
+	uint32_t rootSectors = (bb->root_entries * 32 + 511) / 512;
+	uint32_t root = fatStart + fats * spf;
+	uint32_t dataStart = root + rootSectors;
+
+	// The FAT32 root has cluster 2, so the file starts after it.
+	uint32_t first = (type == 16) ? 2 : 3;
+	uint32_t last = first + (FILE_BYTES / (spc * 512)) - 1;
+	uint32_t perSector = (type == 16) ? 256 : 128;
+	for (uint32_t s = first / perSector; s <= last / perSector; s++) {
+		ram.readBlock(fatStart + s, block);
+		for (uint32_t i = 0; i < perSector; i++) {
+			uint32_t c = s * perSector + i;
+			if ((c < first) || (c > last)) {
+				continue;
+			}
+			if (type == 16) {
+				((uint16_t *)block)[i] = (c == last) ? 0xFFFF : c + 1;
+			} else {
+				((uint32_t *)block)[i] = (c == last) ? 0x0FFFFFFFUL : c + 1;
+			}
+		}
+		for (uint32_t f = 0; f < fats; f++) {
+			ram.writeBlock(fatStart + f * spf + s, block);
+		}
+	}
+
+	memset(block, 0, 512);
+	struct fat_dirent *d = (struct fat_dirent *)block;
+	memcpy(d->filename, "DATA    ", 8);
+	memcpy(d->extension, "BIN", 3);
+	d->attribs = ATTR_ARCHIVE;
+	d->cluster_low = first & 0xFFFF;
+	d->cluster_high = first >> 16;
+	d->size = FILE_BYTES;
+	ram.writeBlock((type == 16) ? root : dataStart, block);
+
+	for (uint32_t b = 0; b < FILE_BYTES / 512; b++) {
+		for (uint32_t j = 0; j < 512; j++) {
+			block[j] = b + j;
+		}
+		ram.writeBlock(dataStart + ((first - 2) * spc) + b, block);
+	}
+	ram.sync();
+	return type;
+}
+
+static void run(uint8_t sectorsPerCluster) {
+	RamDisk ram(disk, SECTORS);
+	Fat fs(ram);
+	CHECK(fs.format(sectorsPerCluster));
+	uint8_t type = layout(ram);
+	CHECK(fs.begin());
+
+	// Best of a few passes, to keep other things the host is doing out of it.
+	unsigned long byteMicros = 0xFFFFFFFFUL;
+	unsigned long blockMicros = 0xFFFFFFFFUL;
+	unsigned long chainMicros = 0xFFFFFFFFUL;
+	uint32_t first = fs.getInode("/DATA.BIN");
+	uint32_t links = 0;
+	for (int pass = 0; pass < PASSES; pass++) {
+		File f = fs.open("/DATA.BIN");
+		uint32_t sum = 0;
+		unsigned long start = micros();
+		for (uint32_t i = 0; i < FILE_BYTES; i++) {
+			sum += f.read();
+		}
+		byteMicros = min(byteMicros, micros() - start);
+		CHECK(f.read() == -1);
+
+		File g = fs.open("/DATA.BIN");
+		uint32_t blockSum = 0;
+		start = micros();
+		for (uint32_t i = 0; i < FILE_BYTES; i += sizeof(chunk)) {
+			CHECK(g.readBytes((char *)chunk, sizeof(chunk)) == sizeof(chunk));
+			for (uint32_t j = 0; j < sizeof(chunk); j++) {
+				blockSum += chunk[j];
+			}
+		}
+		blockMicros = min(blockMicros, micros() - start);
+		CHECK(sum == blockSum);
+
+		links = 0;
+		start = micros();
+		for (int i = 0; i < 100; i++) {
+			for (uint32_t c = first; !fs.isEndOfChain(c); c = fs.getNextInode(c)) {
+				links++;
+			}
+		}
+		chainMicros = min(chainMicros, micros() - start);
+	}
+
+	printf("  FAT%u, %4lu byte clusters %8.1f %8.2f %8.1f\n", type, sectorsPerCluster * 512UL,
+		byteMicros * 1000.0 / FILE_BYTES,
+		blockMicros * 1000.0 / FILE_BYTES,
+		chainMicros * 1000.0 / links);
+}
+
+int main() {
+	printf("read: a 2MB file on a 40MB RAM disk, ns per byte or per link\n");
+	printf("  %-27s %8s %8s %8s\n", "", "read()", "512s", "chain");
+	run(8);
+	run(1);
+
+	return testResult("bench_read");
+}
@@ -0,0 +1,74 @@
+#include <Arduino.h>
+#include <sys/time.h>
+
+p32_ioport stub_ioports[8];
+HardwareSerial Serial;
+
+unsigned long millis() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+unsigned long micros() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+void delay(unsigned long ms) {}
+void delayMicroseconds(unsigned int us) {}
+// Pin access goes through the stub ports, the way the core's does through
+// the real ones, so code using it can be timed against register-level code.
+// The core's digitalWrite() also checks for PWM and pin validity; these
+// don't, so they are a best case for it.
+void pinMode(uint8_t pin, uint8_t mode) {
+	volatile p32_ioport *port = portRegisters(digitalPinToPort(pin));
+	if (mode == OUTPUT) {
+		port->tris.clr = digitalPinToBitMask(pin);
+	} else {
+		port->tris.set = digitalPinToBitMask(pin);
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+	volatile p32_ioport *port = portRegisters(digitalPinToPort(pin));
+	if (val == LOW) {
+		port->lat.clr = digitalPinToBitMask(pin);
+	} else {
+		port->lat.set = digitalPinToBitMask(pin);
+	}
+}
+
+int digitalRead(uint8_t pin) {
+	volatile p32_ioport *port = portRegisters(digitalPinToPort(pin));
+	return (port->port.reg & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+extern "C" {
+uint8_t shiftIn(uint8_t data, uint8_t clock, uint8_t order) {
+	uint8_t value = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		digitalWrite(clock, HIGH);
+		if (order == LSBFIRST) {
+			value |= digitalRead(data) << i;
+		} else {
+			value |= digitalRead(data) << (7 - i);
+		}
+		digitalWrite(clock, LOW);
+	}
+	return value;
+}
+
+void shiftOut(uint8_t data, uint8_t clock, uint8_t order, uint8_t val) {
+	for (uint8_t i = 0; i < 8; i++) {
+		if (order == LSBFIRST) {
+			digitalWrite(data, !!(val & (1 << i)));
+		} else {
+			digitalWrite(data, !!(val & (1 << (7 - i))));
+		}
+		digitalWrite(clock, HIGH);
+		digitalWrite(clock, LOW);
+	}
+}
+}
@@ -0,0 +1,114 @@
+/*
+ * Just enough of the Arduino core to build the library on a desktop for
+ * the host tests.  Port registers are plain memory.
+ */
+
+#ifndef _ARDUINO_H
+#define _ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define RAMEND 131071
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define NOT_A_PIN 0
+
+#ifndef min
+# define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+# define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+extern "C" {
+uint8_t shiftIn(uint8_t data, uint8_t clock, uint8_t order);
+void shiftOut(uint8_t data, uint8_t clock, uint8_t order, uint8_t val);
+}
+
+// PIC32 style port registers: pin p is bit p % 16 of port p / 16 + 1.
+typedef struct {
+	volatile uint32_t reg, clr, set, inv;
+} p32_regset;
+
+typedef struct {
+	p32_regset tris, port, lat, odc;
+} p32_ioport;
+
+extern p32_ioport stub_ioports[8];
+
+#define digitalPinToPort(p) ((p) / 16 + 1)
+#define digitalPinToBitMask(p) (1UL << ((p) % 16))
+#define portRegisters(P) ((volatile p32_ioport *)&stub_ioports[P])
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t len) {
+		size_t n = 0;
+		while (len--) {
+			n += write(*buf++);
+		}
+		return n;
+	}
+	size_t print(const char *s) { return printf("%s", s); }
+	size_t print(long v) { return printf("%ld", v); }
+	size_t print(unsigned long v) { return printf("%lu", v); }
+	size_t print(int v) { return printf("%d", v); }
+	size_t print(unsigned int v) { return printf("%u", v); }
+	size_t print(double v, int digits = 2) { return printf("%.*f", digits, v); }
+	size_t println() { return printf("\n"); }
+	template <class T> size_t println(T v) { return print(v) + println(); }
+	size_t println(double v, int digits) { return print(v, digits) + println(); }
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() = 0;
+	virtual size_t readBytes(char *buf, size_t len) {
+		size_t i;
+		for (i = 0; i < len; i++) {
+			int c = read();
+			if (c < 0) {
+				break;
+			}
+			buf[i] = c;
+		}
+		return i;
+	}
+};
+
+class HardwareSerial : public Stream {
+public:
+	size_t write(uint8_t c) { return putchar(c) == c; }
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	void flush() {}
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * A DSPI that isn't connected to anything, for the host tests.
+ */
+
+#ifndef _DSPI_H
+#define _DSPI_H
+
+#include <Arduino.h>
+
+class DSPI {
+public:
+	virtual ~DSPI() {}
+	virtual bool begin() { return true; }
+	virtual uint32_t setSpeed(uint32_t speed) { return speed; }
+	virtual uint8_t transfer(uint8_t b) { return 0xFF; }
+	virtual void transfer(uint16_t n, uint8_t *snd, uint8_t *rcv) {
+		for (uint16_t i = 0; i < n; i++) {
+			rcv[i] = transfer(snd[i]);
+		}
+	}
+	virtual void transfer(uint16_t n, uint8_t *snd) {
+		for (uint16_t i = 0; i < n; i++) {
+			transfer(snd[i]);
+		}
+	}
+	virtual void transfer(uint16_t n, uint8_t pad, uint8_t *rcv) {
+		for (uint16_t i = 0; i < n; i++) {
+			rcv[i] = transfer(pad);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Minimal checking for the host tests.  Each test is its own program;
+ * CHECK() reports a failure and carries on, and the program's exit status
+ * says whether anything failed.
+ */
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <FileSystem.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s (errno %d)\n", __FILE__, __LINE__, #cond, errno); \
+		testFailures++; \
+	} \
+} while (0)
+
+#define CHECK_ERRNO(cond, err) do { \
+	errno = 0; \
+	bool _ok = (cond); \
+	CHECK(!_ok && (errno == (err))); \
+} while (0)
+
+static inline int testResult(const char *name) {
+	printf("%s: %s\n", name, testFailures ? "FAILED" : "ok");
+	return testFailures ? 1 : 0;
+}
+
+/*! A block device backed by a temporary file, counting the blocks that go
+ *  each way.
+ */
+class FileDevice : public BlockDevice {
+private:
+	FILE		*_fp;
+	size_t		_sectors;
+
+protected:
+	bool readBlockFromDisk(uint32_t block, uint8_t *data) {
+		if (block >= _sectors) {
+			errno = EINVAL;
+			return false;
+		}
+		reads++;
+		fseeko(_fp, (off_t)block * _blockSize, SEEK_SET);
+		return fread(data, _blockSize, 1, _fp) == 1;
+	}
+
+	bool writeBlockToDisk(uint32_t block, uint8_t *data) {
+		if (block >= _sectors) {
+			errno = EINVAL;
+			return false;
+		}
+		writes++;
+		fseeko(_fp, (off_t)block * _blockSize, SEEK_SET);
+		return fwrite(data, _blockSize, 1, _fp) == 1;
+	}
+
+public:
+	uint32_t	reads;
+	uint32_t	writes;
+
+	FileDevice(size_t sectors, size_t sectorSize = 512) {
+		_fp = tmpfile();
+		_sectors = sectors;
+		_blockSize = sectorSize;
+		reads = 0;
+		writes = 0;
+		// Only the last block is written; the rest reads back as zeros
+		// without taking up any space.
+		uint8_t blank[sectorSize];
+		memset(blank, 0, sectorSize);
+		fseeko(_fp, (off_t)(sectors - 1) * sectorSize, SEEK_SET);
+		fwrite(blank, sectorSize, 1, _fp);
+	}
+
+	virtual ~FileDevice() {
+		fclose(_fp);
+	}
+
+	bool initialize() {
+		initCacheBlocks();
+		loadPartitionTable();
+		errno = 0;
+		return true;
+	}
+	bool eject() { sync(); return true; }
+	bool insert() { return initialize(); }
+	size_t getCapacity() { return _sectors; }
+};
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copying and assigning Files: the open file table slot is shared and let
+ * go exactly once, even when a File is assigned to itself.
+ */
+
+#include "test.h"
+
+static uint8_t disk[8192 * 512];
+
+int main() {
+	RamDisk ram(disk, 8192);
+	Fat fs(ram);
+	CHECK(fs.format());
+	CHECK(fs.begin());
+
+	{
+		File f = fs.open("/self.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f);
+		File &same = f;
+		f = same;
+		CHECK(f);
+		CHECK(f.write((const uint8_t *)"still open", 10) == 10);
+
+		File g = f;
+		g = f;
+		CHECK(g);
+		CHECK(g.write((const uint8_t *)"!", 1) == 1);
+	}
+
+	// Every slot in the open file table is free again.
+	File files[FS_MAX_OPEN_FILES];
+	for (int i = 0; i < FS_MAX_OPEN_FILES; i++) {
+		char name[16];
+		sprintf(name, "/file%d.txt", i);
+		files[i] = fs.open(name, FILE_WRITE | FILE_CREATE);
+		CHECK(files[i]);
+	}
+
+	File f = fs.open("/self.txt", FILE_READ);
+	CHECK(!f);
+	files[0].close();
+	f = fs.open("/self.txt", FILE_READ);
+	CHECK(f);
+	CHECK(f.length() == 11);
+
+	return testResult("assign");
+}
@@ -0,0 +1,74 @@
+/*
+ * CachedBlockDevice round the drivers in the tree, and a FAT volume on a
+ * cached file-backed device.
+ */
+
+#include "test.h"
+
+// Every driver the template is meant for has to build with it, even where
+// there's no hardware here to talk to.
+static DSPI spi;
+static CachedBlockDevice<SDCard, 512, 4, 2> sd(spi, 10);
+static CachedBlockDevice<SPIFlash, 4096, 2, 1> flash(spi, 9);
+
+static void testCache() {
+	CachedBlockDevice<FileDevice, 512, 2, 1> dev(64);
+	CHECK(dev.initialize());
+
+	uint8_t data[512];
+	memset(data, 0x5A, sizeof(data));
+	CHECK(dev.writeBlock(3, data));
+	uint32_t reads = dev.reads;
+	memset(data, 0, sizeof(data));
+	CHECK(dev.readBlock(3, data));
+	CHECK(data[100] == 0x5A);
+	CHECK(dev.reads == reads);
+	// Write back: nothing on the file until it's pushed out.
+	CHECK(dev.writes == 0);
+	dev.sync();
+	CHECK(dev.writes == 1);
+
+	// With both data slots locked there's nowhere to put another block.
+	uint8_t *a = dev.lockBlock(10);
+	uint8_t *b = dev.lockBlock(11);
+	CHECK((a != NULL) && (b != NULL));
+	CHECK((dev.lockBlock(12) == NULL) && (errno == EBUSY));
+	dev.unlockBlock(10, false);
+	CHECK(dev.lockBlock(12) != NULL);
+	dev.unlockBlock(11, false);
+	dev.unlockBlock(12, false);
+}
+
+static void testFat() {
+	CachedBlockDevice<FileDevice, 512, 4, 2> dev(8192);
+	static char text[5000];
+	for (int i = 0; i < (int)sizeof(text); i++) {
+		text[i] = '0' + (i % 10);
+	}
+	{
+		Fat fs(dev);
+		CHECK(fs.format());
+		CHECK(fs.begin());
+		File f = fs.open("/cached.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f.write((const uint8_t *)text, sizeof(text)) == sizeof(text));
+	}
+	dev.sync();
+	{
+		Fat fs(dev);
+		CHECK(fs.begin());
+		File f = fs.open("/cached.txt", FILE_READ);
+		CHECK(f.length() == sizeof(text));
+		static char back[sizeof(text)];
+		CHECK(f.readBytes(back, sizeof(back)) == sizeof(back));
+		CHECK(memcmp(back, text, sizeof(text)) == 0);
+	}
+}
+
+int main() {
+	// No card or chip on the stub bus.
+	CHECK(!sd.initialize());
+	CHECK(flash.getSectorSize() > 0);
+	testCache();
+	testFat();
+	return testResult("cached");
+}
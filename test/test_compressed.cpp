@@ -0,0 +1,127 @@
+/*
+ * CompressedDevice and losing power: at random points the parent is copied
+ * as it stands and the copy mounted.  Every block has to read back as a
+ * version written since the last sync() - nothing committed may be lost.
+ */
+
+#include "test.h"
+
+#define SECTORS		400
+#define VERSIONS	32
+
+static uint8_t mem[4096 * 64];
+static uint8_t crash[4096 * 64];
+static uint8_t shadow[SECTORS * 512];
+
+// Hashes of what each block has held since the last sync()
+static uint32_t versions[SECTORS][VERSIONS];
+static uint8_t versionCount[SECTORS];
+
+static uint32_t hash(const uint8_t *p) {
+	uint32_t h = 2166136261UL;
+	for (int i = 0; i < 512; i++) {
+		h = (h ^ p[i]) * 16777619UL;
+	}
+	return h;
+}
+
+// Mostly log-like text that compresses well, some noise that doesn't,
+// and the odd block of zeros or one repeated byte.
+static void fill(uint8_t *b) {
+	int kind = rand() % 10;
+	if (kind < 5) {
+		int p = 0;
+		while (p < 512) {
+			char line[64];
+			int n = snprintf(line, sizeof(line), "%lu,temp=%d,ok\n", (unsigned long)rand() % 100000, rand() % 50);
+			for (int i = 0; (i < n) && (p < 512); i++) {
+				b[p++] = line[i];
+			}
+		}
+	} else if (kind < 8) {
+		for (int i = 0; i < 512; i++) {
+			b[i] = rand();
+		}
+	} else if (kind < 9) {
+		memset(b, 0, 512);
+	} else {
+		memset(b, rand(), 512);
+	}
+}
+
+static void synced(CompressedDevice &dev) {
+	dev.sync();
+	for (int i = 0; i < SECTORS; i++) {
+		versions[i][0] = hash(shadow + i * 512);
+		versionCount[i] = 1;
+	}
+}
+
+int main() {
+	srand(1);
+	memset(mem, 0xFF, sizeof(mem));
+	RamDisk ram(mem, 64, 4096);
+	CHECK(ram.initialize());
+
+	CompressedDevice dev(ram, SECTORS);
+	CHECK_ERRNO(dev.initialize(), ENODEV);
+	CHECK(dev.format());
+	synced(dev);
+
+	int checks = 0;
+	int damaged = 0;
+	for (int i = 0; i < 20000; i++) {
+		int b = rand() % SECTORS;
+		uint8_t buf[512];
+		fill(buf);
+		if (versionCount[b] == VERSIONS) {
+			synced(dev);
+		}
+		CHECK(dev.writeBlock(b, buf));
+		memcpy(shadow + b * 512, buf, 512);
+		versions[b][versionCount[b]++] = hash(buf);
+
+		if (rand() % 300 == 0) {
+			synced(dev);
+		}
+
+		if (rand() % 50 == 0) {
+			memcpy(crash, mem, sizeof(mem));
+			RamDisk lost(crash, 64, 4096);
+			CHECK(lost.initialize());
+			CompressedDevice after(lost, SECTORS);
+			CHECK(after.initialize());
+			checks++;
+			for (int j = 0; j < SECTORS; j++) {
+				uint8_t back[512];
+				bool found = false;
+				if (after.readBlock(j, back)) {
+					uint32_t h = hash(back);
+					for (int v = 0; v < versionCount[j]; v++) {
+						found = found || (versions[j][v] == h);
+					}
+				}
+				if (!found) {
+					damaged++;
+					break;
+				}
+			}
+		}
+	}
+	CHECK(checks > 100);
+	CHECK(damaged == 0);
+
+	// Everything is there after a clean remount, and a different size is
+	// refused rather than formatted over.
+	dev.sync();
+	CompressedDevice again(ram, SECTORS);
+	CHECK(again.initialize());
+	for (int j = 0; j < SECTORS; j++) {
+		uint8_t back[512];
+		CHECK(again.readBlock(j, back) && (memcmp(back, shadow + j * 512, 512) == 0));
+	}
+	CompressedDevice bigger(ram, SECTORS + 1);
+	CHECK_ERRNO(bigger.initialize(), EINVAL);
+
+	return testResult("compressed");
+}
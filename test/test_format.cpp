@@ -0,0 +1,62 @@
+/*
+ * format() picks FAT16 or FAT32 by the number of clusters the layout ends
+ * up with, so a PC mounting the volume agrees on the type.
+ */
+
+#include "test.h"
+
+// The type written in the boot block, and the cluster count it implies.
+static uint8_t layout(FileDevice &dev, uint32_t *clusters) {
+	uint8_t buffer[512];
+	struct bootblock *bb = (struct bootblock *)buffer;
+	dev.readBlock(0, buffer);
+	uint8_t type = (strncmp(bb->fstype_16, "FAT16", 5) == 0) ? 16 : 32;
+	uint32_t total = (bb->total_sectors != 0) ? bb->total_sectors : bb->total_sectors_16;
+	uint32_t spf = (type == 16) ? bb->sectors_per_fat : bb->sectors_per_fat_32;
+	uint32_t rootSectors = (bb->root_entries * 32 + 511) / 512;
+	*clusters = (total - bb->reserved_sectors - bb->fat_copies * spf - rootSectors) / bb->sectors_per_cluster;
+	return type;
+}
+
+static uint8_t formatAndUse(uint32_t sectors, uint8_t spc, uint32_t *clusters) {
+	FileDevice dev(sectors);
+	Fat fs(dev);
+	CHECK(fs.format(spc));
+	uint8_t type = layout(dev, clusters);
+	if (type == 16) {
+		CHECK(*clusters <= 65524);
+	} else {
+		CHECK(*clusters >= 65525);
+	}
+
+	CHECK(fs.begin());
+	{
+		File f = fs.open("/check.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f);
+		CHECK(f.write((const uint8_t *)"formatted", 9) == 9);
+	}
+	File f = fs.open("/check.txt", FILE_READ);
+	CHECK(f.length() == 9);
+	return type;
+}
+
+int main() {
+	uint32_t clusters;
+
+	// Small volumes stay FAT16.
+	CHECK(formatAndUse(8192, 0, &clusters) == 16);
+
+	// Just under 2GB used to come out as FAT16 with 65534 clusters.
+	CHECK(formatAndUse(0x7FFF0000UL / 512, 0, &clusters) == 32);
+
+	// Small clusters on a middling volume need FAT32.
+	CHECK(formatAndUse(131072, 1, &clusters) == 32);
+	CHECK(formatAndUse(2UL * 1024 * 1024, 8, &clusters) == 32);
+
+	// Big enough for 65525 FAT16 clusters, too small for FAT32's: FAT16,
+	// cut back to 65524.
+	CHECK(formatAndUse(66074, 1, &clusters) == 16);
+	CHECK(clusters == 65524);
+
+	return testResult("format");
+}
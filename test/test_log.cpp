@@ -0,0 +1,73 @@
+/*
+ * FILE_LOG files: whatever state the volume is caught in after a commit,
+ * the file's chain is exactly as long as its directory entry says, even
+ * though the log takes clusters a batch at a time.
+ */
+
+#include "test.h"
+
+static uint8_t disk[8192 * 512];
+static uint8_t copy[8192 * 512];
+
+// Mount a copy of the disk as it stands, as if the power had gone, and
+// check the log's chain against its size.
+static void checkCopy(uint32_t wantSize) {
+	memcpy(copy, disk, sizeof(copy));
+	RamDisk ram(copy, 8192);
+	Fat fs(ram);
+	CHECK(fs.begin());
+
+	File f = fs.open("/LOG.CSV", FILE_READ);
+	CHECK(f);
+	CHECK(f.length() == wantSize);
+
+	uint32_t cs = fs.getClusterSize();
+	uint32_t clusters = 0;
+	for (uint32_t c = fs.getInode("/LOG.CSV"); (c >= 2) && !fs.isEndOfChain(c); c = fs.getNextInode(c)) {
+		clusters++;
+	}
+	CHECK(clusters == (wantSize + cs - 1) / cs);
+}
+
+int main() {
+	RamDisk ram(disk, 8192);
+	Fat fs(ram);
+	CHECK(fs.format(1));
+	CHECK(fs.begin());
+
+	File log = fs.open("/LOG.CSV", FILE_WRITE | FILE_CREATE | FILE_LOG);
+	CHECK(log);
+	log.setLogCommit(0, 0, 4);
+
+	char record[64];
+	uint32_t size = 0;
+	for (int i = 0; i < 437; i++) {
+		int len = snprintf(record, sizeof(record), "%05d,2026-10-19 12:00:00,21.50,1013.25,48.2,ok,node\n", i);
+		CHECK(len == 53);
+		CHECK(log.write((const uint8_t *)record, len) == len);
+		size += len;
+		if ((i % 10) == 9) {
+			CHECK(log.commit());
+			checkCopy(size);
+		}
+	}
+	CHECK(log.commit());
+	checkCopy(size);
+	CHECK(size == 23161);
+
+	// Carrying on after a commit takes clusters again as it needs them.
+	for (int i = 0; i < 20; i++) {
+		CHECK(log.write((const uint8_t *)record, 53) == 53);
+		size += 53;
+	}
+	log.close();
+	checkCopy(size);
+
+	File back = fs.open("/LOG.CSV", FILE_READ);
+	CHECK(back.length() == size);
+	char line[54] = { 0 };
+	back.readBytes(line, 53);
+	CHECK(strncmp(line, "00000,", 6) == 0);
+
+	return testResult("log");
+}
@@ -0,0 +1,62 @@
+/*
+ * Path resolution: only directories can be walked through, and an empty
+ * file is never mistaken for the root.
+ */
+
+#include "test.h"
+
+static uint8_t disk[8192 * 512];
+
+int main() {
+	RamDisk ram(disk, 8192);
+	Fat fs(ram);
+	CHECK(fs.format());
+	CHECK(fs.begin());
+
+	const char *text = "These are my notes, and they had better stay that way.";
+	{
+		File f = fs.open("/notes.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f.write((const uint8_t *)text, strlen(text)) == strlen(text));
+		File e = fs.open("/empty.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(e);
+	}
+
+	// Files can't be used as directories, whether they have data or not.
+	File bad = fs.open("/notes.txt/oops.txt", FILE_WRITE | FILE_CREATE);
+	CHECK(!bad && (errno == ENOTDIR));
+	bad = fs.open("/empty.txt/x.txt", FILE_WRITE | FILE_CREATE);
+	CHECK(!bad && (errno == ENOTDIR));
+	bad = fs.open("/notes.txt/..", FILE_READ);
+	CHECK(!bad && (errno == ENOTDIR));
+
+	errno = 0;
+	CHECK((fs.getInode("/notes.txt/oops.txt") == 0) && (errno == ENOTDIR));
+	errno = 0;
+	CHECK((fs.getInode("/empty.txt/x.txt") == 0) && (errno == ENOTDIR));
+
+	struct fat_dir dir;
+	CHECK_ERRNO(fs.openDir("/notes.txt", &dir), ENOTDIR);
+	CHECK_ERRNO(fs.openDir("/empty.txt", &dir), ENOTDIR);
+
+	// Nothing got made in the root instead, and the notes are untouched.
+	errno = 0;
+	fs.getInode("/x.txt");
+	CHECK(errno == ENOENT);
+	errno = 0;
+	fs.getInode("/oops.txt");
+	CHECK(errno == ENOENT);
+
+	File f = fs.open("/./notes.txt", FILE_READ);
+	CHECK(f);
+	CHECK(f.length() == strlen(text));
+	char back[80] = { 0 };
+	f.readBytes(back, sizeof(back) - 1);
+	CHECK(strcmp(back, text) == 0);
+	f.close();
+
+	// The root itself is still a directory.
+	CHECK(fs.openDir("/", &dir));
+	CHECK(fs.openDir("/.", &dir));
+
+	return testResult("paths");
+}
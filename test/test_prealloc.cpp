@@ -0,0 +1,83 @@
+/*
+ * Preallocated files start on an erase unit of the physical device, however
+ * the volume is reached: through Fat's own partition, a PartitionDevice,
+ * or a range of blocks.
+ */
+
+#include "test.h"
+
+#define ERASE	8
+
+class EraseDevice : public FileDevice {
+public:
+	EraseDevice(size_t sectors) : FileDevice(sectors) {}
+	uint32_t getEraseSize() { return ERASE; }
+};
+
+// Where the file's first block is on the physical device.
+static uint32_t firstBlock(BlockDevice &vol, Fat &fs, const char *path) {
+	uint8_t buffer[512];
+	struct bootblock *bb = (struct bootblock *)buffer;
+	vol.readBlock(0, buffer);
+	uint32_t rootSectors = (bb->root_entries * 32 + 511) / 512;
+	uint32_t dataStart = bb->reserved_sectors + bb->fat_copies * bb->sectors_per_fat + rootSectors;
+	CHECK(bb->hidden_sectors_16 == vol.getBlockOffset());
+	uint32_t cluster = fs.getInode(path);
+	CHECK(cluster >= 2);
+	return vol.getBlockOffset() + dataStart + (cluster - 2) * bb->sectors_per_cluster;
+}
+
+static void check(BlockDevice &vol, Fat &fs) {
+	CHECK(fs.format(1));
+	CHECK(fs.begin());
+
+	// Something small first, so the free space doesn't start aligned.
+	{
+		File f = fs.open("/a.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f.write((const uint8_t *)"x", 1) == 1);
+	}
+	File f = fs.open("/capture.bin", FILE_WRITE | FILE_CREATE);
+	CHECK(f.preallocate(64UL * 1024, false));
+	f.close();
+	CHECK((firstBlock(vol, fs, "/capture.bin") % ERASE) == 0);
+}
+
+int main() {
+	EraseDevice dev(16384);
+	CHECK(dev.initialize());
+
+	// Two partitions, neither starting on an erase unit.
+	uint8_t mbr[512];
+	memset(mbr, 0, sizeof(mbr));
+	struct partition p[2];
+	memset(p, 0, sizeof(p));
+	p[0].type = 0x06;
+	p[0].lbastart = 63;
+	p[0].lbalength = 4000;
+	p[1].type = 0x06;
+	p[1].lbastart = 4067;
+	p[1].lbalength = 4000;
+	memcpy(mbr + 446, p, sizeof(p));
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+	CHECK(dev.writeSystemBlock(0, mbr));
+	dev.sync();
+	CHECK(dev.initialize());
+
+	Fat own(dev, 0);
+	PartitionDevice first(dev, (uint8_t)0);
+	CHECK(first.initialize());
+	check(first, own);
+
+	PartitionDevice second(dev, (uint8_t)1);
+	CHECK(second.initialize());
+	Fat mounted(second);
+	check(second, mounted);
+
+	PartitionDevice range(dev, 9001UL, 4000UL);
+	CHECK(range.initialize());
+	Fat ranged(range);
+	check(range, ranged);
+
+	return testResult("prealloc");
+}
@@ -0,0 +1,92 @@
+/*
+ * Short name aliases: each long name gets the lowest NAME~N.EXT that no
+ * other entry in the directory has.
+ */
+
+#include "test.h"
+
+static void alias(uint32_t n, uint8_t *out) {
+	char tail[8];
+	int tailLen = sprintf(tail, "~%lu", (unsigned long)n);
+	memset(out, ' ', 11);
+	memcpy(out, "DATAFI", min(6, 8 - tailLen));
+	memcpy(out + min(6, 8 - tailLen), tail, tailLen);
+	memcpy(out + 8, "CSV", 3);
+}
+
+int main() {
+	FileDevice dev(8192);
+	CHECK(dev.initialize());
+	Fat fs(dev);
+	CHECK(fs.format());
+	CHECK(fs.begin());
+
+	// A plain 8.3 name that looks like an alias already has ~2.
+	{
+		File f = fs.open("/DATAFI~2.CSV", FILE_WRITE | FILE_CREATE);
+		CHECK(f);
+	}
+
+	// Finding a free tail reads the directory once or twice, not once for
+	// every tail already used.
+	const int files = 150;
+	uint32_t lastReads = 0;
+	for (int i = 0; i < files; i++) {
+		char name[32];
+		sprintf(name, "/data file %03d.csv", i);
+		uint32_t before = dev.reads;
+		File f = fs.open(name, FILE_WRITE | FILE_CREATE);
+		CHECK(f);
+		CHECK(f.write((const uint8_t *)name, strlen(name)) == strlen(name));
+		f.close();
+		lastReads = dev.reads - before;
+	}
+	// The root is 32 blocks; a scan per tail would be thousands of reads.
+	CHECK(lastReads < 4 * 32);
+
+	// Every alias is there once, ~2 skipped, and each long name still
+	// finds its own file.
+	static bool seen[files + 2];
+	struct fat_dir dir;
+	struct fat_direntry entry;
+	CHECK(fs.openDir("/", &dir));
+	int count = 0;
+	while (fs.readDir(&dir, &entry)) {
+		if (strncmp(entry.name, "data file ", 10) != 0) {
+			continue;
+		}
+		count++;
+		bool found = false;
+		for (uint32_t n = 1; n <= files + 1; n++) {
+			uint8_t want[11];
+			alias(n, want);
+			if (memcmp(entry.shortName, want, 11) == 0) {
+				CHECK(!seen[n]);
+				seen[n] = true;
+				found = true;
+			}
+		}
+		CHECK(found);
+	}
+	CHECK(errno == 0);
+	CHECK(count == files);
+	CHECK(!seen[2]);
+	for (int n = 1; n <= files + 1; n++) {
+		CHECK(seen[n] || (n == 2));
+	}
+
+	for (int i = 0; i < files; i += 37) {
+		char name[32];
+		sprintf(name, "/data file %03d.csv", i);
+		File f = fs.open(name, FILE_READ);
+		CHECK(f);
+		char back[32] = { 0 };
+		f.readBytes(back, sizeof(back) - 1);
+		CHECK(strcmp(back, name) == 0);
+	}
+
+	File f = fs.open("/DATAF~10.CSV", FILE_READ);
+	CHECK(f);
+
+	return testResult("shortnames");
+}
@@ -0,0 +1,108 @@
+/*
+ * StripedDevice over file-backed members: block placement, multi-block
+ * transfers that cross stripes, and a FAT volume that survives a remount.
+ */
+
+#include "test.h"
+
+static void testPlacement() {
+	FileDevice a(100);
+	FileDevice b(90);
+	BlockDevice *members[] = { &a, &b };
+	StripedDevice stripe(members, 2, 4);
+
+	CHECK(stripe.initialize());
+	// Whole stripes of the smaller member only.
+	CHECK(stripe.getCapacity() == 176);
+
+	static uint8_t data[176 * 512];
+	for (int i = 0; i < 176; i++) {
+		memset(data + (i * 512), i, 512);
+	}
+	CHECK(stripe.writeBlocks(0, 176, data));
+
+	// Blocks 0-3 go to a, 4-7 to b, 8-11 to a again...
+	uint8_t block[512];
+	a.readBlocks(4, 1, block);
+	CHECK(block[0] == 8);
+	b.readBlocks(1, 1, block);
+	CHECK(block[0] == 5);
+	b.readBlocks(4, 1, block);
+	CHECK(block[0] == 12);
+
+	static uint8_t back[10 * 512];
+	CHECK(stripe.readBlocks(3, 10, back));
+	for (int i = 0; i < 10; i++) {
+		CHECK(back[i * 512] == 3 + i);
+	}
+
+	CHECK_ERRNO(stripe.readBlocks(170, 10, back), EINVAL);
+}
+
+static void testMembers() {
+	FileDevice *dev[STRIPE_MAX_MEMBERS + 1];
+	BlockDevice *members[STRIPE_MAX_MEMBERS + 1];
+	for (int i = 0; i <= STRIPE_MAX_MEMBERS; i++) {
+		dev[i] = new FileDevice(16);
+		members[i] = dev[i];
+	}
+
+	StripedDevice tooMany(members, STRIPE_MAX_MEMBERS + 1, 4);
+	CHECK_ERRNO(tooMany.initialize(), EINVAL);
+
+	StripedDevice full(members, STRIPE_MAX_MEMBERS, 4);
+	CHECK(full.initialize());
+	CHECK(full.getCapacity() == 16 * STRIPE_MAX_MEMBERS);
+
+	StripedDevice none(members, 0, 4);
+	CHECK_ERRNO(none.initialize(), ENODEV);
+
+	for (int i = 0; i <= STRIPE_MAX_MEMBERS; i++) {
+		delete dev[i];
+	}
+}
+
+static void testFat() {
+	FileDevice a(4096);
+	FileDevice b(4096);
+	BlockDevice *members[] = { &a, &b };
+	StripedDevice stripe(members, 2, 16);
+
+	static char text[20000];
+	for (int i = 0; i < (int)sizeof(text); i++) {
+		text[i] = 'a' + (i % 23);
+	}
+
+	{
+		Fat fs(stripe);
+		CHECK(fs.format());
+		CHECK(fs.begin());
+		File f = fs.open("/striped.txt", FILE_WRITE | FILE_CREATE);
+		CHECK(f);
+		CHECK(f.write((const uint8_t *)text, sizeof(text)) == sizeof(text));
+		f.close();
+		fs.sync();
+	}
+
+	// Both members took a share.
+	CHECK(a.writes > 0);
+	CHECK(b.writes > 0);
+
+	{
+		Fat fs(stripe);
+		CHECK(fs.begin());
+		File f = fs.open("/striped.txt", FILE_READ);
+		CHECK(f);
+		CHECK(f.length() == sizeof(text));
+		static char back[sizeof(text)];
+		CHECK(f.readBytes(back, sizeof(back)) == sizeof(back));
+		CHECK(memcmp(back, text, sizeof(text)) == 0);
+	}
+}
+
+int main() {
+	testPlacement();
+	testMembers();
+	testFat();
+	return testResult("striped");
+}